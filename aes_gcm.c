@@ -0,0 +1,427 @@
+/*
+ * AES-256-GCM.
+ *
+ * Portable path: T-table AES and 4-bit table GHASH. It is a fallback for
+ * non-x86 builds and old CPUs; like any table-driven AES it is not
+ * hardened against cache-timing attacks.
+ *
+ * x86 path: AES-NI for the cipher, four counter blocks in flight, and
+ * PCLMULQDQ for GHASH, folding four blocks per reduction with H^1..H^4.
+ * Compiled with target attributes and picked at runtime, so portable
+ * builds (-DODZ_PORTABLE=ON, universal macOS) still use it.
+ */
+
+#include <string.h>
+
+#include "aes_gcm.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GCM_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#include <cpuid.h>
+#define GCM_TARGET __attribute__((target("aes,pclmul,ssse3")))
+#else
+#include <intrin.h>
+#define GCM_TARGET
+#endif
+#endif
+
+static inline uint32_t bswap32(uint32_t x) {
+    return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+}
+
+static inline void wr_u32be(uint8_t *p, uint32_t x) {
+    p[0] = (uint8_t)(x >> 24); p[1] = (uint8_t)(x >> 16);
+    p[2] = (uint8_t)(x >> 8);  p[3] = (uint8_t)x;
+}
+
+static inline void wr_u64be(uint8_t *p, uint64_t x) {
+    wr_u32be(p, (uint32_t)(x >> 32));
+    wr_u32be(p + 4, (uint32_t)x);
+}
+
+static inline uint64_t rd_u64be(const uint8_t *p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) x = (x << 8) | p[i];
+    return x;
+}
+
+/* ── Portable AES-256 ──────────────────────────────────────── */
+
+static const uint8_t sbox[256] = {
+    0x63,0x7c,0x77,0x7b,0xf2,0x6b,0x6f,0xc5,0x30,0x01,0x67,0x2b,0xfe,0xd7,0xab,0x76,
+    0xca,0x82,0xc9,0x7d,0xfa,0x59,0x47,0xf0,0xad,0xd4,0xa2,0xaf,0x9c,0xa4,0x72,0xc0,
+    0xb7,0xfd,0x93,0x26,0x36,0x3f,0xf7,0xcc,0x34,0xa5,0xe5,0xf1,0x71,0xd8,0x31,0x15,
+    0x04,0xc7,0x23,0xc3,0x18,0x96,0x05,0x9a,0x07,0x12,0x80,0xe2,0xeb,0x27,0xb2,0x75,
+    0x09,0x83,0x2c,0x1a,0x1b,0x6e,0x5a,0xa0,0x52,0x3b,0xd6,0xb3,0x29,0xe3,0x2f,0x84,
+    0x53,0xd1,0x00,0xed,0x20,0xfc,0xb1,0x5b,0x6a,0xcb,0xbe,0x39,0x4a,0x4c,0x58,0xcf,
+    0xd0,0xef,0xaa,0xfb,0x43,0x4d,0x33,0x85,0x45,0xf9,0x02,0x7f,0x50,0x3c,0x9f,0xa8,
+    0x51,0xa3,0x40,0x8f,0x92,0x9d,0x38,0xf5,0xbc,0xb6,0xda,0x21,0x10,0xff,0xf3,0xd2,
+    0xcd,0x0c,0x13,0xec,0x5f,0x97,0x44,0x17,0xc4,0xa7,0x7e,0x3d,0x64,0x5d,0x19,0x73,
+    0x60,0x81,0x4f,0xdc,0x22,0x2a,0x90,0x88,0x46,0xee,0xb8,0x14,0xde,0x5e,0x0b,0xdb,
+    0xe0,0x32,0x3a,0x0a,0x49,0x06,0x24,0x5c,0xc2,0xd3,0xac,0x62,0x91,0x95,0xe4,0x79,
+    0xe7,0xc8,0x37,0x6d,0x8d,0xd5,0x4e,0xa9,0x6c,0x56,0xf4,0xea,0x65,0x7a,0xae,0x08,
+    0xba,0x78,0x25,0x2e,0x1c,0xa6,0xb4,0xc6,0xe8,0xdd,0x74,0x1f,0x4b,0xbd,0x8b,0x8a,
+    0x70,0x3e,0xb5,0x66,0x48,0x03,0xf6,0x0e,0x61,0x35,0x57,0xb9,0x86,0xc1,0x1d,0x9e,
+    0xe1,0xf8,0x98,0x11,0x69,0xd9,0x8e,0x94,0x9b,0x1e,0x87,0xe9,0xce,0x55,0x28,0xdf,
+    0x8c,0xa1,0x89,0x0d,0xbf,0xe6,0x42,0x68,0x41,0x99,0x2d,0x0f,0xb0,0x54,0xbb,0x16,
+};
+
+/* FIPS-197 key expansion. AES-NI takes the round keys in the same byte
+ * order, so both paths share it. */
+static void aes256_expand(uint8_t rk[15][16], const uint8_t key[32]) {
+    uint8_t *w = rk[0];
+    uint8_t rcon = 1;
+    memcpy(w, key, 32);
+    for (int i = 8; i < 60; i++) {
+        uint8_t t[4];
+        memcpy(t, w + 4 * (i - 1), 4);
+        if (i % 8 == 0) {
+            uint8_t t0 = t[0];
+            t[0] = sbox[t[1]] ^ rcon; t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];        t[3] = sbox[t0];
+            rcon = (uint8_t)((rcon << 1) ^ ((rcon >> 7) * 0x1b));
+        } else if (i % 8 == 4) {
+            for (int j = 0; j < 4; j++) t[j] = sbox[t[j]];
+        }
+        for (int j = 0; j < 4; j++) w[4 * i + j] = w[4 * (i - 8) + j] ^ t[j];
+    }
+}
+
+static inline uint8_t xtime(uint8_t x) {
+    return (uint8_t)((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+static inline uint32_t rotl32(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t rd_u32le(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* T-table: SubBytes + MixColumns for a row-0 byte, as a column with row 0
+ * in the low byte; rows 1-3 use it rotated. */
+static void aes_tables_sw(gcm_ctx_t *g) {
+    for (int x = 0; x < 256; x++) {
+        uint8_t s = sbox[x], s2 = xtime(s);
+        g->te[x] = (uint32_t)s2 | (uint32_t)s << 8 | (uint32_t)s << 16 | (uint32_t)(s2 ^ s) << 24;
+    }
+    for (int i = 0; i < 60; i++) g->rkw[i] = rd_u32le(g->rk[0] + 4 * i);
+}
+
+static void aes256_block_sw(const gcm_ctx_t *g, const uint8_t in[16], uint8_t out[16]) {
+    const uint32_t *rk = g->rkw, *te = g->te;
+    uint32_t w[4], t[4];
+    for (int c = 0; c < 4; c++) w[c] = rd_u32le(in + 4 * c) ^ rk[c];
+    for (int r = 1; r < 14; r++) {
+        /* Column c takes row r from column c + r (ShiftRows) */
+        for (int c = 0; c < 4; c++)
+            t[c] = te[w[c] & 0xFF]
+                 ^ rotl32(te[(w[(c + 1) & 3] >> 8) & 0xFF], 8)
+                 ^ rotl32(te[(w[(c + 2) & 3] >> 16) & 0xFF], 16)
+                 ^ rotl32(te[w[(c + 3) & 3] >> 24], 24)
+                 ^ rk[4 * r + c];
+        memcpy(w, t, sizeof w);
+    }
+    /* Last round: no MixColumns */
+    for (int c = 0; c < 4; c++) {
+        uint32_t v = (uint32_t)sbox[w[c] & 0xFF]
+                   | (uint32_t)sbox[(w[(c + 1) & 3] >> 8) & 0xFF] << 8
+                   | (uint32_t)sbox[(w[(c + 2) & 3] >> 16) & 0xFF] << 16
+                   | (uint32_t)sbox[w[(c + 3) & 3] >> 24] << 24;
+        v ^= rk[56 + c];
+        out[4 * c] = (uint8_t)v;             out[4 * c + 1] = (uint8_t)(v >> 8);
+        out[4 * c + 2] = (uint8_t)(v >> 16); out[4 * c + 3] = (uint8_t)(v >> 24);
+    }
+}
+
+/* ── Portable GHASH / CTR ──────────────────────────────────── */
+
+/* GHASH four bits at a time (Shoup's method): htab[i] = i * H, with the
+ * four bits read most significant first, and rem4[] folding the bits
+ * shifted out back in. */
+static const uint64_t rem4[16] = {
+    0x0000ull << 48, 0x1C20ull << 48, 0x3840ull << 48, 0x2460ull << 48,
+    0x7080ull << 48, 0x6CA0ull << 48, 0x48C0ull << 48, 0x54E0ull << 48,
+    0xE100ull << 48, 0xFD20ull << 48, 0xD940ull << 48, 0xC560ull << 48,
+    0x9180ull << 48, 0x8DA0ull << 48, 0xA9C0ull << 48, 0xB5E0ull << 48,
+};
+
+static void ghash_tables_sw(gcm_ctx_t *g) {
+    uint64_t vh = rd_u64be(g->h), vl = rd_u64be(g->h + 8);
+    memset(g->htab, 0, sizeof g->htab);
+    for (int i = 8; i > 0; i >>= 1) {
+        g->htab[i][0] = vh;
+        g->htab[i][1] = vl;
+        uint64_t t = 0xE100000000000000ull & (0 - (vl & 1));
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ t;
+    }
+    for (int i = 2; i < 16; i <<= 1)
+        for (int j = 1; j < i; j++) {
+            g->htab[i + j][0] = g->htab[i][0] ^ g->htab[j][0];
+            g->htab[i + j][1] = g->htab[i][1] ^ g->htab[j][1];
+        }
+}
+
+/* x = x * H */
+static void gf_mul_sw(const gcm_ctx_t *g, uint8_t x[16]) {
+    uint64_t zh = 0, zl = 0;
+    for (int i = 15; i >= 0; i--) {
+        for (int half = 0; half < 2; half++) {
+            int nib = half ? x[i] >> 4 : x[i] & 0xF;
+            if (i != 15 || half) {
+                uint64_t rem = zl & 0xF;
+                zl = (zh << 60) | (zl >> 4);
+                zh = (zh >> 4) ^ rem4[rem];
+            }
+            zh ^= g->htab[nib][0];
+            zl ^= g->htab[nib][1];
+        }
+    }
+    wr_u64be(x, zh);
+    wr_u64be(x + 8, zl);
+}
+
+static void ghash_sw(const gcm_ctx_t *g, uint8_t x[16], const uint8_t *p, size_t n) {
+    while (n > 0) {
+        size_t k = n < 16 ? n : 16;
+        for (size_t i = 0; i < k; i++) x[i] ^= p[i];   /* short tail: zero-padded */
+        gf_mul_sw(g, x);
+        p += k;
+        n -= k;
+    }
+}
+
+/* Counter block: nonce || ctr (big-endian) */
+static void ctr_sw(const gcm_ctx_t *g, const uint8_t nonce[12], uint32_t ctr,
+                   const uint8_t *in, uint8_t *out, size_t n) {
+    uint8_t cb[16], ks[16];
+    memcpy(cb, nonce, 12);
+    while (n > 0) {
+        wr_u32be(cb + 12, ctr++);
+        aes256_block_sw(g, cb, ks);
+        size_t k = n < 16 ? n : 16;
+        for (size_t i = 0; i < k; i++) out[i] = in[i] ^ ks[i];
+        in += k;
+        out += k;
+        n -= k;
+    }
+}
+
+/* ── x86: AES-NI + PCLMULQDQ ───────────────────────────────── */
+
+#ifdef GCM_X86
+
+static int cpu_has_aes_clmul(void) {
+    unsigned int a, b, c, d;
+#if defined(__GNUC__) || defined(__clang__)
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+#else
+    int r[4];
+    __cpuid(r, 1);
+    a = (unsigned)r[0]; b = (unsigned)r[1]; c = (unsigned)r[2]; d = (unsigned)r[3];
+#endif
+    (void)a; (void)b; (void)d;
+    /* AES-NI (ECX 25), PCLMULQDQ (ECX 1), SSSE3 for pshufb (ECX 9) */
+    return (c >> 25 & 1) && (c >> 1 & 1) && (c >> 9 & 1);
+}
+
+/* GHASH works on byte-reflected blocks, so a 128-bit carry-less multiply
+ * plus a shift and a reduction gives the field product directly. */
+GCM_TARGET static inline __m128i bswap128(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15));
+}
+
+/* 256-bit carry-less product a * b into (lo, hi), accumulated */
+GCM_TARGET static inline void clmul_acc(__m128i a, __m128i b, __m128i *lo, __m128i *hi) {
+    __m128i t0 = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i t1 = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                               _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i t2 = _mm_clmulepi64_si128(a, b, 0x11);
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(t0, _mm_slli_si128(t1, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(t2, _mm_srli_si128(t1, 8)));
+}
+
+/* Shift the reflected product left by one and reduce modulo
+ * x^128 + x^7 + x^2 + x + 1 */
+GCM_TARGET static inline __m128i gf_reduce(__m128i lo, __m128i hi) {
+    __m128i c_lo = _mm_srli_epi32(lo, 31), c_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    hi = _mm_or_si128(hi, _mm_srli_si128(c_lo, 12));
+    hi = _mm_or_si128(hi, _mm_slli_si128(c_hi, 4));
+    lo = _mm_or_si128(lo, _mm_slli_si128(c_lo, 4));
+
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                              _mm_slli_epi32(lo, 25));
+    __m128i a_hi = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    __m128i b = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                              _mm_srli_epi32(lo, 7));
+    b = _mm_xor_si128(b, a_hi);
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, b));
+}
+
+GCM_TARGET static __m128i gf_mul_hw(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    clmul_acc(a, b, &lo, &hi);
+    return gf_reduce(lo, hi);
+}
+
+GCM_TARGET static void gcm_init_hw(gcm_ctx_t *g) {
+    __m128i h = bswap128(_mm_loadu_si128((const __m128i *)g->h));
+    __m128i p = h;
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *)g->hpow[i], p);
+        p = gf_mul_hw(p, h);
+    }
+}
+
+GCM_TARGET static void ghash_hw(const gcm_ctx_t *g, uint8_t x[16], const uint8_t *p, size_t n) {
+    __m128i h1 = _mm_loadu_si128((const __m128i *)g->hpow[0]);
+    __m128i h2 = _mm_loadu_si128((const __m128i *)g->hpow[1]);
+    __m128i h3 = _mm_loadu_si128((const __m128i *)g->hpow[2]);
+    __m128i h4 = _mm_loadu_si128((const __m128i *)g->hpow[3]);
+    __m128i y = bswap128(_mm_loadu_si128((const __m128i *)x));
+
+    /* Y' = (Y + C0) H^4 + C1 H^3 + C2 H^2 + C3 H, one reduction */
+    for (; n >= 64; p += 64, n -= 64) {
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        __m128i c0 = bswap128(_mm_loadu_si128((const __m128i *)p));
+        __m128i c1 = bswap128(_mm_loadu_si128((const __m128i *)(p + 16)));
+        __m128i c2 = bswap128(_mm_loadu_si128((const __m128i *)(p + 32)));
+        __m128i c3 = bswap128(_mm_loadu_si128((const __m128i *)(p + 48)));
+        clmul_acc(_mm_xor_si128(y, c0), h4, &lo, &hi);
+        clmul_acc(c1, h3, &lo, &hi);
+        clmul_acc(c2, h2, &lo, &hi);
+        clmul_acc(c3, h1, &lo, &hi);
+        y = gf_reduce(lo, hi);
+    }
+    for (; n > 0; ) {
+        uint8_t blk[16] = {0};
+        size_t k = n < 16 ? n : 16;
+        memcpy(blk, p, k);
+        y = gf_mul_hw(_mm_xor_si128(y, bswap128(_mm_loadu_si128((const __m128i *)blk))), h1);
+        p += k;
+        n -= k;
+    }
+    _mm_storeu_si128((__m128i *)x, bswap128(y));
+}
+
+GCM_TARGET static inline __m128i aes_enc_hw(const __m128i *k, __m128i b) {
+    b = _mm_xor_si128(b, k[0]);
+    for (int r = 1; r < 14; r++) b = _mm_aesenc_si128(b, k[r]);
+    return _mm_aesenclast_si128(b, k[14]);
+}
+
+GCM_TARGET static void ctr_hw(const gcm_ctx_t *g, const uint8_t nonce[12], uint32_t ctr,
+                              const uint8_t *in, uint8_t *out, size_t n) {
+    __m128i k[15];
+    for (int r = 0; r < 15; r++) k[r] = _mm_loadu_si128((const __m128i *)g->rk[r]);
+    int n0, n1, n2;
+    memcpy(&n0, nonce, 4);
+    memcpy(&n1, nonce + 4, 4);
+    memcpy(&n2, nonce + 8, 4);
+#define CTR_BLOCK(c) _mm_set_epi32((int)bswap32(c), n2, n1, n0)
+
+    /* Four independent blocks keep the AES units busy */
+    for (; n >= 64; in += 64, out += 64, n -= 64, ctr += 4) {
+        __m128i b0 = _mm_xor_si128(CTR_BLOCK(ctr),     k[0]);
+        __m128i b1 = _mm_xor_si128(CTR_BLOCK(ctr + 1), k[0]);
+        __m128i b2 = _mm_xor_si128(CTR_BLOCK(ctr + 2), k[0]);
+        __m128i b3 = _mm_xor_si128(CTR_BLOCK(ctr + 3), k[0]);
+        for (int r = 1; r < 14; r++) {
+            b0 = _mm_aesenc_si128(b0, k[r]);
+            b1 = _mm_aesenc_si128(b1, k[r]);
+            b2 = _mm_aesenc_si128(b2, k[r]);
+            b3 = _mm_aesenc_si128(b3, k[r]);
+        }
+        b0 = _mm_aesenclast_si128(b0, k[14]);
+        b1 = _mm_aesenclast_si128(b1, k[14]);
+        b2 = _mm_aesenclast_si128(b2, k[14]);
+        b3 = _mm_aesenclast_si128(b3, k[14]);
+        _mm_storeu_si128((__m128i *)out,        _mm_xor_si128(b0, _mm_loadu_si128((const __m128i *)in)));
+        _mm_storeu_si128((__m128i *)(out + 16), _mm_xor_si128(b1, _mm_loadu_si128((const __m128i *)(in + 16))));
+        _mm_storeu_si128((__m128i *)(out + 32), _mm_xor_si128(b2, _mm_loadu_si128((const __m128i *)(in + 32))));
+        _mm_storeu_si128((__m128i *)(out + 48), _mm_xor_si128(b3, _mm_loadu_si128((const __m128i *)(in + 48))));
+    }
+    for (; n > 0; ctr++) {
+        uint8_t ks[16];
+        _mm_storeu_si128((__m128i *)ks, aes_enc_hw(k, CTR_BLOCK(ctr)));
+        size_t m = n < 16 ? n : 16;
+        for (size_t i = 0; i < m; i++) out[i] = in[i] ^ ks[i];
+        in += m;
+        out += m;
+        n -= m;
+    }
+#undef CTR_BLOCK
+}
+
+#endif /* GCM_X86 */
+
+/* ── Dispatch ──────────────────────────────────────────────── */
+
+static void ghash(const gcm_ctx_t *g, uint8_t x[16], const uint8_t *p, size_t n) {
+#ifdef GCM_X86
+    if (g->hw) { ghash_hw(g, x, p, n); return; }
+#endif
+    ghash_sw(g, x, p, n);
+}
+
+static void ctr_xor(const gcm_ctx_t *g, const uint8_t nonce[12], uint32_t ctr,
+                    const uint8_t *in, uint8_t *out, size_t n) {
+#ifdef GCM_X86
+    if (g->hw) { ctr_hw(g, nonce, ctr, in, out, n); return; }
+#endif
+    ctr_sw(g, nonce, ctr, in, out, n);
+}
+
+void gcm_init(gcm_ctx_t *g, const uint8_t key[GCM_KEY_SIZE]) {
+    static const uint8_t zero[16] = {0};
+    memset(g, 0, sizeof *g);
+    aes256_expand(g->rk, key);
+    aes_tables_sw(g);
+    aes256_block_sw(g, zero, g->h);
+    ghash_tables_sw(g);
+#ifdef GCM_X86
+    g->hw = cpu_has_aes_clmul();
+    if (g->hw) gcm_init_hw(g);
+#endif
+}
+
+/* Tag = E_K(nonce || 1) ^ GHASH(aad, ct, lengths) */
+static void gcm_tag(const gcm_ctx_t *g, const uint8_t nonce[12],
+                    const uint8_t *aad, size_t aad_len,
+                    const uint8_t *ct, size_t n, uint8_t tag[16]) {
+    uint8_t x[16] = {0}, len[16];
+    ghash(g, x, aad, aad_len);
+    ghash(g, x, ct, n);
+    wr_u64be(len, (uint64_t)aad_len * 8);
+    wr_u64be(len + 8, (uint64_t)n * 8);
+    ghash(g, x, len, 16);
+    ctr_xor(g, nonce, 1, x, tag, 16);   /* x ^ E_K(J0) */
+}
+
+void gcm_seal(const gcm_ctx_t *g, const uint8_t nonce[GCM_NONCE_SIZE],
+              const uint8_t *aad, size_t aad_len,
+              const uint8_t *in, uint8_t *out, size_t n,
+              uint8_t tag[GCM_TAG_SIZE]) {
+    ctr_xor(g, nonce, 2, in, out, n);
+    gcm_tag(g, nonce, aad, aad_len, out, n, tag);
+}
+
+int gcm_open(const gcm_ctx_t *g, const uint8_t nonce[GCM_NONCE_SIZE],
+             const uint8_t *aad, size_t aad_len,
+             const uint8_t *in, uint8_t *out, size_t n,
+             const uint8_t tag[GCM_TAG_SIZE]) {
+    uint8_t want[16];
+    gcm_tag(g, nonce, aad, aad_len, in, n, want);
+    uint8_t diff = 0;
+    for (int i = 0; i < 16; i++) diff |= want[i] ^ tag[i];
+    if (diff) return -1;
+    ctr_xor(g, nonce, 2, in, out, n);
+    return 0;
+}
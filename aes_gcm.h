@@ -0,0 +1,46 @@
+#ifndef AES_GCM_H
+#define AES_GCM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * AES-256-GCM (NIST SP 800-38D) with 96-bit nonces and 128-bit tags.
+ *
+ * AES-NI + PCLMULQDQ are used when the CPU has them (checked once, at
+ * init); otherwise a portable C implementation. Both give identical output.
+ */
+
+#define GCM_KEY_SIZE    32
+#define GCM_NONCE_SIZE  12
+#define GCM_TAG_SIZE    16
+
+typedef struct {
+    uint8_t rk[15][16];     /* AES-256 round keys */
+    uint8_t h[16];          /* hash key E_K(0^128) */
+    uint8_t hpow[4][16];    /* H^1..H^4, byte-reflected (hardware path only) */
+    int     hw;             /* 1: AES-NI + PCLMULQDQ */
+    /* portable path */
+    uint32_t rkw[60];       /* round keys as little-endian columns */
+    uint32_t te[256];       /* AES T-table */
+    uint64_t htab[16][2];   /* 4-bit GHASH multiples of H */
+} gcm_ctx_t;
+
+void gcm_init(gcm_ctx_t *g, const uint8_t key[GCM_KEY_SIZE]);
+
+/* Encrypt in[0..n) to out (may be the same buffer) and compute the tag
+ * over aad and the ciphertext. */
+void gcm_seal(const gcm_ctx_t *g, const uint8_t nonce[GCM_NONCE_SIZE],
+              const uint8_t *aad, size_t aad_len,
+              const uint8_t *in, uint8_t *out, size_t n,
+              uint8_t tag[GCM_TAG_SIZE]);
+
+/* Check the tag, then decrypt in[0..n) to out (may be the same buffer).
+ * Nothing is written to out unless the tag matches.
+ * Returns 0 on success, -1 on authentication failure. */
+int  gcm_open(const gcm_ctx_t *g, const uint8_t nonce[GCM_NONCE_SIZE],
+              const uint8_t *aad, size_t aad_len,
+              const uint8_t *in, uint8_t *out, size_t n,
+              const uint8_t tag[GCM_TAG_SIZE]);
+
+#endif
@@ -0,0 +1,215 @@
+#include "ans.h"
+#include <string.h>
+
+/* Position of the highest set bit of x (> 0) */
+static int highbit(uint32_t x) {
+    int b = 0;
+    while (x >>= 1) b++;
+    return b;
+}
+
+/* log2(x) for x >= 1, in 1/256 bits */
+static uint32_t log2_q8(uint32_t x) {
+    int hb = highbit(x);
+    uint64_t m = ((uint64_t)x << 16) >> hb;     /* x / 2^hb in Q16: [1, 2) */
+    uint32_t frac = 0;
+    for (int i = 7; i >= 0; i--) {
+        m = (m * m) >> 16;
+        if (m >= (2u << 16)) {
+            m >>= 1;
+            frac |= 1u << i;
+        }
+    }
+    return (uint32_t)hb << 8 | frac;
+}
+
+int ans_table_log(const uint32_t *freq, int nsym, int max_log) {
+    uint32_t total = 0;
+    int used = 0, last = 0;
+    for (int s = 0; s < nsym; s++) {
+        if (!freq[s]) continue;
+        total += freq[s];
+        used++;
+        last = s;
+    }
+    if (total < 2) return ANS_MIN_TABLE_LOG;
+
+    /* A quarter of a state per occurrence is all the precision worth
+     * paying for, but keep enough to tell the symbols apart */
+    int tl = max_log;
+    if (tl > highbit(total - 1) - 2) tl = highbit(total - 1) - 2;
+    int lo = highbit(total) + 1;
+    if (lo > highbit((uint32_t)last) + 2) lo = highbit((uint32_t)last) + 2;
+    if (tl < lo) tl = lo;
+    if (tl < ANS_MIN_TABLE_LOG) tl = ANS_MIN_TABLE_LOG;
+    while ((1 << tl) < used) tl++;
+    return tl > ANS_MAX_TABLE_LOG ? ANS_MAX_TABLE_LOG : tl;
+}
+
+int ans_normalize(const uint32_t *freq, int nsym, int table_log, uint16_t *norm) {
+    uint64_t total = 0;
+    for (int s = 0; s < nsym; s++) total += freq[s];
+    if (total == 0) return -1;
+
+    const uint32_t scale = 1u << table_log;
+    int64_t sum = 0;
+    int largest = 0;
+    for (int s = 0; s < nsym; s++) {
+        norm[s] = 0;
+        if (!freq[s]) continue;
+        uint64_t n = ((uint64_t)freq[s] * scale + total / 2) / total;
+        norm[s] = (uint16_t)(n ? n : 1);
+        sum += norm[s];
+        if (freq[s] > freq[largest]) largest = s;
+    }
+
+    /* Rounding (and the minimum of 1) leaves the sum a little off: the
+     * most common symbols, where a count matters least, make it up */
+    int64_t diff = (int64_t)scale - sum;
+    if (diff > 0) norm[largest] = (uint16_t)(norm[largest] + diff);
+    while (diff < 0) {
+        int big = 0;
+        for (int s = 1; s < nsym; s++)
+            if (norm[s] > norm[big]) big = s;
+        int64_t take = norm[big] / 8;
+        if (take < 1) take = 1;
+        if (take > -diff) take = -diff;
+        if (take > norm[big] - 1) take = norm[big] - 1;
+        if (take <= 0) return -1;   /* more symbols than states */
+        norm[big] = (uint16_t)(norm[big] - take);
+        diff += take;
+    }
+    return 0;
+}
+
+uint64_t ans_cost(const uint32_t *freq, const uint16_t *norm, int nsym, int table_log) {
+    uint64_t q8 = 0;
+    for (int s = 0; s < nsym; s++) {
+        if (!freq[s]) continue;
+        if (!norm[s]) return UINT64_MAX;    /* can't be coded */
+        q8 += (uint64_t)freq[s] * (((uint32_t)table_log << 8) - log2_q8(norm[s]));
+    }
+    return (q8 + 255) >> 8;
+}
+
+/* Counts: table_log - ANS_MIN_TABLE_LOG (3 bits), then each symbol's
+ * count in just enough bits for the states still unassigned, until none
+ * are left. A zero count is followed by the number of further zeros, in
+ * 2-bit pieces that continue while they're 3. */
+#define ZRUN_BITS  2
+#define ZRUN_MORE  3
+
+int ans_write_counts(bit_writer_t *bw, const uint16_t *norm, int nsym, int table_log) {
+    int bits = 3;
+    if (bw && bw_write(bw, (uint32_t)(table_log - ANS_MIN_TABLE_LOG), 3) != 0) return -1;
+    uint32_t remaining = 1u << table_log;
+    for (int s = 0; s < nsym && remaining > 0; s++) {
+        int nb = highbit(remaining) + 1;
+        bits += nb;
+        if (bw && bw_write(bw, norm[s], nb) != 0) return -1;
+        remaining -= norm[s];
+        if (norm[s]) continue;
+
+        int run = 0;
+        while (s + 1 + run < nsym && !norm[s + 1 + run]) run++;
+        s += run;
+        for (;;) {
+            int piece = run < ZRUN_MORE ? run : ZRUN_MORE;
+            bits += ZRUN_BITS;
+            if (bw && bw_write(bw, (uint32_t)piece, ZRUN_BITS) != 0) return -1;
+            if (piece < ZRUN_MORE) break;
+            run -= ZRUN_MORE;
+        }
+    }
+    return bits;
+}
+
+int ans_read_counts(bit_reader_t *br, uint16_t *norm, int nsym, int *table_log) {
+    int tl = ANS_MIN_TABLE_LOG + (int)br_read(br, 3);
+    if (tl > ANS_MAX_TABLE_LOG) return -1;
+    memset(norm, 0, (size_t)nsym * sizeof *norm);
+    uint32_t remaining = 1u << tl;
+    for (int s = 0; remaining > 0; s++) {
+        if (s >= nsym) return -1;
+        uint32_t n = br_read(br, highbit(remaining) + 1);
+        if (n > remaining) return -1;
+        norm[s] = (uint16_t)n;
+        remaining -= n;
+        if (n) continue;
+
+        uint32_t piece;
+        do {
+            piece = br_read(br, ZRUN_BITS);
+            s += (int)piece;
+        } while (piece == ZRUN_MORE && s < nsym);
+    }
+    *table_log = tl;
+    return 0;
+}
+
+/* Deal the states out to the symbols, count[s] each, with a step that
+ * visits every state once and scatters each symbol's states over the
+ * table */
+static void spread(uint16_t *sym_of, const uint16_t *norm, int nsym, int table_log) {
+    const uint32_t size = 1u << table_log, mask = size - 1;
+    const uint32_t step = (size >> 1) + (size >> 3) + 3;
+    uint32_t pos = 0;
+    for (int s = 0; s < nsym; s++) {
+        for (uint32_t i = 0; i < norm[s]; i++) {
+            sym_of[pos] = (uint16_t)s;
+            pos = (pos + step) & mask;
+        }
+    }
+}
+
+void ans_build_enc(ans_enc_t *e, const uint16_t *norm, int nsym, int table_log) {
+    const uint32_t size = 1u << table_log;
+    uint16_t sym_of[1 << ANS_MAX_TABLE_LOG];
+    uint32_t start[ANS_MAX_SYMS];
+    spread(sym_of, norm, nsym, table_log);
+    e->table_log = table_log;
+
+    uint32_t total = 0;
+    for (int s = 0; s < nsym; s++) {
+        uint32_t c = norm[s];
+        start[s] = total;
+        if (c == 0) {
+            e->delta_nbits[s] = 0;
+            e->delta_find[s] = 0;
+            continue;
+        }
+        /* States x in [size, 2 * size) shift down into [c, 2c) */
+        int max_out = c == 1 ? table_log : table_log - highbit(c - 1);
+        e->delta_nbits[s] = (int32_t)(((uint32_t)max_out << 16) - (c << max_out));
+        e->delta_find[s] = (int32_t)total - (int32_t)c;
+        total += c;
+    }
+    for (uint32_t u = 0; u < size; u++)
+        e->next[start[sym_of[u]]++] = (uint16_t)(size + u);
+}
+
+void ans_build_dec(ans_dec_t *dec, const uint16_t *norm, int nsym, int table_log) {
+    const uint32_t size = 1u << table_log;
+    uint16_t sym_of[1 << ANS_MAX_TABLE_LOG];
+    uint32_t next[ANS_MAX_SYMS];
+    spread(sym_of, norm, nsym, table_log);
+    for (int s = 0; s < nsym; s++) next[s] = norm[s];
+
+    for (uint32_t u = 0; u < size; u++) {
+        int s = sym_of[u];
+        uint32_t x = next[s]++;
+        int nb = table_log - highbit(x);
+        dec[u].sym = (uint16_t)s;
+        dec[u].nbits = (uint8_t)nb;
+        dec[u].base = (uint16_t)((x << nb) - size);
+    }
+}
+
+int ans_reader_init(ans_reader_t *r, const uint8_t *buf, size_t len) {
+    if (len == 0 || buf[len - 1] == 0) return -1;
+    r->buf = buf;
+    r->len = len;
+    r->pos = (uint64_t)(len - 1) * 8 + (uint64_t)highbit(buf[len - 1]);
+    r->bad = 0;
+    return 0;
+}
@@ -0,0 +1,129 @@
+#ifndef ANS_H
+#define ANS_H
+#include <stdint.h>
+#include <stddef.h>
+#include "bitstream.h"
+
+/*
+ * Table-based ANS (tANS / FSE) entropy coder.
+ *
+ * A symbol's share of the 2^table_log states is its normalized count, so
+ * it costs log2(2^table_log / count) bits: fractions of a bit, where a
+ * Huffman code needs a whole one. The decoder is one table lookup per
+ * symbol plus a read of that entry's few new-state bits.
+ *
+ * The encoder runs backwards over the symbols and the decoder reads the
+ * bits backwards: ans_write_* fill an ordinary bit_writer_t, which ends
+ * with a 1 bit after the last state, and ans_reader_t reads it from the
+ * end.
+ */
+
+#define ANS_MIN_TABLE_LOG  5
+#define ANS_MAX_TABLE_LOG  12
+#define ANS_MAX_SYMS       288
+
+/* Decode table entry: state → symbol, then the next state is
+ * base + the next nbits bits */
+typedef struct {
+    uint16_t sym;
+    uint16_t base;
+    uint8_t  nbits;
+} ans_dec_t;
+
+/* Encoding tables of one alphabet */
+typedef struct {
+    int      table_log;
+    int32_t  delta_nbits[ANS_MAX_SYMS];     /* (bits out << 16) - state bound */
+    int32_t  delta_find[ANS_MAX_SYMS];      /* symbol's start in next[] - count */
+    uint16_t next[1 << ANS_MAX_TABLE_LOG];  /* states by symbol, in order */
+} ans_enc_t;
+
+/* Table size for a block with these counts, up to max_log: smaller for
+ * small blocks, large enough for every symbol present */
+int      ans_table_log(const uint32_t *freq, int nsym, int max_log);
+
+/* Scale freq to counts summing to 1 << table_log, every symbol present
+ * keeping at least 1. Returns 0, or -1 if no symbol is present. */
+int      ans_normalize(const uint32_t *freq, int nsym, int table_log, uint16_t *norm);
+
+/* Bits freq costs coded with norm, rounded up */
+uint64_t ans_cost(const uint32_t *freq, const uint16_t *norm, int nsym, int table_log);
+
+/* Write table_log and the counts (bw NULL: just count the bits).
+ * Returns the number of bits, or -1 if out of memory. */
+int      ans_write_counts(bit_writer_t *bw, const uint16_t *norm, int nsym, int table_log);
+
+/* Read what ans_write_counts wrote. Returns 0, or -1 on corrupt data. */
+int      ans_read_counts(bit_reader_t *br, uint16_t *norm, int nsym, int *table_log);
+
+void     ans_build_enc(ans_enc_t *e, const uint16_t *norm, int nsym, int table_log);
+/* dec has 1 << table_log entries */
+void     ans_build_dec(ans_dec_t *dec, const uint16_t *norm, int nsym, int table_log);
+
+/* ── Encoder ───────────────────────────────────────────────── */
+
+/* A fresh state; states run from 1 << table_log to twice that */
+static inline uint32_t ans_init_state(const ans_enc_t *e) {
+    return 1u << e->table_log;
+}
+
+/* Push sym: writes the low bits of *state the decoder needs to get back */
+static inline int ans_put(bit_writer_t *bw, const ans_enc_t *e, uint32_t *state, int sym) {
+    uint32_t nb = (*state + (uint32_t)e->delta_nbits[sym]) >> 16;
+    if (bw_write(bw, *state & ((1u << nb) - 1), (int)nb) != 0) return -1;
+    *state = e->next[(*state >> nb) + (uint32_t)e->delta_find[sym]];
+    return 0;
+}
+
+/* The final state, which the decoder starts from */
+static inline int ans_flush_state(bit_writer_t *bw, const ans_enc_t *e, uint32_t state) {
+    return bw_write(bw, state - (1u << e->table_log), e->table_log);
+}
+
+/* End the stream: the marker bit the reader finds the end by, padded */
+static inline int ans_finish(bit_writer_t *bw) {
+    if (bw_write(bw, 1, 1) != 0) return -1;
+    return bw_flush(bw);
+}
+
+/* ── Backward bit reader ───────────────────────────────────── */
+
+typedef struct {
+    const uint8_t *buf;
+    size_t         len;
+    uint64_t       pos;     /* bits left to read, below the marker */
+    int            bad;     /* read past the start */
+} ans_reader_t;
+
+/* Returns 0, or -1 if buf[0..len) doesn't end with a marker */
+int ans_reader_init(ans_reader_t *r, const uint8_t *buf, size_t len);
+
+/* The n (<= 32) bits below the last ones read */
+static inline uint32_t ans_read(ans_reader_t *r, int n) {
+    if ((uint64_t)n > r->pos) {
+        r->bad = 1;
+        r->pos = 0;
+        return 0;
+    }
+    r->pos -= (uint64_t)n;
+    size_t byte = (size_t)(r->pos >> 3);
+    uint64_t v = 0;
+    if (byte + 8 <= r->len) {
+        const uint8_t *p = r->buf + byte;
+        v = (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+            (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+            (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+    } else {
+        for (size_t i = byte; i < r->len; i++) v |= (uint64_t)r->buf[i] << ((i - byte) * 8);
+    }
+    return (uint32_t)(v >> (r->pos & 7)) & (uint32_t)(((uint64_t)1 << n) - 1);
+}
+
+/* Decode one symbol and move *state on */
+static inline int ans_get(ans_reader_t *r, const ans_dec_t *dec, uint32_t *state) {
+    ans_dec_t e = dec[*state];
+    *state = e.base + ans_read(r, e.nbits);
+    return e.sym;
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Batch API: compress or decompress many independent buffers in one call.
+ *
+ * Each thread owns one context and pulls the next item from a shared
+ * counter, so buffer allocation and table setup are paid once per thread
+ * instead of once per item, and there is no FILE plumbing at all.
+ */
+
+#include <stdlib.h>
+
+#include "libodzip.h"
+#include "odz.h"
+#include "odz_thread.h"
+
+typedef struct {
+    int                  compress;
+    const odz_in_span_t *in;
+    odz_out_span_t      *out;
+    size_t               n;
+    const odz_options_t *opts;
+    int                  block_log;
+    int                  window_log;
+
+    odz_mutex_t          lock;      /* guards everything below */
+    size_t               next;      /* next item to start */
+    uint64_t             done_bytes;
+    uint64_t             total_bytes;
+    int                  abort;
+} batch_t;
+
+/* A context set up for b->opts, or NULL if out of memory */
+static void *worker_ctx(const batch_t *b) {
+    const odz_options_t *o = b->opts;
+    const uint8_t *key = o ? o->key : NULL;
+    if (!b->compress) {
+        odz_dctx_t *d = odz_dctx_new();
+        if (d && key && odz_dctx_set_key(d, key) != ODZ_OK) { odz_dctx_free(d); d = NULL; }
+        return d;
+    }
+    odz_cctx_t *c = odz_cctx_new(b->block_log);
+    if (c && ((key && odz_cctx_set_key(c, key) != ODZ_OK) ||
+              (o && o->rsyncable && odz_cctx_set_rsyncable(c, 1) != ODZ_OK) ||
+              (o && o->dedup && odz_cctx_set_dedup(c, 1) != ODZ_OK) ||
+              (o && o->filters && odz_cctx_set_filters(c, 1) != ODZ_OK) ||
+              (o && o->archive && odz_cctx_set_archive(c, 1) != ODZ_OK) ||
+              (o && o->fast_decode && odz_cctx_set_fast_decode(c, 1) != ODZ_OK) ||
+              (b->window_log && odz_cctx_set_window(c, b->window_log) != ODZ_OK))) {
+        odz_cctx_free(c);
+        c = NULL;
+    }
+    return c;
+}
+
+static void *batch_worker(void *arg) {
+    batch_t *b = arg;
+    void *ctx = worker_ctx(b);
+
+    for (;;) {
+        odz_mutex_lock(&b->lock);
+        if (b->abort || b->next >= b->n) { odz_mutex_unlock(&b->lock); break; }
+        size_t i = b->next++;
+        odz_mutex_unlock(&b->lock);
+
+        const odz_in_span_t *in = &b->in[i];
+        odz_out_span_t *out = &b->out[i];
+        odz_sink_t sink = { .buf = out->data, .cap = out->cap };
+
+        if (!ctx)
+            out->err = ODZ_ERR_OOM;
+        else if (b->compress)
+            out->err = odz_compress_mem(ctx, in->data, in->size, &sink);
+        else
+            out->err = odz_decompress_mem(ctx, in->data, in->size, &sink);
+        out->size = sink.pos;
+
+        /* Progress callback, serialized across threads */
+        if (b->opts && b->opts->progress) {
+            odz_mutex_lock(&b->lock);
+            b->done_bytes += in->size;
+            if (!b->abort &&
+                b->opts->progress(b->done_bytes, b->total_bytes, b->opts->userdata) != 0)
+                b->abort = 1;
+            odz_mutex_unlock(&b->lock);
+        }
+    }
+
+    if (b->compress) odz_cctx_free(ctx);
+    else             odz_dctx_free(ctx);
+    return NULL;
+}
+
+static int run_batch(int compress, const odz_in_span_t *in, odz_out_span_t *out,
+                     size_t n, const odz_options_t *opts) {
+    batch_t b = { .compress = compress, .in = in, .out = out, .n = n, .opts = opts };
+    for (size_t i = 0; i < n; i++) {
+        b.total_bytes += in[i].size;
+        out[i].size = 0;
+        out[i].err  = ODZ_ERR_IO;   /* "not processed", if aborted */
+    }
+    if (opts && opts->format != ODZ_FMT_ODZ) return ODZ_ERR_PARAM;
+    if (compress) {
+        int rc = odz_block_log(opts, &b.block_log);
+        if (rc == ODZ_OK) rc = odz_window_log(opts, &b.window_log);
+        if (rc != ODZ_OK) return rc;
+    }
+
+    size_t nthreads = opts && opts->threads > 1 ? (size_t)opts->threads : 1;
+    if (nthreads > n) nthreads = n;
+
+    odz_mutex_init(&b.lock);
+
+    /* The calling thread is one of the workers; if a thread can't be
+     * started the remaining ones simply take more items. */
+    odz_thread_t *tids = NULL;
+    size_t started = 0;
+    if (nthreads > 1 && (tids = malloc((nthreads - 1) * sizeof *tids)) != NULL) {
+        for (; started < nthreads - 1; started++)
+            if (odz_thread_create(&tids[started], batch_worker, &b) != 0) break;
+    }
+    batch_worker(&b);
+    for (size_t t = 0; t < started; t++) odz_thread_join(tids[t]);
+    free(tids);
+
+    odz_mutex_destroy(&b.lock);
+
+    for (size_t i = 0; i < n; i++)
+        if (out[i].err != ODZ_OK) return out[i].err;
+    return ODZ_OK;
+}
+
+int odz_compress_batch(const odz_in_span_t *in, odz_out_span_t *out, size_t n,
+                       const odz_options_t *opts) {
+    return run_batch(1, in, out, n, opts);
+}
+
+int odz_decompress_batch(const odz_in_span_t *in, odz_out_span_t *out, size_t n,
+                         const odz_options_t *opts) {
+    return run_batch(0, in, out, n, opts);
+}
@@ -51,6 +51,38 @@ int bw_flush(bit_writer_t *w) {
     return 0;
 }
 
+void bw_reset(bit_writer_t *w) {
+    w->pos = 0;
+    w->bits = 0;
+    w->nbits = 0;
+}
+
+int bw_append(bit_writer_t *w, const uint8_t *src, uint64_t nbits) {
+    size_t nbytes = (size_t)(nbits >> 3);
+    if (w->nbits == 0) {
+        /* Byte-aligned: plain copy */
+        if (bw_grow(w, nbytes) != 0) return -1;
+        memcpy(w->buf + w->pos, src, nbytes);
+        w->pos += nbytes;
+    } else {
+        /* Shift each byte in past the nbits (< 8) pending ones */
+        if (bw_grow(w, nbytes) != 0) return -1;
+        uint8_t *d = w->buf + w->pos;
+        uint32_t acc = (uint32_t)w->bits;
+        int sh = w->nbits;
+        for (size_t i = 0; i < nbytes; i++) {
+            acc |= (uint32_t)src[i] << sh;
+            d[i] = (uint8_t)acc;
+            acc >>= 8;
+        }
+        w->pos += nbytes;
+        w->bits = acc;
+    }
+    int rem = (int)(nbits & 7);
+    if (rem) return bw_write(w, src[nbytes] & ((1u << rem) - 1), rem);
+    return 0;
+}
+
 /* ── Reader ────────────────────────────────────────────────── */
 
 void br_init(bit_reader_t *r, const uint8_t *buf, size_t len) {
@@ -61,7 +93,7 @@ void br_init(bit_reader_t *r, const uint8_t *buf, size_t len) {
     r->nbits = 0;
 }
 
-static void br_refill(bit_reader_t *r) {
+void br_refill(bit_reader_t *r) {
     if (r->pos + 8 <= r->len) {
         /* Fast path: load 8 bytes in one shot */
         uint64_t raw;
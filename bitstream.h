@@ -17,6 +17,8 @@ int  bw_init(bit_writer_t *w, size_t initial_cap);  /* 0=ok, -1=oom */
 void bw_free(bit_writer_t *w);
 int  bw_write(bit_writer_t *w, uint32_t val, int nbits);  /* LSB-first, 0=ok, -1=oom */
 int  bw_flush(bit_writer_t *w);                            /* pad to byte, 0=ok, -1=oom */
+void bw_reset(bit_writer_t *w);                            /* discard contents, keep buffer */
+int  bw_append(bit_writer_t *w, const uint8_t *src, uint64_t nbits); /* LSB-first bit string, 0=ok, -1=oom */
 
 /* ── Memory-backed bit reader ──────────────────────────────── */
 typedef struct {
@@ -30,6 +32,7 @@ typedef struct {
 void     br_init(bit_reader_t *r, const uint8_t *buf, size_t len);
 uint32_t br_peek(bit_reader_t *r, int nbits);
 uint32_t br_read(bit_reader_t *r, int nbits);   /* LSB-first */
+void     br_refill(bit_reader_t *r);    /* >= 57 bits buffered after, while 8 bytes are left */
 
 /* Lightweight consume after br_peek — just shifts bits, no refill */
 static inline void br_consume(bit_reader_t *r, int nbits) {
@@ -1,11 +1,69 @@
 /*
  * Block-based LZ77 + Huffman compressor.
  *
- * For each 1 MB block:
- *   1. Run LZ77 hash-chain matcher → token buffer
+ * For each block (block_size from the header, 1 MB by default):
+ *   1. Run LZ77 matcher → token buffer: the three most recent match
+ *      distances are tried first, then the hash chain
  *   2. Count symbol frequencies, build Huffman trees
- *   3. Write Huffman trees + encoded tokens to bitstream buffer
+ *   3. Write Huffman trees (or pick the fixed codes if cheaper)
+ *      + encoded tokens to bitstream buffer
  *   4. Write block header + compressed data to output
+ *      (or the raw block, if that is smaller still)
+ *
+ * All working memory is sized to the block, so small inputs only pay
+ * for what they use.
+ *
+ * odz blocks code a match at a recent distance with a rep code instead of
+ * its distance. Their symbols go through tANS (ans.h) instead of Huffman
+ * codes when its fractional bits save more than its larger tables cost,
+ * as on very skewed data. Text often does better with a literal/length
+ * table for each kind of byte before the symbol, which a context block
+ * (ODZ_EXT_CTX) has: contexts are grouped into up to four tables by
+ * their statistics. A sequence block (ODZ_EXT_SEQ) keeps the literals
+ * apart from the matches, each coded with the run of literals before it,
+ * which often codes smaller and always decodes in tighter loops.
+ * Without rep codes the block bodies are DEFLATE blocks minus their
+ * 3-bit headers, which is how gzip / zlib / raw DEFLATE is written.
+ *
+ * With a key, each block's data is sealed with AES-256-GCM after
+ * compression, so blocks stay independently decodable.
+ *
+ * Rsyncable mode cuts blocks at content-defined points instead of fixed
+ * offsets. Blocks share no state, so an edit only changes the compressed
+ * blocks around it.
+ *
+ * File streams hash every block, so odz_update can copy the blocks of an
+ * older version whose data hasn't changed.
+ *
+ * With a long-distance window, a rolling-hash index over the frame
+ * (lz_long.c) first finds repeats up to 1 GB back, across blocks; the
+ * hash chain then fills the gaps between them as usual.
+ *
+ * Dedup writes a block whose data equals an earlier block of the frame
+ * as a copy block naming it, without compressing it at all.
+ *
+ * With filters on, a sample of each block is compressed as it is and
+ * through the likeliest filters (filter.h); the block goes through the
+ * winner, if any, before LZ77.
+ *
+ * A patch is a long-distance frame whose history starts with a reference
+ * file: the reference goes through the long-distance index first, so the
+ * new data's matches reach back into it.
+ *
+ * Archive mode codes every block with lzrc.c instead: an optimal parse
+ * over binary-tree match search, range coded with adaptive models.
+ *
+ * Fast-decode mode caps Huffman codes at HUFF_FLAT_BITS, so the decoder
+ * finds every symbol with one table lookup. That costs a fraction of a
+ * percent, and nothing in the format: the decoder sees it in the trees.
+ *
+ * With threads, a large block is parsed in segments at once, each
+ * matcher first seeing the window before its segment, so only matches
+ * across segment edges are lost. The tokens of a Huffman-coded block are
+ * then written in chunks at once, into separate bit buffers joined
+ * afterwards. Meanwhile the next block's LZ pass already runs, into a
+ * second token buffer, unless filters, dedup or archive mode may decide
+ * to write that block some other way.
  */
 
 #include <stdlib.h>
@@ -20,8 +78,14 @@
 #include "odz.h"
 #include "bitstream.h"
 #include "huffman.h"
+#include "ans.h"
 #include "lz_tables.h"
 #include "lz_matcher.h"
+#include "lz_long.h"
+#include "lzrc.h"
+#include "filter.h"
+#include "aes_gcm.h"
+#include "odz_thread.h"
 
 /* Raw LZ token: either a literal or a (length, distance) match */
 typedef struct {
@@ -29,41 +93,782 @@ typedef struct {
     uint16_t dist;      /* 0 = literal, >0 = match distance */
 } token_t;
 
-/* Compress one block of raw data into the bitstream buffer.
- * Returns the compressed data size, or 0 on error (sets *err). */
-static size_t compress_block(const uint8_t *in, size_t n,
-                             bit_writer_t *bw, int *err) {
-    *err = 0;
+/* Token distance standing for the next entry of odz_cctx.far */
+#define TOKEN_FAR  0xFFFF
 
-    /* ── Pass 1: LZ77 → token buffer + frequency counts ──── */
-    size_t max_tokens = n + 1; /* worst case: all literals + end symbol */
-    token_t *tokens = malloc(max_tokens * sizeof(token_t));
-    if (!tokens) { *err = ODZ_ERR_OOM; return 0; }
-    size_t ntok = 0;
+/* A block already written in this frame, for dedup */
+typedef struct {
+    uint64_t hash;      /* XXH64 of its data */
+    uint64_t offset;    /* in the frame's input */
+    uint32_t raw_size;  /* 0: empty slot */
+    uint32_t index;     /* block number */
+} seen_t;
+
+/* A block's LZ pass: its tokens and their symbol counts */
+typedef struct {
+    token_t  *tokens;
+    size_t    tokens_cap;
+    uint32_t *far;              /* distances of TOKEN_FAR tokens, in order */
+    size_t    far_cap;
+    size_t    ntok, nfar;
+    uint32_t  ll_freq[LITLEN_SYMS];
+    uint32_t  d_freq[DIST_SYMS];        /* plain distance codes */
+    uint32_t  r_freq[DIST_SYMS_MAX];    /* with rep codes */
+} lz_pass_t;
 
-    uint32_t ll_freq[LITLEN_SYMS] = {0};
-    uint32_t d_freq[DIST_SYMS]    = {0};
+/* A segment of a block's LZ pass: in[start..end) of the n-byte block,
+ * after its matcher has seen the ODZ_WINDOW bytes before start. Its
+ * tokens go to o->tokens from index start on, as a segment has no more
+ * tokens than bytes. */
+typedef struct {
+    lz_pass_t          *o;
+    const uint8_t      *in;
+    size_t              n, start, end;
+    lz_matcher_t       *m;
+    int                 use_rep;
+    const ldm_match_t  *lm;         /* long matches to take (one segment only) */
+    size_t              nlong;
+    size_t              ntok, nfar; /* tokens end at o->tokens[ntok] */
+    int                 err;
+    int                 reps[REP_CODES];    /* after the segment */
+    uint32_t            ll_freq[LITLEN_SYMS];
+    uint32_t            d_freq[DIST_SYMS];      /* plain distance codes */
+    uint32_t            r_freq[DIST_SYMS_MAX];  /* with rep codes */
+} lz_seg_t;
 
+/* Reusable compression state. Every buffer grows to the largest block
+ * seen and is kept, so consecutive blocks (and streams) skip the setup. */
+struct odz_cctx {
+    int          block_log;     /* stream block size is 1 << block_log */
+    lz_pass_t   *lz;            /* the block being coded: one of */
+    lz_pass_t    lzp[2];        /*   these, the other one free for */
+    size_t       ahead;         /*   the next block's LZ pass: its length
+                                 *   once done */
     lz_matcher_t m;
-    if (lz_matcher_init(&m, n, HASH_BITS, MAX_CHAIN_STEPS) != 0) {
-        free(tokens);
-        *err = ODZ_ERR_OOM;
-        return 0;
+    bit_writer_t bw;
+    uint64_t     bits;          /* exact bit length of the last block in bw */
+    uint8_t     *block_buf;     /* FILE input only */
+    bit_writer_t zw;            /* DEFLATE output stream (non-odz formats) */
+    gcm_ctx_t   *gcm;           /* non-NULL: encrypt */
+    uint8_t      hdr[ODZ_HEADER_SIZE_ENC];  /* current frame header (AAD) */
+    uint32_t     block_index;   /* blocks written in the frame (the nonce) */
+    uint64_t    *gear;          /* non-NULL: rsyncable block boundaries */
+    int          hashes;        /* hash every block (unencrypted frames) */
+    ldm_t       *ldm;           /* non-NULL: long-distance matching */
+    seen_t      *seen;          /* non-NULL: dedup; open addressing by hash */
+    size_t       seen_cap, seen_n;
+    uint64_t     frame_in;      /* input bytes of the frame so far */
+    const uint8_t *src;         /* the frame's input in memory, or */
+    FILE        *in;            /* its input file, to compare blocks with */
+    uint8_t     *cmp_buf;       /* an earlier block read back from in */
+    size_t       cmp_cap;
+    int          filters;       /* try filters on every block */
+    uint8_t     *filt_buf;      /* the filtered block */
+    size_t       filt_cap;
+    int          patch;         /* write patch frames against: */
+    uint64_t     ref_size;      /*   a reference of this size */
+    uint32_t     ref_crc;       /*   and CRC-32 */
+    ans_enc_t   *ans;           /* literal/length and distance tables */
+    uint8_t     *dsyms;         /* distance symbol of each match token */
+    size_t       dsyms_cap;
+    lzrc_enc_t  *lzrc;          /* non-NULL: archive blocks */
+    uint32_t    *ctx_freq;      /* literal/length counts by context */
+    bit_writer_t tw;            /* context block headers, to size them */
+    int          max_bits;      /* longest Huffman code: HUFF_MAX_BITS, or
+                                 * HUFF_FLAT_BITS for fast decoding */
+    int          threads;       /* to work on a block with */
+    bit_writer_t *cw;           /* threads > 1: chunk buffers, but the first */
+    lz_matcher_t *sm;           /* threads > 1: segment matchers, but the first */
+    lz_seg_t     *seg;          /* threads > 1: segments */
+};
+
+/* Context-coded blocks are only tried with this many tokens */
+#define CTX_MIN_TOKENS  1024
+#define CTX_ROUNDS      4
+
+/* Sequence blocks with this many literals split them into four streams */
+#define LIT4_MIN        1024
+
+/* Threads a context works on one block with, at most */
+#define MAX_THREADS     64
+
+/* With threads, the LZ pass runs in a segment of at least LZ_SEG_MIN
+ * bytes per thread, and tokens are coded in a chunk of at least
+ * ENC_CHUNK_MIN per thread */
+#define LZ_SEG_MIN      (1 << 17)
+#define ENC_CHUNK_MIN   (1 << 16)
+
+/* Table sizes of ANS blocks */
+#define ANS_LL_LOG  11
+#define ANS_D_LOG   9
+
+/* Hash table size for an n-byte block: one bucket per position is plenty,
+ * and keeps the table (and its memset) small for small inputs. */
+static int hash_bits_for(size_t n) {
+    int bits = 8;
+    while (bits < HASH_BITS && ((size_t)1 << bits) < n) bits++;
+    return bits;
+}
+
+/* ── Content-defined block boundaries ──────────────────────── */
+
+/* Rsyncable blocks are block_size / 4 .. block_size long */
+#define RSYNC_MIN_SHIFT  2
+
+/* Length of the next rsyncable block of p[0..n): the first cut point at
+ * least block_size / 4 in, else block_size (or all of n, if smaller).
+ * The top block_log - 2 bits of the gear hash being zero makes a cut
+ * point, so blocks average about half the block size. As those bits only
+ * depend on the last 64 bytes, a cut point moves with the content around
+ * it and ignores everything else. */
+static size_t next_cut(const odz_cctx_t *c, const uint8_t *p, size_t n) {
+    size_t max = (size_t)1 << c->block_log;
+    size_t min = max >> RSYNC_MIN_SHIFT;
+    if (n > max) n = max;
+    if (n <= min) return n;
+
+    const uint64_t *gear = c->gear;
+    int shift = 64 - (c->block_log - RSYNC_MIN_SHIFT);
+    uint64_t h = 0;
+    for (size_t i = min - 64; i < min; i++) h = (h << 1) + gear[p[i]];
+    for (size_t i = min; i < n; i++) {
+        h = (h << 1) + gear[p[i]];
+        if ((h >> shift) == 0) return i + 1;
+    }
+    return n;
+}
+
+/* Total code bits for the given symbol frequencies under lens[] */
+static uint64_t code_cost(const uint32_t *freq, const uint8_t *lens, int nsym) {
+    uint64_t bits = 0;
+    for (int s = 0; s < nsym; s++) bits += (uint64_t)freq[s] * lens[s];
+    return bits;
+}
+
+/* A rep match at least this long is taken without searching further */
+#define REP_GOOD_LEN  32
+
+/* A rep match of rep_len is taken over a hash-chain match of len at
+ * dist when it codes at least as well: a rep distance costs a couple of
+ * bits, a plain one about 5 bits of code plus its extra bits. */
+static int rep_wins(int rep_len, int len, int dist) {
+    if (len == 0) return 1;
+    int dsym = 0, debits = 0, deval = 0;
+    dist_to_code(dist, &dsym, &debits, &deval);
+    return (rep_len - len) * 8 + debits >= 0;
+}
+
+/* Distance symbol for dist: a rep code if dist is in reps, else the
+ * distance code (shifted past the rep codes when reps is set) */
+static inline int dist_symbol(const int *reps, int dist, int *ebits, int *eval) {
+    if (reps) {
+        for (int k = 0; k < REP_CODES; k++)
+            if (reps[k] == dist) { *ebits = 0; *eval = 0; return k; }
+    }
+    int dsym = 0;
+    dist_to_code(dist, &dsym, ebits, eval);
+    return reps ? dsym + REP_CODES : dsym;
+}
+
+/* Distance codes after the rep codes: more in long-distance frames */
+static int dist_codes(const odz_cctx_t *c) {
+    return c->ldm ? DIST_CODES(c->ldm->window_log) : DIST_SYMS;
+}
+
+/* Append a match token to o->tokens and count its symbols: d_freq gets
+ * the plain distance code (none for far distances, which the fixed codes
+ * can't express), r_freq the rep-match one when reps is set. */
+static void add_match(lz_pass_t *o, size_t *ntok, size_t *nfar, int len, int dist,
+                      uint32_t *ll_freq, uint32_t *d_freq, uint32_t *r_freq, int *reps) {
+    int lsym = 0, lebits = 0, leval = 0;
+    len_to_code(len, &lsym, &lebits, &leval);
+    ll_freq[lsym]++;
+
+    int debits = 0, deval = 0;
+    token_t *t = &o->tokens[(*ntok)++];
+    t->litlen = (uint16_t)len;
+    if (dist > (int)ODZ_WINDOW) {
+        t->dist = TOKEN_FAR;
+        o->far[(*nfar)++] = (uint32_t)dist;
+    } else {
+        t->dist = (uint16_t)dist;
+        d_freq[dist_symbol(NULL, dist, &debits, &deval)]++;
+    }
+    if (reps) {
+        r_freq[dist_symbol(reps, dist, &debits, &deval)]++;
+        rep_update(reps, dist);
     }
+}
 
-    size_t i = 0;
-    while (i < n) {
+/* ── Literal contexts ──────────────────────────────────────── */
+
+/* Bits freq costs under lens, counting a symbol the code lacks as longer
+ * than any code, so no context is put with a table that can't code it */
+static uint64_t fit_cost(const uint32_t *freq, const uint8_t *lens, int nsym) {
+    uint64_t bits = 0;
+    for (int s = 0; s < nsym; s++)
+        if (freq[s]) bits += (uint64_t)freq[s] * (lens[s] ? lens[s] : HUFF_MAX_BITS + 2);
+    return bits;
+}
+
+/* Counts and code lengths of nt tables from the context counts cf and
+ * their map; every table can code the end of the block */
+static void build_ctx_tables(const uint32_t *cf, const uint8_t *map, int nt, int max_bits,
+                             uint32_t (*tf)[LITLEN_SYMS], uint8_t (*tl)[LITLEN_SYMS]) {
+    memset(tf, 0, (size_t)nt * sizeof *tf);
+    for (int x = 0; x < LIT_CTXS; x++)
+        for (int s = 0; s < LITLEN_SYMS; s++) tf[map[x]][s] += cf[x * LITLEN_SYMS + s];
+    for (int t = 0; t < nt; t++) {
+        if (!tf[t][LITLEN_END]) tf[t][LITLEN_END] = 1;
+        huff_build_lengths(tf[t], LITLEN_SYMS, max_bits, tl[t]);
+    }
+}
+
+/* Group the contexts into up to nt tables: each new table starts from the
+ * context its table fits worst against its own code (own[]), then every
+ * context moves to the table that codes it cheapest, for a few rounds.
+ * Fills map, tf and tl (codes of up to max_bits); returns the number of
+ * tables. */
+static int cluster_ctx(const uint32_t *cf, const uint64_t *own, int nt, int max_bits,
+                       uint8_t *map, uint32_t (*tf)[LITLEN_SYMS], uint8_t (*tl)[LITLEN_SYMS]) {
+    memset(map, 0, LIT_CTXS);
+    build_ctx_tables(cf, map, 1, max_bits, tf, tl);
+    int k = 1;
+    for (; k < nt; k++) {
+        int seed = -1;
+        uint64_t worst = 0;
+        for (int x = 0; x < LIT_CTXS; x++) {
+            uint64_t fit = fit_cost(cf + x * LITLEN_SYMS, tl[map[x]], LITLEN_SYMS);
+            if (fit > own[x] && fit - own[x] > worst) {
+                worst = fit - own[x];
+                seed = x;
+            }
+        }
+        if (seed < 0) break;
+        map[seed] = (uint8_t)k;
+        build_ctx_tables(cf, map, k + 1, max_bits, tf, tl);
+    }
+    for (int round = 0; round < CTX_ROUNDS; round++) {
+        int moved = 0;
+        for (int x = 0; x < LIT_CTXS; x++) {
+            int best = map[x];
+            uint64_t best_bits = fit_cost(cf + x * LITLEN_SYMS, tl[best], LITLEN_SYMS);
+            for (int t = 0; t < k; t++) {
+                uint64_t bits = fit_cost(cf + x * LITLEN_SYMS, tl[t], LITLEN_SYMS);
+                if (bits < best_bits) { best_bits = bits; best = t; }
+            }
+            moved += best != map[x];
+            map[x] = (uint8_t)best;
+        }
+        if (!moved) break;
+        build_ctx_tables(cf, map, k, max_bits, tf, tl);
+    }
+
+    /* Drop tables left without a context */
+    int id[LIT_TABLES], nused = 0;
+    for (int t = 0; t < k; t++) id[t] = -1;
+    for (int x = 0; x < LIT_CTXS; x++) {
+        if (id[map[x]] < 0) id[map[x]] = nused++;
+        map[x] = (uint8_t)id[map[x]];
+    }
+    build_ctx_tables(cf, map, nused, max_bits, tf, tl);
+    return nused;
+}
+
+/* Context block header: the mode, the number of tables - 1 (2 bits), the
+ * map (2 bits per context), then the first table with the distance tree,
+ * and the others each with an empty one */
+static void write_ctx_header(bit_writer_t *bw, int nt, const uint8_t *map,
+                             uint8_t (*tl)[LITLEN_SYMS], const uint8_t *d_lens, int nd) {
+    static const uint8_t no_dist[1] = { 0 };
+    bw_write(bw, ODZ_EXT_CTX, 8);
+    bw_write(bw, (uint32_t)(nt - 1), 2);
+    for (int x = 0; x < LIT_CTXS; x++) bw_write(bw, map[x], 2);
+    huff_write_trees(bw, tl[0], LITLEN_SYMS, d_lens, nd);
+    for (int t = 1; t < nt; t++) huff_write_trees(bw, tl[t], LITLEN_SYMS, no_dist, 1);
+}
+
+/* Size tokens[0..ntok) of in[] as a context block: literal/length counts
+ * by the byte before each symbol, grouped into 2 .. LIT_TABLES tables,
+ * keeping the number that costs least. *bits gets the bits of the header
+ * and literal/length codes (UINT64_MAX if all contexts want one table),
+ * *nt, map and tl the tables. Returns 0, or -1 if out of memory. */
+static int size_ctx(odz_cctx_t *c, const uint8_t *in, size_t ntok,
+                    const uint8_t *d_lens, int nd, uint64_t *bits,
+                    int *nt, uint8_t *map, uint8_t (*tl)[LITLEN_SYMS]) {
+    const size_t ncf = (size_t)LIT_CTXS * LITLEN_SYMS;
+    *bits = UINT64_MAX;
+    if (!c->ctx_freq && !(c->ctx_freq = malloc(ncf * sizeof *c->ctx_freq))) return -1;
+    if (!c->tw.buf && bw_init(&c->tw, 1024) != 0) return -1;
+    uint32_t *cf = c->ctx_freq;
+    memset(cf, 0, ncf * sizeof *cf);
+
+    const token_t *tokens = c->lz->tokens;
+    size_t pos = 0;
+    int x = 0;
+    for (size_t t = 0; t < ntok; t++) {
+        int sym = tokens[t].litlen, len = 1;
+        if (tokens[t].dist != 0) {
+            int lebits = 0, leval = 0;
+            len_to_code(tokens[t].litlen, &sym, &lebits, &leval);
+            len = tokens[t].litlen;
+        }
+        cf[x * LITLEN_SYMS + sym]++;
+        pos += (size_t)len;
+        x = lit_ctx(in[pos - 1], tokens[t].dist != 0);
+    }
+    cf[x * LITLEN_SYMS + LITLEN_END]++;
+
+    uint64_t own[LIT_CTXS];
+    uint8_t lens[LITLEN_SYMS];
+    for (int x = 0; x < LIT_CTXS; x++) {
+        huff_build_lengths(cf + x * LITLEN_SYMS, LITLEN_SYMS, c->max_bits, lens);
+        own[x] = code_cost(cf + x * LITLEN_SYMS, lens, LITLEN_SYMS);
+    }
+
+    uint32_t tf[LIT_TABLES][LITLEN_SYMS];
+    uint8_t m[LIT_CTXS], l[LIT_TABLES][LITLEN_SYMS];
+    for (int want = 2; want <= LIT_TABLES; want++) {
+        int k = cluster_ctx(cf, own, want, c->max_bits, m, tf, l);
+        if (k < 2) break;
+        bw_reset(&c->tw);
+        write_ctx_header(&c->tw, k, m, l, d_lens, nd);
+        uint64_t size = (uint64_t)c->tw.pos * 8 + (uint64_t)c->tw.nbits;
+        for (int t = 0; t < k; t++) size += code_cost(tf[t], l[t], LITLEN_SYMS);
+        if (size < *bits) {
+            *bits = size;
+            *nt = k;
+            memcpy(map, m, sizeof m);
+            memcpy(tl, l, (size_t)k * sizeof *l);
+        }
+        if (k < want) break;
+    }
+    return 0;
+}
+
+/* ── Sequence blocks ───────────────────────────────────────── */
+
+/* Code lengths of a sequence block */
+typedef struct {
+    uint32_t nlit;                  /* literals in the block */
+    int      lit4;                  /* in four streams */
+    uint8_t  lit[LITLEN_SYMS];      /* literals (0-255, and 256 for the tree) */
+    uint8_t  run[RUN_SYMS];         /* runs too long for a sequence symbol */
+    uint8_t  seq[LITLEN_SYMS];      /* sequence symbols and the end */
+} seq_codes_t;
+
+/* Sequence symbol of a match of length code lsym after run literals */
+static inline int seq_symbol(uint32_t run, int lsym) {
+    uint32_t r = run < SEQ_RUNS - 1 ? run : SEQ_RUNS - 1;
+    return (int)r * 29 + lsym - 257;
+}
+
+/* Sequence block header: the mode, the number of literals (32 bits), the
+ * literal tree with the run tree, then the sequence tree with the
+ * distance tree */
+static void write_seq_header(bit_writer_t *bw, const seq_codes_t *s,
+                             const uint8_t *d_lens, int nd) {
+    bw_write(bw, ODZ_EXT_SEQ | (s->lit4 ? ODZ_EXT_LIT4 : 0), 8);
+    bw_write(bw, s->nlit, 32);
+    huff_write_trees(bw, s->lit, LITLEN_SYMS, s->run, RUN_SYMS);
+    huff_write_trees(bw, s->seq, LITLEN_SYMS, d_lens, nd);
+}
+
+/* Size tokens[0..ntok) as a sequence block: the literals of ll_freq, a
+ * sequence symbol per match (and a run code for a long run before it).
+ * *bits gets the bits of the header, literals, sequence symbols and runs,
+ * s the codes. Returns 0, or -1 if out of memory. */
+static int size_seq(odz_cctx_t *c, size_t ntok, const uint32_t *ll_freq,
+                    const uint8_t *d_lens, int nd, uint64_t *bits, seq_codes_t *s) {
+    if (!c->tw.buf && bw_init(&c->tw, 1024) != 0) return -1;
+    uint32_t lf[LITLEN_SYMS] = {0}, sf[LITLEN_SYMS] = {0}, rf[RUN_SYMS] = {0};
+    memcpy(lf, ll_freq, LITLEN_END * sizeof *lf);
+    lf[LITLEN_END] = 1;     /* tree readers want one; it is never coded */
+    sf[LITLEN_END] = 1;
+
+    const token_t *tokens = c->lz->tokens;
+    uint64_t extra = 0;
+    uint32_t run = 0;
+    s->nlit = 0;
+    for (size_t t = 0; t < ntok; t++) {
+        if (tokens[t].dist == 0) { run++; continue; }
+        int lsym = 0, lebits = 0, leval = 0;
+        len_to_code(tokens[t].litlen, &lsym, &lebits, &leval);
+        sf[seq_symbol(run, lsym)]++;
+        if (run >= SEQ_RUNS - 1) {
+            int rsym = 0, rbits = 0;
+            uint32_t rval = 0;
+            run_to_code(run - (SEQ_RUNS - 1), &rsym, &rbits, &rval);
+            rf[rsym]++;
+            extra += (uint32_t)rbits;
+        }
+        s->nlit += run;
+        run = 0;
+    }
+    s->nlit += run;
+    s->lit4 = s->nlit >= LIT4_MIN;
+    if (s->lit4) extra += 3 * 32 + 4 * 7;   /* the sizes, and padding at most */
+
+    huff_build_lengths(lf, LITLEN_SYMS, c->max_bits, s->lit);
+    huff_build_lengths(rf, RUN_SYMS, c->max_bits, s->run);
+    huff_build_lengths(sf, LITLEN_SYMS, c->max_bits, s->seq);
+    bw_reset(&c->tw);
+    write_seq_header(&c->tw, s, d_lens, nd);
+    *bits = (uint64_t)c->tw.pos * 8 + (uint64_t)c->tw.nbits
+          + code_cost(lf, s->lit, LITLEN_SYMS) + code_cost(rf, s->run, RUN_SYMS)
+          + code_cost(sf, s->seq, LITLEN_SYMS) + extra;
+    return 0;
+}
+
+/* Write tokens[0..ntok) to c->bw as a sequence block: the header, every
+ * literal, then for each match its sequence symbol, the run code of a
+ * long run, the length extra bits and the distance (rep codes as in a rep
+ * block), and the end.
+ * Four literal streams start at the byte after the header with the sizes
+ * of the first three (u32 LE each), which are padded to a byte; they
+ * hold a quarter of the literals each, the last one any left over, and
+ * the sequences follow the last one. Returns 0, or -1 if out of memory. */
+static int encode_seq(odz_cctx_t *c, size_t ntok, const seq_codes_t *s,
+                      const uint8_t *d_lens, int nd) {
+    bit_writer_t *bw = &c->bw;
+    uint16_t lit_c[LITLEN_SYMS], run_c[RUN_SYMS], seq_c[LITLEN_SYMS], d_c[DIST_SYMS_MAX];
+    huff_build_codes(s->lit, LITLEN_SYMS, lit_c);
+    huff_build_codes(s->run, RUN_SYMS, run_c);
+    huff_build_codes(s->seq, LITLEN_SYMS, seq_c);
+    huff_build_codes(d_lens, nd, d_c);
+
+    bw_reset(bw);
+    write_seq_header(bw, s, d_lens, nd);
+    const token_t *tokens = c->lz->tokens;
+    uint32_t quarter = s->nlit / 4, n = 0;
+    size_t sizes = 0, start = 0;
+    if (s->lit4) {
+        if (bw_flush(bw) != 0 || bw_write(bw, 0, 32) != 0 ||
+            bw_write(bw, 0, 32) != 0 || bw_write(bw, 0, 32) != 0)
+            return -1;
+        sizes = bw->pos - 12;
+        start = bw->pos;
+    }
+    for (size_t t = 0; t < ntok; t++) {
+        int l = tokens[t].litlen;
+        if (tokens[t].dist != 0) continue;
+        if (bw_write(bw, lit_c[l], s->lit[l]) != 0) return -1;
+        if (s->lit4 && ++n % quarter == 0 && n / quarter < 4) {
+            /* End of one of the first three streams */
+            if (bw_flush(bw) != 0) return -1;
+            wr_u32le(bw->buf + sizes, (uint32_t)(bw->pos - start));
+            sizes += 4;
+            start = bw->pos;
+        }
+    }
+
+    int reps[REP_CODES];
+    memcpy(reps, rep_init, sizeof reps);
+    size_t f = 0;
+    uint32_t run = 0;
+    for (size_t t = 0; t < ntok; t++) {
+        if (tokens[t].dist == 0) { run++; continue; }
+        int lsym = 0, lebits = 0, leval = 0;
+        len_to_code(tokens[t].litlen, &lsym, &lebits, &leval);
+        int sym = seq_symbol(run, lsym);
+        if (bw_write(bw, seq_c[sym], s->seq[sym]) != 0) return -1;
+        if (run >= SEQ_RUNS - 1) {
+            int rsym = 0, rbits = 0;
+            uint32_t rval = 0;
+            run_to_code(run - (SEQ_RUNS - 1), &rsym, &rbits, &rval);
+            if (bw_write(bw, run_c[rsym], s->run[rsym]) != 0 ||
+                (rbits > 0 && bw_write(bw, rval, rbits) != 0))
+                return -1;
+        }
+        run = 0;
+        if (lebits > 0 && bw_write(bw, (uint32_t)leval, lebits) != 0) return -1;
+
+        int dist = tokens[t].dist == TOKEN_FAR ? (int)c->lz->far[f++] : tokens[t].dist;
+        int debits = 0, deval = 0;
+        int dsym = dist_symbol(reps, dist, &debits, &deval);
+        rep_update(reps, dist);
+        if (bw_write(bw, d_c[dsym], d_lens[dsym]) != 0 ||
+            (debits > 0 && bw_write(bw, (uint32_t)deval, debits) != 0))
+            return -1;
+    }
+    if (bw_write(bw, seq_c[LITLEN_END], s->seq[LITLEN_END]) != 0) return -1;
+    c->bits = (uint64_t)bw->pos * 8 + (uint64_t)bw->nbits;
+    return bw_flush(bw);
+}
+
+/* Write tokens[0..ntok) to c->bw as an ANS block: the counts of both
+ * alphabets, then the symbols and extra bits backwards (ans.h). Literal/
+ * length symbols alternate between two states, so the decoder can work
+ * on two lookups at once. Returns 0, or -1 if out of memory. */
+static int encode_ans(odz_cctx_t *c, size_t ntok, const uint16_t *ll_norm, int ll_log,
+                      const uint16_t *d_norm, int nd, int d_log) {
+    bit_writer_t *bw = &c->bw;
+    if (!c->ans && !(c->ans = malloc(2 * sizeof *c->ans))) return -1;
+    if (ntok > c->dsyms_cap) {
+        free(c->dsyms);
+        c->dsyms = malloc(ntok);
+        c->dsyms_cap = c->dsyms ? ntok : 0;
+        if (!c->dsyms) return -1;
+    }
+    ans_enc_t *le = &c->ans[0], *de = &c->ans[1];
+    ans_build_enc(le, ll_norm, LITLEN_SYMS, ll_log);
+    ans_build_enc(de, d_norm, nd, d_log);
+
+    bw_reset(bw);
+    if (ans_write_counts(bw, ll_norm, LITLEN_SYMS, ll_log) < 0 ||
+        ans_write_counts(bw, d_norm, nd, d_log) < 0 || bw_flush(bw) != 0)
+        return -1;
+
+    /* Rep codes depend on the matches before them: pick them going forwards */
+    const token_t *tokens = c->lz->tokens;
+    int reps[REP_CODES];
+    memcpy(reps, rep_init, sizeof reps);
+    size_t f = 0;
+    for (size_t t = 0; t < ntok; t++) {
+        if (tokens[t].dist == 0) continue;
+        int dist = tokens[t].dist == TOKEN_FAR ? (int)c->lz->far[f++] : tokens[t].dist;
+        int debits = 0, deval = 0;
+        c->dsyms[t] = (uint8_t)dist_symbol(reps, dist, &debits, &deval);
+        rep_update(reps, dist);
+    }
+
+    /* Each token's reads in reverse: distance extra bits, distance,
+     * length extra bits, literal/length */
+    uint32_t ls[2] = { ans_init_state(le), ans_init_state(le) };
+    uint32_t ds = ans_init_state(de);
+    if (ans_put(bw, le, &ls[ntok & 1], LITLEN_END) != 0) return -1;
+    for (size_t t = ntok; t-- > 0; ) {
+        uint32_t *st = &ls[t & 1];
+        if (tokens[t].dist == 0) {
+            if (ans_put(bw, le, st, tokens[t].litlen) != 0) return -1;
+            continue;
+        }
+        int dist = tokens[t].dist == TOKEN_FAR ? (int)c->lz->far[--f] : tokens[t].dist;
+        int dsym = c->dsyms[t], debits = 0, deval = 0;
+        if (dsym >= REP_CODES) dist_symbol(NULL, dist, &debits, &deval);
+        int lsym = 0, lebits = 0, leval = 0;
+        len_to_code(tokens[t].litlen, &lsym, &lebits, &leval);
+        if (bw_write(bw, (uint32_t)deval, debits) != 0 ||
+            ans_put(bw, de, &ds, dsym) != 0 ||
+            bw_write(bw, (uint32_t)leval, lebits) != 0 ||
+            ans_put(bw, le, st, lsym) != 0)
+            return -1;
+    }
+
+    /* The decoder starts from these, first to last */
+    if (ans_flush_state(bw, de, ds) != 0 ||
+        ans_flush_state(bw, le, ls[1]) != 0 ||
+        ans_flush_state(bw, le, ls[0]) != 0)
+        return -1;
+    return ans_finish(bw);
+}
+
+/* Run fn on jobs[0..n) (each size bytes) at once, and wait for them all.
+ * The calling thread takes the first, and any a thread couldn't be
+ * started for. */
+static void run_jobs(void *(*fn)(void *), void *jobs, size_t size, size_t n) {
+    odz_thread_t tid[MAX_THREADS];
+    int started[MAX_THREADS] = {0};
+    for (size_t i = 1; i < n; i++)
+        started[i] = odz_thread_create(&tid[i], fn, (char *)jobs + i * size) == 0;
+    for (size_t i = 0; i < n; i++)
+        if (!started[i]) fn((char *)jobs + i * size);
+    for (size_t i = 1; i < n; i++)
+        if (started[i]) odz_thread_join(tid[i]);
+}
+
+/* The codes of a Huffman, rep, fixed or context block, for encode_tokens */
+typedef struct {
+    const odz_cctx_t *c;
+    const uint8_t   *in;
+    int              ntab;          /* literal/length tables */
+    const uint8_t   *ctx_map;       /* ntab > 1: context → table */
+    const uint8_t  (*tl)[LITLEN_SYMS];
+    const uint16_t (*tc)[LITLEN_SYMS];
+    const uint8_t   *ll_lens, *d_lens;     /* ntab == 1 */
+    const uint16_t  *ll_codes, *d_codes;
+    int              rep_codes;
+} tok_codes_t;
+
+/* Where encode_tokens starts (and, after it, stops) */
+typedef struct {
+    size_t t;                   /* token */
+    size_t pos;                 /* its input position */
+    size_t f;                   /* next entry of c->lz->far */
+    int    x;                   /* context of its literal/length symbol */
+    int    reps[REP_CODES];
+} tok_state_t;
+
+/* Advance s past tokens[s->t..end) without writing them */
+static void skip_tokens(const tok_codes_t *k, tok_state_t *s, size_t end) {
+    const token_t *tokens = k->c->lz->tokens;
+    for (; s->t < end; s->t++) {
+        if (tokens[s->t].dist == 0) {
+            s->pos++;
+            s->x = lit_ctx(tokens[s->t].litlen, 0);
+            continue;
+        }
+        s->pos += tokens[s->t].litlen;
+        s->x = lit_ctx(k->in[s->pos - 1], 1);
+        int dist = tokens[s->t].dist == TOKEN_FAR ? (int)k->c->lz->far[s->f++] : tokens[s->t].dist;
+        if (k->rep_codes) rep_update(s->reps, dist);
+    }
+}
+
+/* Write tokens[s->t..end) to bw, advancing s. Returns 0, or -1 if out of
+ * memory. */
+static int encode_tokens(const tok_codes_t *k, tok_state_t *s, size_t end,
+                         bit_writer_t *bw) {
+    const token_t *tokens = k->c->lz->tokens;
+    const uint8_t *ll_l = k->ll_lens;
+    const uint16_t *ll_c = k->ll_codes;
+    for (; s->t < end; s->t++) {
+        const token_t *tk = &tokens[s->t];
+        if (k->ntab > 1) {
+            ll_l = k->tl[k->ctx_map[s->x]];
+            ll_c = k->tc[k->ctx_map[s->x]];
+        }
+        if (tk->dist == 0) {
+            /* Literal */
+            int sym = tk->litlen;
+            if (bw_write(bw, ll_c[sym], ll_l[sym]) != 0) return -1;
+            s->pos++;
+            s->x = lit_ctx(sym, 0);
+        } else {
+            /* Match */
+            int lsym = 0, lebits = 0, leval = 0;
+            len_to_code(tk->litlen, &lsym, &lebits, &leval);
+            if (bw_write(bw, ll_c[lsym], ll_l[lsym]) != 0) return -1;
+            s->pos += tk->litlen;
+            s->x = lit_ctx(k->in[s->pos - 1], 1);
+            if (lebits > 0 && bw_write(bw, (uint32_t)leval, lebits) != 0) return -1;
+
+            int dist = tk->dist == TOKEN_FAR ? (int)k->c->lz->far[s->f++] : tk->dist;
+            int debits = 0, deval = 0;
+            int dsym = dist_symbol(k->rep_codes ? s->reps : NULL, dist, &debits, &deval);
+            if (k->rep_codes) rep_update(s->reps, dist);
+            if (bw_write(bw, k->d_codes[dsym], k->d_lens[dsym]) != 0) return -1;
+            if (debits > 0 && bw_write(bw, (uint32_t)deval, debits) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/* One chunk of a block's tokens, for a worker thread */
+typedef struct {
+    const tok_codes_t *k;
+    tok_state_t        s;
+    size_t             end;
+    bit_writer_t      *bw;
+    int                err;
+} enc_chunk_t;
+
+static void *enc_chunk_worker(void *arg) {
+    enc_chunk_t *ch = arg;
+    ch->err = encode_tokens(ch->k, &ch->s, ch->end, ch->bw);
+    return NULL;
+}
+
+/* Write tokens[0..ntok) to c->bw after its header; s starts at token 0
+ * and ends past the last one. With threads and enough tokens, chunks of
+ * them are coded into their own bit buffers at once: a quick pass finds
+ * the state each chunk starts in, and the buffers are then shifted onto
+ * the end of c->bw in order, each exactly as many bits long as its codes.
+ * The output is the same either way. Returns 0, or -1 if out of memory. */
+static int encode_block_tokens(odz_cctx_t *c, const tok_codes_t *k, tok_state_t *s,
+                               size_t ntok) {
+    size_t nch = ntok / ENC_CHUNK_MIN;
+    if (nch > (size_t)c->threads) nch = (size_t)c->threads;
+    if (nch <= 1 || !c->cw) return encode_tokens(k, s, ntok, &c->bw);
+
+    enc_chunk_t ch[MAX_THREADS];
+    for (size_t i = 0; i < nch; i++) {
+        if (i > 0) skip_tokens(k, s, ch[i - 1].end);
+        ch[i].k = k;
+        ch[i].s = *s;
+        ch[i].end = i + 1 < nch ? ntok / nch * (i + 1) : ntok;
+        ch[i].bw = i == 0 ? &c->bw : &c->cw[i - 1];
+        ch[i].err = 0;
+        if (i > 0) bw_reset(ch[i].bw);
+    }
+
+    run_jobs(enc_chunk_worker, ch, sizeof *ch, nch);
+
+    int err = 0;
+    for (size_t i = 0; i < nch; i++) err |= ch[i].err;
+    for (size_t i = 1; i < nch && !err; i++) {
+        bit_writer_t *w = ch[i].bw;
+        uint64_t nbits = (uint64_t)w->pos * 8 + (uint64_t)w->nbits;
+        if (bw_flush(w) != 0 || bw_append(&c->bw, w->buf, nbits) != 0) err = -1;
+    }
+    *s = ch[nch - 1].s;
+    return err ? -1 : 0;
+}
+
+/* Parse g's segment into tokens, counting their symbols */
+static void lz_parse(lz_seg_t *g) {
+    lz_pass_t *o = g->o;
+    const uint8_t *in = g->in;
+    size_t n = g->n;
+    lz_matcher_t *m = g->m;
+    uint32_t *ll_freq = g->ll_freq, *d_freq = g->d_freq, *r_freq = g->r_freq;
+    int *reps = g->reps;
+    memcpy(reps, rep_init, sizeof g->reps);
+    int use_rep = g->use_rep;
+    token_t *tokens = o->tokens;
+    size_t ntok = g->start, nfar = 0;
+    const ldm_match_t *lm = g->lm;
+    size_t nlong = g->nlong, k = 0;
+
+    /* Matches may still reach a window back past the segment's start */
+    size_t i = g->start >= ODZ_WINDOW ? g->start - ODZ_WINDOW : 0;
+    for (; i < g->start; i++) lz_matcher_insert(m, in, i);
+
+    while (i < g->end) {
         int best_len = 0, best_dist = 0;
-        lz_matcher_find_best(&m, in, i, n, (int)ODZ_WINDOW,
-                             ODZ_MIN_MATCH, ODZ_MAX_MATCH,
-                             &best_len, &best_dist);
+        size_t lim = k < nlong ? lm[k].pos : g->end;     /* matches below end here */
+
+        if (i == lim) {
+            /* Long match, in tokens of up to ODZ_MAX_MATCH: all but the
+             * first are rep0 */
+            int left = (int)lm[k].len, dist = (int)lm[k].dist;
+            while (left > 0) {
+                int len = left < ODZ_MAX_MATCH ? left : ODZ_MAX_MATCH;
+                if (left - len > 0 && left - len < ODZ_MIN_MATCH) len = left - ODZ_MIN_MATCH;
+                add_match(o, &ntok, &nfar, len, dist, ll_freq, d_freq, r_freq, reps);
+                left -= len;
+            }
+            for (size_t p = i; p < i + lm[k].len && p + 2 < n; p++)
+                lz_matcher_insert(m, in, p);
+            i += lm[k++].len;
+            continue;
+        }
+
+        /* Rep distances first: a long enough rep match is taken without
+         * walking the hash chain at all */
+        int rep_len = 0, rep_idx = 0;
+        if (use_rep)
+            lz_matcher_find_rep(in, i, lim, reps, REP_CODES, (int)ODZ_WINDOW,
+                                ODZ_MIN_MATCH, ODZ_MAX_MATCH, &rep_len, &rep_idx);
+        if (rep_len < REP_GOOD_LEN) {
+            lz_matcher_find_best(m, in, i, lim, (int)ODZ_WINDOW,
+                                 ODZ_MIN_MATCH, ODZ_MAX_MATCH,
+                                 &best_len, &best_dist);
+        }
+        if (rep_len > 0 && rep_wins(rep_len, best_len, best_dist)) {
+            best_len = rep_len;
+            best_dist = reps[rep_idx];
+        }
 
         /* Lazy matching: check if the next position has a longer match.
          * Skip the check for near-maximum matches (not worth it). */
-        if (best_len >= ODZ_MIN_MATCH && best_len < ODZ_MAX_MATCH - 1 && i + 1 < n) {
-            lz_matcher_insert(&m, in, i);
+        size_t inserted = i;    /* positions below this are in the chains */
+        if (best_len >= ODZ_MIN_MATCH && best_len < ODZ_MAX_MATCH - 1 && i + 1 < lim &&
+            rep_len < REP_GOOD_LEN) {
+            lz_matcher_insert(m, in, i);
+            inserted = i + 1;
             int next_len = 0, next_dist = 0;
-            lz_matcher_find_best_next(&m, in, i, n, (int)ODZ_WINDOW,
+            lz_matcher_find_best_next(m, in, i, lim, (int)ODZ_WINDOW,
                                       ODZ_MIN_MATCH, ODZ_MAX_MATCH,
                                       &next_len, &next_dist);
             if (next_len > best_len) {
@@ -78,32 +883,151 @@ static size_t compress_block(const uint8_t *in, size_t n,
 
         if (best_len >= ODZ_MIN_MATCH) {
             /* Emit match token */
-            int lsym = 0, lebits = 0, leval = 0;
-            len_to_code(best_len, &lsym, &lebits, &leval);
-            ll_freq[lsym]++;
-
-            int dsym = 0, debits = 0, deval = 0;
-            dist_to_code(best_dist, &dsym, &debits, &deval);
-            d_freq[dsym]++;
-
-            tokens[ntok].litlen = (uint16_t)best_len;
-            tokens[ntok].dist   = (uint16_t)best_dist;
-            ntok++;
+            add_match(o, &ntok, &nfar, best_len, best_dist,
+                      ll_freq, d_freq, r_freq, use_rep ? reps : NULL);
 
             /* Insert ALL positions covered by the match */
-            for (size_t p = i; p < i + (size_t)best_len && p + 2 < n; p++)
-                lz_matcher_insert(&m, in, p);
+            for (size_t p = inserted; p < i + (size_t)best_len && p + 2 < n; p++)
+                lz_matcher_insert(m, in, p);
             i += (size_t)best_len;
         } else {
             /* Emit literal */
-            lz_matcher_insert(&m, in, i);
+            lz_matcher_insert(m, in, i);
             ll_freq[in[i]]++;
             tokens[ntok].litlen = in[i];
             tokens[ntok].dist = 0;
             ntok++; i++;
         }
     }
-    lz_matcher_free(&m);
+
+    g->ntok = ntok;
+    g->nfar = nfar;
+}
+
+static void *lz_seg_worker(void *arg) {
+    lz_seg_t *g = arg;
+    if (lz_matcher_prepare(g->m, g->n, hash_bits_for(g->n), MAX_CHAIN_STEPS) != 0)
+        g->err = ODZ_ERR_OOM;
+    else
+        lz_parse(g);
+    return NULL;
+}
+
+/* A segment's rep codes were counted from the initial rep list; recount
+ * them from reps, the list the segment before ended with, up to where the
+ * two lists agree again, and leave the true list after g in g->reps */
+static void seg_fix_reps(lz_seg_t *g, const int *reps) {
+    const token_t *tokens = g->o->tokens;
+    int own[REP_CODES], tr[REP_CODES];
+    memcpy(own, rep_init, sizeof own);
+    memcpy(tr, reps, sizeof tr);
+    for (size_t t = g->start; t < g->ntok && memcmp(own, tr, sizeof own) != 0; t++) {
+        if (tokens[t].dist == 0) continue;
+        int dist = tokens[t].dist, ebits = 0, eval = 0;
+        g->r_freq[dist_symbol(own, dist, &ebits, &eval)]--;
+        g->r_freq[dist_symbol(tr, dist, &ebits, &eval)]++;
+        rep_update(own, dist);
+        rep_update(tr, dist);
+    }
+    if (memcmp(own, tr, sizeof own) != 0) memcpy(g->reps, tr, sizeof tr);
+}
+
+/* LZ pass over in[0..n) into o: in[-hist..0) is the frame's earlier data,
+ * which long-distance matches may reach into. Returns ODZ_OK or
+ * ODZ_ERR_OOM. */
+static int lz_block(odz_cctx_t *c, lz_pass_t *o, const uint8_t *in, size_t n,
+                    size_t hist, int use_rep) {
+    size_t max_tokens = n + 1; /* worst case: all literals + end symbol */
+    if (max_tokens > o->tokens_cap) {
+        free(o->tokens);
+        o->tokens = malloc(max_tokens * sizeof(token_t));
+        o->tokens_cap = o->tokens ? max_tokens : 0;
+        if (!o->tokens) return ODZ_ERR_OOM;
+    }
+
+    /* With threads, segments of the block are parsed at once */
+    size_t nseg = c->threads > 1 && !(c->ldm && use_rep) ? n / LZ_SEG_MIN : 1;
+    if (nseg > (size_t)c->threads) nseg = (size_t)c->threads;
+    if (nseg == 0) nseg = 1;
+    lz_seg_t one, *seg = nseg > 1 ? c->seg : &one;
+    for (size_t i = 0; i < nseg; i++) {
+        lz_seg_t *g = &seg[i];
+        memset(g, 0, sizeof *g);
+        g->o = o;
+        g->in = in;
+        g->n = n;
+        g->start = n / nseg * i;
+        g->end = i + 1 < nseg ? n / nseg * (i + 1) : n;
+        g->m = i == 0 ? &c->m : &c->sm[i - 1];
+        g->use_rep = use_rep;
+    }
+
+    /* Long repeats first; the search fills the gaps between them */
+    if (c->ldm && use_rep) {
+        size_t need = n / LDM_MIN_MATCH + 1;    /* far tokens, at most */
+        if (need > o->far_cap) {
+            free(o->far);
+            o->far = malloc(need * sizeof *o->far);
+            o->far_cap = o->far ? need : 0;
+        }
+        if (!o->far || ldm_find(c->ldm, in, n, hist, &seg[0].nlong) != 0)
+            return ODZ_ERR_OOM;
+        seg[0].lm = c->ldm->matches;
+    }
+
+    run_jobs(lz_seg_worker, seg, sizeof *seg, nseg);
+    for (size_t i = 0; i < nseg; i++)
+        if (seg[i].err) return seg[i].err;
+
+    /* Join the segments' tokens and counts */
+    o->ntok = seg[0].ntok;
+    o->nfar = seg[0].nfar;
+    memcpy(o->ll_freq, seg[0].ll_freq, sizeof o->ll_freq);
+    memcpy(o->d_freq, seg[0].d_freq, sizeof o->d_freq);
+    memcpy(o->r_freq, seg[0].r_freq, sizeof o->r_freq);
+    for (size_t i = 1; i < nseg; i++) {
+        lz_seg_t *g = &seg[i];
+        if (use_rep) seg_fix_reps(g, seg[i - 1].reps);
+        memmove(o->tokens + o->ntok, o->tokens + g->start,
+                (g->ntok - g->start) * sizeof *o->tokens);
+        o->ntok += g->ntok - g->start;
+        for (int k = 0; k < LITLEN_SYMS; k++) o->ll_freq[k] += g->ll_freq[k];
+        for (int k = 0; k < DIST_SYMS; k++) o->d_freq[k] += g->d_freq[k];
+        for (int k = 0; k < DIST_SYMS_MAX; k++) o->r_freq[k] += g->r_freq[k];
+    }
+    return ODZ_OK;
+}
+
+/* A block whose LZ pass may run ahead, for compress_block */
+typedef struct {
+    const uint8_t *in;
+    size_t         n, hist;
+} next_block_t;
+
+/* The next block's LZ pass, on its own thread */
+typedef struct {
+    odz_cctx_t    *c;
+    lz_pass_t     *o;
+    const uint8_t *in;
+    size_t         n, hist;
+    int            use_rep;
+    int            err;
+} lz_ahead_t;
+
+static void *lz_ahead_worker(void *arg) {
+    lz_ahead_t *a = arg;
+    a->err = lz_block(a->c, a->o, a->in, a->n, a->hist, a->use_rep);
+    return NULL;
+}
+
+/* Code the tokens of c->lz, the LZ pass of in, into c->bw (see
+ * compress_block) */
+static size_t code_block(odz_cctx_t *c, const uint8_t *in, int use_rep,
+                         int *type, int *err) {
+    bit_writer_t *bw = &c->bw;
+    bw_reset(bw);
+    size_t ntok = c->lz->ntok, nfar = c->lz->nfar;
+    uint32_t *ll_freq = c->lz->ll_freq, *d_freq = c->lz->d_freq, *r_freq = c->lz->r_freq;
 
     /* End-of-block symbol */
     ll_freq[LITLEN_END]++;
@@ -112,57 +1036,808 @@ static size_t compress_block(const uint8_t *in, size_t n,
     if (d_freq[0] == 0) {
         int any = 0;
         for (int s = 0; s < DIST_SYMS; s++) if (d_freq[s]) { any = 1; break; }
-        if (!any) d_freq[0] = 1;
+        if (!any) { d_freq[0] = 1; r_freq[0] = 1; }
     }
 
     /* ── Build Huffman trees ─────────────────────────────── */
-    uint8_t  ll_lens[LITLEN_SYMS], d_lens[DIST_SYMS];
-    uint16_t ll_codes[LITLEN_SYMS], d_codes[DIST_SYMS];
+    int nd = use_rep ? REP_CODES + dist_codes(c) : DIST_SYMS;
+    const uint32_t *df = use_rep ? r_freq : d_freq;
+    uint8_t  ll_lens[LITLEN_FIXED], d_lens[DIST_SYMS_MAX];
+    uint16_t ll_codes[LITLEN_FIXED], d_codes[DIST_SYMS_MAX];
+    int n_ll = LITLEN_SYMS;
 
-    huff_build_lengths(ll_freq, LITLEN_SYMS, HUFF_MAX_BITS, ll_lens);
-    huff_build_lengths(d_freq, DIST_SYMS, HUFF_MAX_BITS, d_lens);
-    huff_build_codes(ll_lens, LITLEN_SYMS, ll_codes);
-    huff_build_codes(d_lens, DIST_SYMS, d_codes);
+    huff_build_lengths(ll_freq, LITLEN_SYMS, c->max_bits, ll_lens);
+    huff_build_lengths(df, nd, c->max_bits, d_lens);
 
     /* ── Pass 2: write trees + encoded tokens to bitstream ── */
-    huff_write_trees(bw, ll_lens, LITLEN_SYMS, d_lens, DIST_SYMS);
+    huff_write_trees(bw, ll_lens, LITLEN_SYMS, d_lens, nd);
 
-    for (size_t t = 0; t < ntok; t++) {
-        if (tokens[t].dist == 0) {
-            /* Literal */
-            int s = tokens[t].litlen;
-            if (bw_write(bw, ll_codes[s], ll_lens[s]) != 0) goto oom;
-        } else {
-            /* Match */
-            int lsym = 0, lebits = 0, leval = 0;
-            len_to_code(tokens[t].litlen, &lsym, &lebits, &leval);
-            if (bw_write(bw, ll_codes[lsym], ll_lens[lsym]) != 0) goto oom;
-            if (lebits > 0 && bw_write(bw, (uint32_t)leval, lebits) != 0) goto oom;
+    /* Small or flat blocks are often cheaper with the fixed codes, which
+     * cost no tree bits at all. Length extra bits are the same either way;
+     * distance extra bits are too, unless rep codes save some. DEFLATE
+     * output takes DEFLATE's fixed code, odz blocks their own. */
+    uint8_t fx_ll[LITLEN_FIXED], fx_d[DIST_SYMS];
+    int n_fixed = use_rep ? LITLEN_SYMS : LITLEN_FIXED;
+    huff_fixed_lengths(fx_ll, n_fixed, fx_d);
+    uint64_t dyn_bits = (uint64_t)bw->pos * 8 + (uint64_t)bw->nbits
+                      + code_cost(ll_freq, ll_lens, LITLEN_SYMS)
+                      + code_cost(df, d_lens, nd);
+    uint64_t fix_bits = code_cost(ll_freq, fx_ll, LITLEN_SYMS)
+                      + code_cost(d_freq, fx_d, DIST_SYMS);
+    uint64_t rep_extra = 0;
+    if (use_rep) {
+        for (int s = 0; s < DIST_SYMS; s++) {
+            fix_bits += (uint64_t)d_freq[s] * (uint32_t)extra_dbits[s];
+            rep_extra += (uint64_t)r_freq[s + REP_CODES] * (uint32_t)extra_dbits[s];
+        }
+        dyn_bits += rep_extra;
+    }
 
-            int dsym = 0, debits = 0, deval = 0;
-            dist_to_code(tokens[t].dist, &dsym, &debits, &deval);
-            if (bw_write(bw, d_codes[dsym], d_lens[dsym]) != 0) goto oom;
-            if (debits > 0 && bw_write(bw, (uint32_t)deval, debits) != 0) goto oom;
+    /* ANS estimate: counts, symbols, the same extra bits, the final
+     * states and the padding after the counts */
+    uint64_t ans_bits = UINT64_MAX;
+    uint16_t ll_norm[LITLEN_SYMS], d_norm[DIST_SYMS_MAX];
+    int ll_log = 0, d_log = 0;
+    if (use_rep) {
+        ll_log = ans_table_log(ll_freq, LITLEN_SYMS, ANS_LL_LOG);
+        d_log = ans_table_log(r_freq, nd, ANS_D_LOG);
+        if (ans_normalize(ll_freq, LITLEN_SYMS, ll_log, ll_norm) == 0 &&
+            ans_normalize(r_freq, nd, d_log, d_norm) == 0) {
+            ans_bits = (uint64_t)ans_write_counts(NULL, ll_norm, LITLEN_SYMS, ll_log)
+                     + (uint64_t)ans_write_counts(NULL, d_norm, nd, d_log) + 8
+                     + ans_cost(ll_freq, ll_norm, LITLEN_SYMS, ll_log)
+                     + ans_cost(r_freq, d_norm, nd, d_log)
+                     + (uint64_t)(2 * ll_log + d_log) + 8 + rep_extra;
         }
     }
 
+    /* Literal/length tables by context: the same distance codes */
+    uint64_t ctx_bits = UINT64_MAX;
+    int ntab = 1;
+    uint8_t ctx_map[LIT_CTXS], tl[LIT_TABLES][LITLEN_SYMS];
+    if (use_rep && ntok >= CTX_MIN_TOKENS) {
+        if (size_ctx(c, in, ntok, d_lens, nd, &ctx_bits, &ntab, ctx_map, tl) != 0) goto oom;
+        if (ctx_bits != UINT64_MAX) ctx_bits += code_cost(df, d_lens, nd) + rep_extra;
+    }
+
+    /* Runs and lengths as sequence symbols: the same distance codes */
+    uint64_t seq_bits = UINT64_MAX;
+    seq_codes_t seq;
+    if (use_rep) {
+        if (size_seq(c, ntok, ll_freq, d_lens, nd, &seq_bits, &seq) != 0) goto oom;
+        seq_bits += code_cost(df, d_lens, nd) + rep_extra;
+    }
+
+    if (seq_bits < dyn_bits && seq_bits < ctx_bits && seq_bits < ans_bits &&
+        (nfar > 0 || seq_bits < fix_bits)) {
+        *type = ODZ_BLOCK_EXT;
+        if (encode_seq(c, ntok, &seq, d_lens, nd) != 0) goto oom;
+        return bw->pos;
+    }
+
+    if (ans_bits < dyn_bits && ans_bits <= ctx_bits && (nfar > 0 || ans_bits <= fix_bits)) {
+        *type = ODZ_BLOCK_ANS;
+        if (encode_ans(c, ntok, ll_norm, ll_log, d_norm, nd, d_log) != 0) goto oom;
+        c->bits = (uint64_t)bw->pos * 8;
+        return bw->pos;
+    }
+
+    int rep_codes = use_rep;
+    uint16_t tc[LIT_TABLES][LITLEN_SYMS];
+    if (ctx_bits < dyn_bits && (nfar > 0 || ctx_bits < fix_bits)) {
+        bw_reset(bw);  /* the single table's trees */
+        write_ctx_header(bw, ntab, ctx_map, tl, d_lens, nd);
+        for (int t = 0; t < ntab; t++) huff_build_codes(tl[t], LITLEN_SYMS, tc[t]);
+        *type = ODZ_BLOCK_EXT;
+    } else if (nfar == 0 && fix_bits < dyn_bits) {
+        ntab = 1;
+        bw_reset(bw);  /* drop the trees */
+        memcpy(ll_lens, fx_ll, sizeof ll_lens);
+        memcpy(d_lens, fx_d, sizeof fx_d);
+        n_ll = n_fixed;
+        nd = DIST_SYMS;
+        rep_codes = 0;
+        *type = ODZ_BLOCK_FIXED;
+    } else {
+        ntab = 1;
+        *type = use_rep ? ODZ_BLOCK_REP : ODZ_BLOCK_HUFFMAN;
+    }
+    huff_build_codes(ll_lens, n_ll, ll_codes);
+    huff_build_codes(d_lens, nd, d_codes);
+
+    tok_codes_t codes = {
+        .c = c, .in = in, .ntab = ntab, .ctx_map = ctx_map,
+        .tl = (const uint8_t (*)[LITLEN_SYMS])tl, .tc = (const uint16_t (*)[LITLEN_SYMS])tc,
+        .ll_lens = ll_lens, .d_lens = d_lens, .ll_codes = ll_codes, .d_codes = d_codes,
+        .rep_codes = rep_codes
+    };
+    tok_state_t st = { 0 };
+    memcpy(st.reps, rep_init, sizeof st.reps);
+    if (encode_block_tokens(c, &codes, &st, ntok) != 0) goto oom;
+
     /* End-of-block */
-    if (bw_write(bw, ll_codes[LITLEN_END], ll_lens[LITLEN_END]) != 0) goto oom;
+    const uint8_t *ll_l = ntab > 1 ? tl[ctx_map[st.x]] : ll_lens;
+    const uint16_t *ll_c = ntab > 1 ? tc[ctx_map[st.x]] : ll_codes;
+    if (bw_write(bw, ll_c[LITLEN_END], ll_l[LITLEN_END]) != 0) goto oom;
+    c->bits = (uint64_t)bw->pos * 8 + (uint64_t)bw->nbits;
     if (bw_flush(bw) != 0) goto oom;
 
-    free(tokens);
     return bw->pos;
 
 oom:
-    free(tokens);
     *err = ODZ_ERR_OOM;
     return 0;
 }
 
+/* Compress one block of raw data into c->bw. in[-hist..0) is the frame's
+ * earlier data, which long-distance matches may reach into.
+ * Sets *type to ODZ_BLOCK_HUFFMAN, ODZ_BLOCK_REP, ODZ_BLOCK_ANS or
+ * ODZ_BLOCK_EXT (if use_rep) or ODZ_BLOCK_FIXED, whichever is smallest.
+ * next, if not NULL, is the block to be compressed after this one (with
+ * the same use_rep), whose data stays put until then: its LZ pass runs on
+ * another thread while this block is coded, and that call skips it.
+ * Returns the compressed data size, or 0 on error (sets *err). */
+static size_t compress_block(odz_cctx_t *c, const uint8_t *in, size_t n, size_t hist,
+                             int use_rep, const next_block_t *next, int *type, int *err) {
+    *err = 0;
+    lz_pass_t *spare = c->lz == &c->lzp[0] ? &c->lzp[1] : &c->lzp[0];
+    if (c->ahead) {
+        /* Not the block promised? The input changed under us */
+        if (c->ahead != n) { *err = ODZ_ERR_IO; c->ahead = 0; return 0; }
+        c->lz = spare;
+        spare = spare == &c->lzp[0] ? &c->lzp[1] : &c->lzp[0];
+        c->ahead = 0;
+    } else if ((*err = lz_block(c, c->lz, in, n, hist, use_rep)) != ODZ_OK) {
+        return 0;
+    }
+
+    lz_ahead_t a = { 0 };
+    odz_thread_t tid;
+    int started = 0;
+    if (next) {
+        a = (lz_ahead_t){ .c = c, .o = spare, .in = next->in, .n = next->n,
+                          .hist = next->hist, .use_rep = use_rep };
+        started = odz_thread_create(&tid, lz_ahead_worker, &a) == 0;
+    }
+    size_t size = code_block(c, in, use_rep, type, err);
+    if (next) {
+        if (started) odz_thread_join(tid);
+        else         lz_ahead_worker(&a);
+        if (a.err && !*err) *err = a.err;
+        c->ahead = *err ? 0 : next->n;
+    }
+    return *err ? 0 : size;
+}
+
+/* ── Stream writer ─────────────────────────────────────────── */
+
+odz_cctx_t *odz_cctx_new(int block_log) {
+    odz_cctx_t *c = calloc(1, sizeof *c);
+    if (!c) return NULL;
+    c->block_log = block_log;
+    c->lz = &c->lzp[0];
+    c->max_bits = HUFF_MAX_BITS;
+    c->threads = 1;
+    if (bw_init(&c->bw, 1024) != 0) { free(c); return NULL; }
+    return c;
+}
+
+void odz_cctx_free(odz_cctx_t *c) {
+    if (!c) return;
+    for (int i = 0; i < 2; i++) {
+        free(c->lzp[i].tokens);
+        free(c->lzp[i].far);
+    }
+    lz_matcher_free(&c->m);
+    bw_free(&c->bw);
+    bw_free(&c->zw);
+    free(c->block_buf);
+    free(c->gcm);
+    free(c->gear);
+    if (c->ldm) ldm_free(c->ldm);
+    free(c->ldm);
+    free(c->seen);
+    free(c->cmp_buf);
+    free(c->filt_buf);
+    free(c->ans);
+    free(c->dsyms);
+    odz_cctx_set_threads(c, 1);
+    lzrc_enc_free(c->lzrc);
+    free(c->ctx_freq);
+    bw_free(&c->tw);
+    free(c);
+}
+
+int odz_cctx_set_key(odz_cctx_t *c, const uint8_t *key) {
+    if (!key) {
+        free(c->gcm);
+        c->gcm = NULL;
+        return ODZ_OK;
+    }
+    if (!c->gcm && !(c->gcm = malloc(sizeof *c->gcm))) return ODZ_ERR_OOM;
+    gcm_init(c->gcm, key);
+    return ODZ_OK;
+}
+
+int odz_cctx_set_rsyncable(odz_cctx_t *c, int on) {
+    if (!on) {
+        free(c->gear);
+        c->gear = NULL;
+        return ODZ_OK;
+    }
+    if (!c->gear) {
+        if (!(c->gear = malloc(256 * sizeof *c->gear))) return ODZ_ERR_OOM;
+        odz_gear_init(c->gear);
+    }
+    return ODZ_OK;
+}
+
+int odz_cctx_set_window(odz_cctx_t *c, int window_log) {
+    if (window_log == 0) {
+        if (c->ldm) ldm_free(c->ldm);
+        free(c->ldm);
+        c->ldm = NULL;
+        return ODZ_OK;
+    }
+    if (window_log < ODZ_MIN_WINDOW_LOG || window_log > ODZ_MAX_WINDOW_LOG) return ODZ_ERR_PARAM;
+    if (!c->ldm && !(c->ldm = calloc(1, sizeof *c->ldm))) return ODZ_ERR_OOM;
+    c->ldm->window_log = window_log;    /* tables come with the first frame */
+    return ODZ_OK;
+}
+
+/* Slot of the entry for (hash, raw_size), or the empty slot it would take */
+static seen_t *seen_slot(seen_t *tab, size_t cap, uint64_t hash, uint32_t raw_size) {
+    size_t i = (size_t)hash & (cap - 1);
+    while (tab[i].raw_size && (tab[i].hash != hash || tab[i].raw_size != raw_size))
+        i = (i + 1) & (cap - 1);
+    return &tab[i];
+}
+
+/* Double the table (or start it), keeping its entries */
+static int seen_grow(odz_cctx_t *c) {
+    size_t cap = c->seen_cap ? c->seen_cap * 2 : 256;
+    seen_t *tab = calloc(cap, sizeof *tab);
+    if (!tab) return ODZ_ERR_OOM;
+    for (size_t i = 0; i < c->seen_cap; i++) {
+        const seen_t *e = &c->seen[i];
+        if (e->raw_size) *seen_slot(tab, cap, e->hash, e->raw_size) = *e;
+    }
+    free(c->seen);
+    c->seen = tab;
+    c->seen_cap = cap;
+    return ODZ_OK;
+}
+
+int odz_cctx_set_dedup(odz_cctx_t *c, int on) {
+    if (!on) {
+        free(c->seen);
+        c->seen = NULL;
+        c->seen_cap = c->seen_n = 0;
+        return ODZ_OK;
+    }
+    return c->seen ? ODZ_OK : seen_grow(c);
+}
+
+int odz_cctx_set_filters(odz_cctx_t *c, int on) {
+    c->filters = on;
+    return ODZ_OK;
+}
+
+int odz_cctx_set_fast_decode(odz_cctx_t *c, int on) {
+    c->max_bits = on ? HUFF_FLAT_BITS : HUFF_MAX_BITS;
+    return ODZ_OK;
+}
+
+int odz_cctx_set_threads(odz_cctx_t *c, int threads) {
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    for (int i = 0; i < c->threads - 1; i++) {
+        if (c->cw) bw_free(&c->cw[i]);
+        if (c->sm) lz_matcher_free(&c->sm[i]);
+    }
+    free(c->cw);
+    free(c->sm);
+    free(c->seg);
+    c->cw = NULL;
+    c->sm = NULL;
+    c->seg = NULL;
+    c->threads = threads;
+    if (threads == 1) return ODZ_OK;
+    c->cw = calloc((size_t)threads - 1, sizeof *c->cw);
+    c->sm = calloc((size_t)threads - 1, sizeof *c->sm);
+    c->seg = malloc((size_t)threads * sizeof *c->seg);
+    if (!c->cw || !c->sm || !c->seg) goto oom;
+    for (int i = 0; i < threads - 1; i++)
+        if (bw_init(&c->cw[i], 1024) != 0) goto oom;
+    return ODZ_OK;
+oom:
+    odz_cctx_set_threads(c, 1);
+    return ODZ_ERR_OOM;
+}
+
+int odz_cctx_set_archive(odz_cctx_t *c, int on) {
+    if (!on) {
+        lzrc_enc_free(c->lzrc);
+        c->lzrc = NULL;
+        return ODZ_OK;
+    }
+    if (!c->lzrc && !(c->lzrc = lzrc_enc_new())) return ODZ_ERR_OOM;
+    return ODZ_OK;
+}
+
+/* File header: "ODZ" version(1) flags(1) block_log(1) original_size(8)
+ * [nonce_prefix(8) when encrypted], or a patch frame header */
+static int write_header(odz_cctx_t *c, odz_sink_t *out, uint64_t original_size) {
+    uint8_t *hdr = c->hdr;
+    size_t len = ODZ_HEADER_SIZE;
+    hdr[0] = 'O'; hdr[1] = 'D'; hdr[2] = c->patch ? 'P' : 'Z'; hdr[3] = ODZ_VERSION;
+    hdr[4] = c->gear ? ODZ_FLAG_RSYNCABLE : 0;
+    if (c->hashes && !c->gcm) hdr[4] |= ODZ_FLAG_BLOCK_HASH;
+    if (c->seen && !c->gcm) {
+        hdr[4] |= ODZ_FLAG_COPIES;
+        memset(c->seen, 0, c->seen_cap * sizeof *c->seen);
+        c->seen_n = 0;
+    }
+    c->block_index = 0;
+    c->frame_in = 0;
+    hdr[5] = (uint8_t)c->block_log;
+    if (c->filters && !c->ldm) hdr[5] |= ODZ_LOG_FILTERS;
+    wr_u64le(hdr + 6, original_size);
+    if (c->ldm) {
+        int wlog = c->ldm->window_log;
+        hdr[4] |= (uint8_t)((wlog - 15) << ODZ_WINDOW_SHIFT);
+        if (ldm_reset(c->ldm, wlog, original_size + c->ref_size) != 0) return ODZ_ERR_OOM;
+    }
+    if (c->patch) {
+        uint8_t ref[ODZ_PATCH_REF_SIZE];
+        wr_u64le(ref, c->ref_size);
+        wr_u32le(ref + 8, c->ref_crc);
+        int rc = odz_sink_write(out, hdr, len);
+        return rc == ODZ_OK ? odz_sink_write(out, ref, sizeof ref) : rc;
+    }
+    if (c->gcm) {
+        /* A fresh random prefix per frame keeps nonces unique per key */
+        hdr[4] |= ODZ_FLAG_ENCRYPTED;
+        int rc = odz_random(hdr + ODZ_HEADER_SIZE, ODZ_NONCE_PREFIX);
+        if (rc != ODZ_OK) return rc;
+        len = ODZ_HEADER_SIZE_ENC;
+    }
+    return odz_sink_write(out, hdr, len);
+}
+
+/* Write a block header and its data, sealing the data (followed by its
+ * tag) when encrypting. */
+static int write_block(odz_cctx_t *c, odz_sink_t *out,
+                       const uint8_t *blk_hdr, size_t hlen,
+                       const uint8_t *data, size_t n) {
+    int rc = odz_sink_write(out, blk_hdr, hlen);
+    if (rc != ODZ_OK) return rc;
+    uint32_t i = c->block_index++;
+    if (!c->gcm) return n ? odz_sink_write(out, data, n) : ODZ_OK;
+
+    /* Encrypt in c->bw: compressed data is already there, stored blocks
+     * are copied in (the caller's input is read-only) */
+    if (data != c->bw.buf && n > 0) {
+        bw_reset(&c->bw);
+        if (bw_append(&c->bw, data, (uint64_t)n * 8) != 0) return ODZ_ERR_OOM;
+    }
+    if (i == UINT32_MAX) return ODZ_ERR_PARAM;   /* out of nonces */
+
+    uint8_t nonce[GCM_NONCE_SIZE], aad[ODZ_HEADER_SIZE_ENC + ODZ_BLOCK_HEADER_MAX];
+    uint8_t tag[GCM_TAG_SIZE];
+    memcpy(nonce, c->hdr + ODZ_HEADER_SIZE, ODZ_NONCE_PREFIX);
+    nonce[8] = (uint8_t)(i >> 24); nonce[9] = (uint8_t)(i >> 16);
+    nonce[10] = (uint8_t)(i >> 8); nonce[11] = (uint8_t)i;
+    memcpy(aad, c->hdr, ODZ_HEADER_SIZE_ENC);
+    memcpy(aad + ODZ_HEADER_SIZE_ENC, blk_hdr, hlen);
+    gcm_seal(c->gcm, nonce, aad, ODZ_HEADER_SIZE_ENC + hlen,
+             c->bw.buf, c->bw.buf, n, tag);
+
+    if ((rc = odz_sink_write(out, c->bw.buf, n)) != ODZ_OK) return rc;
+    return odz_sink_write(out, tag, GCM_TAG_SIZE);
+}
+
+/* Does the frame's input at offset hold blk[0..n)? Compared byte for
+ * byte, so a hash collision can't make a wrong copy block. */
+static int same_data(odz_cctx_t *c, uint64_t offset, const uint8_t *blk, size_t n,
+                     int *same) {
+    if (c->src) {
+        *same = memcmp(c->src + offset, blk, n) == 0;
+        return ODZ_OK;
+    }
+    if (n > c->cmp_cap) {
+        free(c->cmp_buf);
+        c->cmp_buf = malloc(n);
+        c->cmp_cap = c->cmp_buf ? n : 0;
+        if (!c->cmp_buf) return ODZ_ERR_OOM;
+    }
+    int64_t pos = ftello(c->in);
+    if (pos < 0 || fseeko(c->in, (int64_t)offset, SEEK_SET) != 0 ||
+        fread(c->cmp_buf, 1, n, c->in) != n || fseeko(c->in, pos, SEEK_SET) != 0)
+        return ODZ_ERR_IO;
+    *same = memcmp(c->cmp_buf, blk, n) == 0;
+    return ODZ_OK;
+}
+
+/* Write blk[0..n) (at offset in the frame's input) as a copy block if an
+ * earlier block of the frame holds the same data (*done = 1), else
+ * remember it for the blocks after it. */
+static int dedup_block(odz_cctx_t *c, const uint8_t *blk, size_t n, size_t hist,
+                       uint64_t hash, uint64_t offset, int is_last, odz_sink_t *out,
+                       int *done) {
+    *done = 0;
+    seen_t *e = seen_slot(c->seen, c->seen_cap, hash, (uint32_t)n);
+    if (!e->raw_size) {
+        if (c->block_index == UINT32_MAX) return ODZ_OK;   /* can't be named */
+        *e = (seen_t){ hash, offset, (uint32_t)n, c->block_index };
+        return ++c->seen_n * 2 > c->seen_cap ? seen_grow(c) : ODZ_OK;
+    }
+    int same, rc = same_data(c, e->offset, blk, n, &same);
+    if (rc != ODZ_OK || !same) return rc;
+
+    /* The long-distance index still has to see the data */
+    size_t nlong;
+    if (c->ldm && ldm_find(c->ldm, blk, n, hist, &nlong) != 0) return ODZ_ERR_OOM;
+
+    uint8_t blk_hdr[ODZ_BLOCK_HEADER_MAX];
+    size_t hlen = 9;
+    blk_hdr[0] = (uint8_t)((is_last ? 1 : 0) | (ODZ_BLOCK_COPY << 1));
+    wr_u32le(blk_hdr + 1, (uint32_t)n);
+    wr_u32le(blk_hdr + 5, e->index);
+    if (c->hdr[4] & ODZ_FLAG_BLOCK_HASH) {
+        wr_u64le(blk_hdr + hlen, hash);
+        hlen += 8;
+    }
+    *done = 1;
+    return write_block(c, out, blk_hdr, hlen, NULL, 0);
+}
+
+/* Filters are tried on FILTER_SLICES pieces spread over the block, an
+ * eighth of it up to FILTER_SAMPLE bytes in all: blocks are often a mix
+ * of code, tables and text, which one piece wouldn't show */
+#define FILTER_SLICES  8
+#define FILTER_SAMPLE  32768
+
+/* Order-0 Huffman cost of p[0..n) in bits: a quick guess at which delta
+ * stride helps most */
+static uint64_t byte_cost(const uint8_t *p, size_t n) {
+    uint32_t freq[256] = {0};
+    uint8_t lens[256];
+    for (size_t i = 0; i < n; i++) freq[p[i]]++;
+    huff_build_lengths(freq, 256, HUFF_MAX_BITS, lens);
+    return code_cost(freq, lens, 256);
+}
+
+/* Pick the filter for blk[0..n): compress a sample unfiltered, through
+ * the delta stride with the cheapest order-0 cost (if cheaper than none)
+ * and through the x86 filter (if the sample has enough E8/E9 operands
+ * that it converts), and keep the smallest if it saves over 1.5%.
+ * Leaves the filtered block in c->filt_buf. */
+static int pick_filter(odz_cctx_t *c, const uint8_t *blk, size_t n, int *filter) {
+    *filter = ODZ_FILTER_NONE;
+    size_t len = n / 8 < FILTER_SAMPLE ? n / 8 : FILTER_SAMPLE;
+    if (len < 4096) len = n < 4096 ? n : 4096;
+    if (n + len > c->filt_cap) {
+        free(c->filt_buf);
+        c->filt_buf = malloc(n + len);
+        c->filt_cap = c->filt_buf ? n + len : 0;
+        if (!c->filt_buf) return ODZ_ERR_OOM;
+    }
+    /* The sample goes after room for the filtered block */
+    uint8_t *sample = c->filt_buf + n, *tmp = c->filt_buf;
+    size_t slice = len / FILTER_SLICES;
+    if (len < n) {
+        for (int k = 0; k < FILTER_SLICES; k++)
+            memcpy(sample + k * slice, blk + (n - slice) / (FILTER_SLICES - 1) * k, slice);
+        len = slice * FILTER_SLICES;
+    } else {
+        memcpy(sample, blk, n);
+    }
+
+    int cand[2], ncand = 0;
+    uint64_t best_cost = byte_cost(sample, len);
+    int delta = ODZ_FILTER_NONE;
+    for (int id = ODZ_FILTER_DELTA; id <= ODZ_FILTER_MAX; id++) {
+        filter_encode(id, sample, tmp, len);
+        uint64_t cost = byte_cost(tmp, len);
+        if (cost < best_cost) { best_cost = cost; delta = id; }
+    }
+    if (delta != ODZ_FILTER_NONE) cand[ncand++] = delta;
+
+    size_t calls = 0;
+    for (size_t i = 0; i + 5 <= len; i++)
+        if ((sample[i] & 0xFE) == 0xE8 && (sample[i + 4] == 0x00 || sample[i + 4] == 0xFF))
+            calls++;
+    if (calls >= len / 128) cand[ncand++] = ODZ_FILTER_X86;
+    if (ncand == 0) return ODZ_OK;
+
+    int type, err;
+    size_t best = compress_block(c, sample, len, 0, 1, NULL, &type, &err);
+    if (err) return err;
+    best -= best / 64;      /* what a filter has to beat */
+    for (int k = 0; k < ncand; k++) {
+        filter_encode(cand[k], sample, tmp, len);
+        size_t size = compress_block(c, tmp, len, 0, 1, NULL, &type, &err);
+        if (err) return err;
+        if (size < best) { best = size; *filter = cand[k]; }
+    }
+    if (*filter != ODZ_FILTER_NONE) filter_encode(*filter, blk, c->filt_buf, n);
+    return ODZ_OK;
+}
+
+/* Compress one block into c->bw as an archive block, like compress_block.
+ * Long and rep matches reach back a window into in[-hist..0) in
+ * long-distance frames. */
+static size_t compress_block_lzrc(odz_cctx_t *c, const uint8_t *in, size_t n, size_t hist,
+                                  int *err) {
+    *err = 0;
+    const ldm_match_t *lm = NULL;
+    size_t nlong = 0;
+    if (c->ldm) {
+        if (ldm_find(c->ldm, in, n, hist, &nlong) != 0) {
+            *err = ODZ_ERR_OOM;
+            return 0;
+        }
+        lm = c->ldm->matches;
+        size_t window = (size_t)1 << c->ldm->window_log;
+        if (hist > window) hist = window;
+    } else {
+        hist = 0;
+    }
+    if (lzrc_compress(c->lzrc, in, n, hist, lm, nlong, &c->bw) != 0) {
+        *err = ODZ_ERR_OOM;
+        return 0;
+    }
+    return c->bw.pos;
+}
+
+/* Length of the block at p, with n bytes of input from there on */
+static size_t block_len(const odz_cctx_t *c, const uint8_t *p, size_t n) {
+    size_t block_size = (size_t)1 << c->block_log;
+    if (c->gear) return next_cut(c, p, n);
+    return n < block_size ? n : block_size;
+}
+
+/* Can the next block's LZ pass run while this one is coded? Not when
+ * the next block might not be compressed as it is: filters and dedup
+ * decide that block by block, and archive blocks have no LZ pass of
+ * their own. */
+static int pipelined(const odz_cctx_t *c) {
+    return c->threads > 1 && !c->filters && !c->seen && !c->lzrc;
+}
+
+/* Compress one block and write it (header + data) to out, falling back to
+ * a stored block when compression doesn't pay for its bigger header, or
+ * write a copy block in its place when deduplicating.
+ * blk[-hist..0) is the frame's earlier data, and next the next block, as
+ * for compress_block. */
+static int emit_block(odz_cctx_t *c, const uint8_t *blk, size_t n, size_t hist,
+                      int is_last, const next_block_t *next, odz_sink_t *out) {
+    uint64_t hash = 0, offset = c->frame_in;
+    c->frame_in += n;
+    if (c->hdr[4] & (ODZ_FLAG_BLOCK_HASH | ODZ_FLAG_COPIES)) hash = odz_hash64(blk, n);
+    if (c->hdr[4] & ODZ_FLAG_COPIES) {
+        int done, rc = dedup_block(c, blk, n, hist, hash, offset, is_last, out, &done);
+        if (rc != ODZ_OK || done) return rc;
+    }
+
+    /* Filtered frames are never long-distance ones: hist is no use */
+    int filter = ODZ_FILTER_NONE;
+    if (c->hdr[5] & ODZ_LOG_FILTERS) {
+        int rc = pick_filter(c, blk, n, &filter);
+        if (rc != ODZ_OK) return rc;
+    }
+
+    int blk_type = ODZ_BLOCK_LZRC, blk_err;
+    const uint8_t *src = filter ? c->filt_buf : blk;
+    size_t comp_size = c->lzrc ? compress_block_lzrc(c, src, n, hist, &blk_err)
+                               : compress_block(c, src, n, hist, 1, next, &blk_type, &blk_err);
+    if (blk_err) return blk_err;
+
+    /* Block header: flags(1) + raw_size(4) [+ comp_size(4)] [+ hash(8)].
+     * Stored (unfiltered) if compression didn't help. */
+    uint8_t blk_hdr[ODZ_BLOCK_HEADER_MAX];
+    int coded = comp_size + 9 < n + 5;
+    blk_hdr[0] = (uint8_t)((is_last ? 1 : 0) | ((coded ? blk_type : ODZ_BLOCK_STORED) << 1) |
+                           (coded ? filter << 4 : 0));
+    wr_u32le(blk_hdr + 1, (uint32_t)n);
+    size_t hlen = 5;
+    if (coded) {
+        wr_u32le(blk_hdr + 5, (uint32_t)comp_size);
+        hlen = 9;
+    }
+    if (c->hdr[4] & ODZ_FLAG_BLOCK_HASH) {
+        wr_u64le(blk_hdr + hlen, hash);
+        hlen += 8;
+    }
+    if (coded) return write_block(c, out, blk_hdr, hlen, c->bw.buf, comp_size);
+    return write_block(c, out, blk_hdr, hlen, blk, n);
+}
+
+/* Empty input: one empty stored block */
+static int emit_empty(odz_cctx_t *c, odz_sink_t *out) {
+    uint8_t blk_hdr[ODZ_BLOCK_HEADER_MAX];
+    size_t hlen = 5;
+    blk_hdr[0] = 1 | (ODZ_BLOCK_STORED << 1);  /* is_last + stored */
+    wr_u32le(blk_hdr + 1, 0);
+    if (c->hdr[4] & ODZ_FLAG_BLOCK_HASH) {
+        wr_u64le(blk_hdr + hlen, odz_hash64("", 0));
+        hlen += 8;
+    }
+    return write_block(c, out, blk_hdr, hlen, NULL, 0);
+}
+
+int odz_compress_mem(odz_cctx_t *c, const uint8_t *src, size_t n,
+                     odz_sink_t *out) {
+    int rc = write_header(c, out, (uint64_t)n);
+    if (rc != ODZ_OK) return rc;
+    if (n == 0) return emit_empty(c, out);
+    c->src = src;
+
+    /* Blocks are compressed straight out of the caller's buffer, with all
+     * of the data before them as history */
+    c->ahead = 0;
+    for (size_t pos = 0, len; pos < n; pos += len) {
+        len = block_len(c, src + pos, n - pos);
+        next_block_t next = { src + pos + len, 0, pos + len };
+        if (pipelined(c) && pos + len < n) next.n = block_len(c, next.in, n - pos - len);
+        rc = emit_block(c, src + pos, len, pos, pos + len == n, next.n ? &next : NULL, out);
+        if (rc != ODZ_OK) return rc;
+    }
+    return ODZ_OK;
+}
+
+/* ── DEFLATE / zlib / gzip writer ──────────────────────────── */
+
+/* Append one block to the DEFLATE stream in c->zw: the compressed body
+ * behind a BFINAL/BTYPE header, or stored blocks if those are smaller. */
+static int deflate_block(odz_cctx_t *c, const uint8_t *blk, size_t n, int is_last,
+                         const next_block_t *next) {
+    bit_writer_t *zw = &c->zw;
+    int blk_type, blk_err;
+    compress_block(c, blk, n, 0, 0, next, &blk_type, &blk_err);
+    if (blk_err) return blk_err;
+
+    /* Stored: per 64K piece, header + worst-case alignment + LEN/NLEN */
+    uint64_t stored_bits = (uint64_t)n * 8 + (uint64_t)((n + 65534) / 65535) * 42;
+    if (c->bits + 3 < stored_bits) {
+        uint32_t btype = blk_type == ODZ_BLOCK_FIXED ? 1 : 2;
+        if (bw_write(zw, (uint32_t)is_last | (btype << 1), 3) != 0 ||
+            bw_append(zw, c->bw.buf, c->bits) != 0)
+            return ODZ_ERR_OOM;
+        return ODZ_OK;
+    }
+
+    /* Stored blocks hold at most 65535 bytes each */
+    do {
+        size_t len = n < 65535 ? n : 65535;
+        uint32_t final = is_last && len == n;
+        if (bw_write(zw, final, 3) != 0 || bw_flush(zw) != 0 ||
+            bw_write(zw, (uint32_t)len, 16) != 0 ||
+            bw_write(zw, (uint32_t)~len & 0xFFFF, 16) != 0 ||
+            bw_append(zw, blk, (uint64_t)len * 8) != 0)
+            return ODZ_ERR_OOM;
+        blk += len;
+        n -= len;
+    } while (n > 0);
+    return ODZ_OK;
+}
+
+/* Empty stored block: byte-aligns the stream so that what follows doesn't
+ * depend on the bit length of what came before (zlib's sync flush) */
+static int deflate_sync(odz_cctx_t *c) {
+    bit_writer_t *zw = &c->zw;
+    if (bw_write(zw, 0, 3) != 0 || bw_flush(zw) != 0 ||
+        bw_write(zw, 0, 16) != 0 || bw_write(zw, 0xFFFF, 16) != 0)
+        return ODZ_ERR_OOM;
+    return ODZ_OK;
+}
+
+/* Write out the whole bytes of c->zw, keeping the pending bits */
+static int deflate_drain(odz_cctx_t *c, odz_sink_t *out) {
+    int rc = odz_sink_write(out, c->zw.buf, c->zw.pos);
+    c->zw.pos = 0;
+    return rc;
+}
+
+static int write_wrap_header(int format, odz_sink_t *out) {
+    static const uint8_t gz[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255 };
+    static const uint8_t zl[2]  = { 0x78, 0x9c };   /* 32K window, default level */
+    if (format == ODZ_FMT_GZIP) return odz_sink_write(out, gz, sizeof gz);
+    if (format == ODZ_FMT_ZLIB) return odz_sink_write(out, zl, sizeof zl);
+    return ODZ_OK;
+}
+
+/* Finish the DEFLATE stream and write the format's trailer */
+static int write_wrap_trailer(odz_cctx_t *c, int format, odz_sink_t *out,
+                              uint32_t check, uint64_t total) {
+    if (bw_flush(&c->zw) != 0) return ODZ_ERR_OOM;
+    int rc = deflate_drain(c, out);
+    if (rc != ODZ_OK) return rc;
+
+    uint8_t t[8];
+    if (format == ODZ_FMT_GZIP) {
+        wr_u32le(t, check);
+        wr_u32le(t + 4, (uint32_t)total);   /* ISIZE is mod 2^32 */
+        return odz_sink_write(out, t, 8);
+    }
+    if (format == ODZ_FMT_ZLIB) {
+        t[0] = (uint8_t)(check >> 24); t[1] = (uint8_t)(check >> 16);
+        t[2] = (uint8_t)(check >> 8);  t[3] = (uint8_t)check;
+        return odz_sink_write(out, t, 4);
+    }
+    return ODZ_OK;
+}
+
+/* ── Incremental update ────────────────────────────────────── */
+
+/* Blocks of an existing stream that odz_update copies rather than
+ * recompressing */
+typedef struct {
+    FILE            *old;
+    odz_block_ref_t *refs;      /* sorted by hash, then raw_size */
+    size_t           n;
+    uint8_t         *buf;       /* holds one old block */
+    uint64_t         reused;    /* raw bytes copied so far */
+} reuse_t;
+
+static int ref_cmp(const void *a, const void *b) {
+    const odz_block_ref_t *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->raw_size < y->raw_size ? -1 : x->raw_size > y->raw_size;
+}
+
+/* Copy an old block holding exactly blk[0..n) to out, byte for byte but
+ * for its last-block flag. *done = 0 if there is no such block. */
+static int reuse_block(reuse_t *r, const uint8_t *blk, size_t n, int is_last,
+                       odz_sink_t *out, int *done) {
+    odz_block_ref_t key = { .hash = odz_hash64(blk, n), .raw_size = (uint32_t)n };
+    const odz_block_ref_t *ref = bsearch(&key, r->refs, r->n, sizeof key, ref_cmp);
+    *done = 0;
+    if (!ref) return ODZ_OK;
+
+    if (fseeko(r->old, (int64_t)ref->offset, SEEK_SET) != 0 ||
+        fread(r->buf, 1, ref->len, r->old) != ref->len)
+        return ODZ_ERR_IO;
+    r->buf[0] = (uint8_t)((r->buf[0] & ~1) | (is_last ? 1 : 0));
+    *done = 1;
+    r->reused += n;
+    return odz_sink_write(out, r->buf, ref->len);
+}
+
 /* ── Public API ────────────────────────────────────────────── */
 
-int odz_compress(FILE *in, FILE *out, const odz_options_t *opts) {
+size_t odz_compress_bound(size_t n) {
+    /* header + every block stored at the smallest block size
+     * (+ one empty block for n == 0), with room for a tag or hash per
+     * block and for the shortest rsyncable blocks */
+    return ODZ_HEADER_SIZE_ENC + n +
+           (5 + ODZ_TAG_SIZE) * ((n >> (ODZ_MIN_BLOCK_LOG - RSYNC_MIN_SHIFT)) + 1);
+}
+
+/* Size and CRC-32 of all of f */
+static int file_crc32(FILE *f, uint64_t *size, uint32_t *crc) {
+    uint8_t *buf = malloc(1 << 16);
+    if (!buf) return ODZ_ERR_OOM;
+    *size = 0;
+    *crc = 0;
+    int rc = fseeko(f, 0, SEEK_SET) != 0 ? ODZ_ERR_IO : ODZ_OK;
+    for (size_t got; rc == ODZ_OK && (got = fread(buf, 1, 1 << 16, f)) > 0; ) {
+        *crc = odz_crc32(*crc, buf, got);
+        *size += got;
+    }
+    if (ferror(f)) rc = ODZ_ERR_IO;
+    free(buf);
+    return rc;
+}
+
+/* odz_compress, or odz_update when r is set: blocks found in r are
+ * copied from the old stream instead of being compressed again; or
+ * odz_patch_create when ref is set. */
+static int compress_file(FILE *in, FILE *out, const odz_options_t *opts,
+                         int block_log, int rsyncable, reuse_t *r, FILE *ref) {
     int rc = ODZ_OK;
+    size_t block_size = (size_t)1 << block_log;
 
     /* Get input size */
     if (fseeko(in, 0, SEEK_END) != 0) return ODZ_ERR_IO;
@@ -170,52 +1845,138 @@ int odz_compress(FILE *in, FILE *out, const odz_options_t *opts) {
     if (in_size < 0) return ODZ_ERR_IO;
     if (fseeko(in, 0, SEEK_SET) != 0) return ODZ_ERR_IO;
 
-    /* Write file header: "ODZ" version(1) original_size(8) */
-    uint8_t hdr[12];
-    hdr[0] = 'O'; hdr[1] = 'D'; hdr[2] = 'Z'; hdr[3] = ODZ_VERSION;
-    wr_u64le(hdr + 4, (uint64_t)in_size);
-    if (fwrite(hdr, 1, 12, out) != 12) return ODZ_ERR_IO;
+    int format = opts ? opts->format : ODZ_FMT_ODZ;
+    if (format < ODZ_FMT_ODZ || format > ODZ_FMT_DEFLATE) return ODZ_ERR_PARAM;
+    uint32_t check = format == ODZ_FMT_ZLIB ? 1 : 0;
+
+    if (opts && opts->key && format != ODZ_FMT_ODZ) return ODZ_ERR_PARAM;
+    int window_log;
+    if ((rc = odz_window_log(opts, &window_log)) != ODZ_OK) return rc;
+    if (window_log && format != ODZ_FMT_ODZ) return ODZ_ERR_PARAM;
+    int dedup = opts && opts->dedup;
+    if (dedup && format != ODZ_FMT_ODZ) return ODZ_ERR_PARAM;
+    int filters = opts && opts->filters;
+    if (filters && format != ODZ_FMT_ODZ) return ODZ_ERR_PARAM;
+    int archive = opts && opts->archive;
+    if (archive && format != ODZ_FMT_ODZ) return ODZ_ERR_PARAM;
+
+    /* A patch's window covers its reference and input */
+    uint64_t ref_size = 0;
+    uint32_t ref_crc = 0;
+    if (ref) {
+        if ((rc = file_crc32(ref, &ref_size, &ref_crc)) != ODZ_OK) return rc;
+        int wlog = ODZ_MIN_WINDOW_LOG;
+        while (wlog < ODZ_MAX_WINDOW_LOG && ((uint64_t)1 << wlog) < ref_size + (uint64_t)in_size)
+            wlog++;
+        if (wlog > window_log) window_log = wlog;
+    }
+
+    odz_cctx_t *c = odz_cctx_new(block_log);
+    if (!c) return ODZ_ERR_OOM;
+    c->hashes = 1;
+    if (opts && opts->key && (rc = odz_cctx_set_key(c, opts->key)) != ODZ_OK) goto cleanup;
+    if (rsyncable && (rc = odz_cctx_set_rsyncable(c, 1)) != ODZ_OK) goto cleanup;
+    if (window_log && (rc = odz_cctx_set_window(c, window_log)) != ODZ_OK) goto cleanup;
+    if (dedup && (rc = odz_cctx_set_dedup(c, 1)) != ODZ_OK) goto cleanup;
+    if (filters && (rc = odz_cctx_set_filters(c, 1)) != ODZ_OK) goto cleanup;
+    if (archive && (rc = odz_cctx_set_archive(c, 1)) != ODZ_OK) goto cleanup;
+    if (opts && opts->fast_decode && (rc = odz_cctx_set_fast_decode(c, 1)) != ODZ_OK)
+        goto cleanup;
+    if (opts && opts->threads > 1 && (rc = odz_cctx_set_threads(c, opts->threads)) != ODZ_OK)
+        goto cleanup;
+    c->in = in;
+    c->src = NULL;
+    c->patch = ref != NULL;
+    c->ref_size = ref_size;
+    c->ref_crc = ref_crc;
 
-    uint8_t *block_buf = malloc(ODZ_BLOCK_SIZE);
-    if (!block_buf) return ODZ_ERR_OOM;
+    odz_sink_t sink = { .f = out };
+    if (format == ODZ_FMT_ODZ) {
+        rc = write_header(c, &sink, (uint64_t)in_size);
+    } else {
+        rc = bw_init(&c->zw, 1024) != 0 ? ODZ_ERR_OOM : write_wrap_header(format, &sink);
+    }
+    if (rc != ODZ_OK) goto cleanup;
+
+    /* The buffer holds the block being read, behind up to a window of
+     * the data before it for long-distance matching, and the block after
+     * it when its LZ pass runs ahead. Never allocate more than the input
+     * needs. */
+    int pipe = pipelined(c) && !r;
+    size_t ahead = pipe ? block_size : 0;
+    size_t window = window_log ? (size_t)1 << window_log : 0;
+    size_t buf_size = (window ? odz_history_size(window_log, block_size) : block_size) + ahead;
+    if ((uint64_t)in_size + ref_size < buf_size) buf_size = (size_t)(in_size + ref_size);
+    c->block_buf = malloc(buf_size ? buf_size : 1);
+    if (!c->block_buf) { rc = ODZ_ERR_OOM; goto cleanup; }
 
     uint64_t total_in = 0;
 
     int wrote_any = 0;
+    size_t hist = 0;    /* data in front of the block */
+    size_t filled = 0;  /* read so far; rsyncable blocks leave a tail */
+
+    /* A patch's reference goes through the buffer first: history for the
+     * long-distance index, with nothing written for it */
+    if (ref) {
+        uint64_t total_ref = 0;
+        if (fseeko(ref, 0, SEEK_SET) != 0) { rc = ODZ_ERR_IO; goto cleanup; }
+        for (;;) {
+            if (hist + block_size > buf_size) {
+                size_t keep = hist < window ? hist : window;
+                memmove(c->block_buf, c->block_buf + hist - keep, keep);
+                hist = keep;
+            }
+            size_t room = buf_size - hist < block_size ? buf_size - hist : block_size;
+            size_t got = fread(c->block_buf + hist, 1, room, ref);
+            if (got == 0) break;
+            size_t nlong;
+            if (ldm_find(c->ldm, c->block_buf + hist, got, hist, &nlong) != 0) {
+                rc = ODZ_ERR_OOM;
+                goto cleanup;
+            }
+            hist += got;
+            total_ref += got;
+        }
+        /* Changed since its CRC was taken? */
+        if (ferror(ref) || total_ref != ref_size) { rc = ODZ_ERR_IO; goto cleanup; }
+    }
+
     for (;;) {
-        size_t nread = fread(block_buf, 1, ODZ_BLOCK_SIZE, in);
-        if (nread == 0) break;
+        if (hist + block_size + ahead > buf_size) {
+            /* Slide down, keeping the last window of history */
+            size_t keep = hist < window ? hist : window;
+            memmove(c->block_buf, c->block_buf + hist - keep, keep + filled);
+            hist = keep;
+        }
+        uint8_t *blk = c->block_buf + hist;
+        size_t room = buf_size - hist < block_size + ahead ? buf_size - hist : block_size + ahead;
+        filled += fread(blk + filled, 1, room - filled, in);
+        if (filled == 0) break;
         wrote_any = 1;
 
-        int is_last = (total_in + nread >= (uint64_t)in_size);
-
-        /* Try Huffman compression */
-        bit_writer_t bw;
-        if (bw_init(&bw, nread + 1024) != 0) { rc = ODZ_ERR_OOM; goto cleanup; }
-
-        int blk_err;
-        size_t comp_size = compress_block(block_buf, nread, &bw, &blk_err);
-        if (blk_err) { bw_free(&bw); rc = blk_err; goto cleanup; }
-
-        /* Block header: flags(1) + raw_size(4) */
-        uint8_t blk_hdr[9];
-        if (comp_size < nread) {
-            /* Use compressed block */
-            blk_hdr[0] = (uint8_t)((is_last ? 1 : 0) | (ODZ_BLOCK_HUFFMAN << 1));
-            wr_u32le(blk_hdr + 1, (uint32_t)nread);
-            wr_u32le(blk_hdr + 5, (uint32_t)comp_size);
-            if (fwrite(blk_hdr, 1, 9, out) != 9) { bw_free(&bw); rc = ODZ_ERR_IO; goto cleanup; }
-            if (fwrite(bw.buf, 1, comp_size, out) != comp_size) { bw_free(&bw); rc = ODZ_ERR_IO; goto cleanup; }
+        /* With a whole block (or the rest of the input) read after this
+         * one, that block's length is already known */
+        size_t len = block_len(c, blk, filled);
+        int is_last = (total_in + len >= (uint64_t)in_size);
+        next_block_t next = { blk + len, 0, format == ODZ_FMT_ODZ ? hist + len : 0 };
+        if (pipe && !is_last) next.n = block_len(c, next.in, filled - len);
+        const next_block_t *np = next.n ? &next : NULL;
+        if (format == ODZ_FMT_ODZ) {
+            int reused = 0;
+            if (r) rc = reuse_block(r, blk, len, is_last, &sink, &reused);
+            if (rc == ODZ_OK && !reused) rc = emit_block(c, blk, len, hist, is_last, np, &sink);
         } else {
-            /* Stored block (compression didn't help) */
-            blk_hdr[0] = (uint8_t)((is_last ? 1 : 0) | (ODZ_BLOCK_STORED << 1));
-            wr_u32le(blk_hdr + 1, (uint32_t)nread);
-            if (fwrite(blk_hdr, 1, 5, out) != 5) { bw_free(&bw); rc = ODZ_ERR_IO; goto cleanup; }
-            if (fwrite(block_buf, 1, nread, out) != nread) { bw_free(&bw); rc = ODZ_ERR_IO; goto cleanup; }
+            if (format == ODZ_FMT_GZIP) check = odz_crc32(check, blk, len);
+            if (format == ODZ_FMT_ZLIB) check = odz_adler32(check, blk, len);
+            rc = deflate_block(c, blk, len, is_last, np);
+            if (rc == ODZ_OK && c->gear && !is_last) rc = deflate_sync(c);
+            if (rc == ODZ_OK) rc = deflate_drain(c, &sink);
         }
-
-        bw_free(&bw);
-        total_in += nread;
+        if (rc != ODZ_OK) goto cleanup;
+        total_in += len;
+        filled -= len;
+        hist += len;
 
         /* Progress callback */
         if (opts && opts->progress) {
@@ -226,15 +1987,76 @@ int odz_compress(FILE *in, FILE *out, const odz_options_t *opts) {
         }
     }
 
-    /* Handle empty input: write one empty stored block */
-    if (!wrote_any) {
-        uint8_t blk_hdr[5];
-        blk_hdr[0] = 1 | (ODZ_BLOCK_STORED << 1);  /* is_last + stored */
-        wr_u32le(blk_hdr + 1, 0);
-        if (fwrite(blk_hdr, 1, 5, out) != 5) { rc = ODZ_ERR_IO; goto cleanup; }
+    if (format != ODZ_FMT_ODZ) {
+        /* Empty input: one final fixed block holding just end-of-block */
+        if (!wrote_any && bw_write(&c->zw, 1 | (1 << 1), 3 + 7) != 0) {
+            rc = ODZ_ERR_OOM;
+            goto cleanup;
+        }
+        rc = write_wrap_trailer(c, format, &sink, check, total_in);
+        goto cleanup;
     }
 
+    /* Handle empty input: write one empty stored block */
+    if (!wrote_any)
+        rc = emit_empty(c, &sink);
+
 cleanup:
-    free(block_buf);
+    odz_cctx_free(c);
     return rc;
 }
+
+int odz_compress(FILE *in, FILE *out, const odz_options_t *opts) {
+    int block_log;
+    int rc = odz_block_log(opts, &block_log);
+    if (rc != ODZ_OK) return rc;
+    return compress_file(in, out, opts, block_log, opts && opts->rsyncable, NULL, NULL);
+}
+
+int odz_patch_create(FILE *ref, FILE *in, FILE *out, const odz_options_t *opts) {
+    if (opts && (opts->key || opts->format != ODZ_FMT_ODZ)) return ODZ_ERR_PARAM;
+    int block_log;
+    int rc = odz_block_log(opts, &block_log);
+    if (rc != ODZ_OK) return rc;
+    return compress_file(in, out, opts, block_log, opts && opts->rsyncable, NULL, ref);
+}
+
+int odz_update(FILE *old, FILE *in, FILE *out, const odz_options_t *opts,
+               uint64_t *reused) {
+    if (opts && (opts->key || opts->window_size || opts->dedup || opts->filters ||
+                 opts->format != ODZ_FMT_ODZ))
+        return ODZ_ERR_PARAM;
+
+    /* Same block size and cut points as the old stream, so unchanged
+     * data falls into the same blocks */
+    reuse_t r = { .old = old };
+    int block_log, rsyncable;
+    int rc = odz_block_index(old, &r.refs, &r.n, &block_log, &rsyncable);
+    if (rc != ODZ_OK) return rc;
+    qsort(r.refs, r.n, sizeof *r.refs, ref_cmp);
+
+    uint32_t max_len = 0;
+    for (size_t i = 0; i < r.n; i++)
+        if (r.refs[i].len > max_len) max_len = r.refs[i].len;
+    r.buf = malloc(max_len ? max_len : 1);
+    if (!r.buf) {
+        free(r.refs);
+        return ODZ_ERR_OOM;
+    }
+
+    rc = compress_file(in, out, opts, block_log, rsyncable || (opts && opts->rsyncable), &r, NULL);
+    if (reused) *reused = r.reused;
+    free(r.buf);
+    free(r.refs);
+    return rc;
+}
+
+int odz_write_skippable(FILE *out, int kind, const void *data, size_t size) {
+    if (kind < 0 || kind > 255 || size > UINT32_MAX) return ODZ_ERR_PARAM;
+    uint8_t hdr[ODZ_SKIP_HEADER_SIZE];
+    hdr[0] = 'O'; hdr[1] = 'D'; hdr[2] = 'S'; hdr[3] = (uint8_t)kind;
+    wr_u32le(hdr + 4, (uint32_t)size);
+    if (fwrite(hdr, 1, sizeof hdr, out) != sizeof hdr) return ODZ_ERR_IO;
+    if (size && fwrite(data, 1, size, out) != size) return ODZ_ERR_IO;
+    return ODZ_OK;
+}
@@ -3,26 +3,62 @@
  *
  * For each block:
  *   1. Read block header (type, raw size, compressed size)
- *   2. For stored blocks: copy raw data
+ *   2. For stored blocks: copy raw data; for copy blocks, the output of
+ *      the earlier block they name (read back from a file output)
  *   3. For Huffman blocks: read trees, decode tokens, replay LZ
+ *      (fixed blocks skip the trees and use the fixed codes; ANS blocks
+ *      read counts and decode with tANS tables; context blocks pick one
+ *      of several literal/length tables by the byte before; sequence
+ *      blocks decode all their literals first, then the matches; archive
+ *      blocks go to the range decoder of lzrc.c), then undo the block's
+ *      filter, if any
+ *
+ * Encrypted blocks are authenticated and decrypted before step 2.
+ *
+ * Blocks of long-distance frames may copy from earlier blocks, so file
+ * output keeps up to a window of it in the block buffer, in front of the
+ * block being decoded. Patch frames start with their reference file
+ * there, as if it were earlier output.
+ *
+ * Raw DEFLATE, zlib and gzip streams go through the same token decoder,
+ * with a 32 KB sliding window in place of the odz block buffer.
  */
 
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _MSC_VER
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
 #include "libodzip.h"
 #include "odz.h"
 #include "bitstream.h"
 #include "huffman.h"
+#include "ans.h"
 #include "lz_tables.h"
+#include "lzrc.h"
+#include "filter.h"
+#include "aes_gcm.h"
 
-/* Decode one symbol using two-level table */
-static inline int huff_decode2(bit_reader_t *br,
+/* Decode loops specialized by table shape are instances of one body */
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define ALWAYS_INLINE __forceinline
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* Decode one symbol using two-level table, from bits already in br (at
+ * least HUFF_MAX_BITS of them) */
+static inline int huff_lookup2(bit_reader_t *br,
                                const huff_decode_table_t *t) {
-    uint32_t bits = br_peek(br, HUFF_MAX_BITS);
-    huff_entry_t e = t->primary[bits & ((1 << HUFF_PRIMARY_BITS) - 1)];
+    uint32_t bits = (uint32_t)br->bits;
+    huff_entry_t e = t->primary[bits & t->mask];
     if ((e.len & 0x8000) == 0) {
-        /* Primary hit (95%+ of cases) */
+        /* Primary hit (95%+ of cases, all of them with a flat table) */
         br_consume(br, e.len);
         return e.sym;
     }
@@ -35,31 +71,130 @@ static inline int huff_decode2(bit_reader_t *br,
     return se.sym;
 }
 
-/* Returns ODZ_OK on success, ODZ_ERR_* on failure */
-static int decompress_huffman_block(const uint8_t *comp, size_t comp_size,
-                                    uint8_t *out, size_t raw_size,
-                                    size_t *out_pos,
-                                    huff_decode_table_t *ll_tab,
-                                    huff_decode_table_t *d_tab) {
-    bit_reader_t br;
-    br_init(&br, comp, comp_size);
+/* huff_lookup2 for a table without secondary entries (secondary_size 0):
+ * one lookup and no branch */
+static inline int huff_lookup_flat(bit_reader_t *br,
+                                   const huff_decode_table_t *t) {
+    huff_entry_t e = t->primary[(uint32_t)br->bits & t->mask];
+    br_consume(br, e.len);
+    return e.sym;
+}
 
-    /* Read Huffman trees */
-    uint8_t ll_lens[LITLEN_SYMS], d_lens[DIST_SYMS];
-    int n_ll, n_dist;
-    if (huff_read_trees(&br, ll_lens, &n_ll, d_lens, &n_dist) != 0)
-        return ODZ_ERR_CORRUPT;
+/* Decode one symbol using two-level table */
+static inline int huff_decode2(bit_reader_t *br,
+                               const huff_decode_table_t *t) {
+    if (br->nbits < HUFF_MAX_BITS) br_refill(br);
+    return huff_lookup2(br, t);
+}
 
-    /* Build two-level decode tables */
-    if (huff_build_decode_table2(ll_lens, LITLEN_SYMS, ll_tab) != 0)
-        return ODZ_ERR_OOM;
-    if (huff_build_decode_table2(d_lens, DIST_SYMS, d_tab) != 0)
-        return ODZ_ERR_OOM;
+/* huff_decode2 with huff_lookup_flat if flat */
+static ALWAYS_INLINE int huff_decode_as(bit_reader_t *br,
+                                        const huff_decode_table_t *t, int flat) {
+    if (br->nbits < HUFF_MAX_BITS) br_refill(br);
+    return flat ? huff_lookup_flat(br, t) : huff_lookup2(br, t);
+}
 
-    /* Decode tokens */
+/* br_refill when 8 bytes of input are left, inline */
+static inline void br_refill_fast(bit_reader_t *r) {
+    uint64_t raw;
+    memcpy(&raw, r->buf + r->pos, 8);
+    r->bits |= raw << r->nbits;
+    int consumed = (64 - r->nbits) >> 3;
+    r->pos += (size_t)consumed;
+    r->nbits += consumed * 8;
+}
+
+/* Codes of a flat table one refill covers */
+#define FLAT_PER_REFILL  (57 / HUFF_FLAT_BITS)
+
+/* decode_tokens stopped between tokens to let the caller drain out[] */
+#define DECODE_FULL (-1)
+
+/* Base distance of distance code dcode (rep codes taken off) and its
+ * number of extra bits; -1 for a code out of range */
+static inline int dist_base(int dcode, int *ebits) {
+    if (dcode < 0) return -1;
+    if (dcode < DIST_SYMS) {
+        *ebits = extra_dbits[dcode];
+        return base_dist[dcode];
+    }
+    /* Long-distance frames only: the tables stop at 30 codes otherwise */
+    if (dcode >= 2 * ODZ_MAX_WINDOW_LOG) return -1;
+    return long_dist_base(dcode, ebits);
+}
+
+/* Replay a match of length bytes at dist into out[op..raw_size) */
+static inline int copy_match(uint8_t *out, size_t op, size_t raw_size,
+                             int dist, int length) {
+    if (dist <= 0 || (size_t)dist > op) return ODZ_ERR_CORRUPT;
+    if (op + (size_t)length > raw_size) return ODZ_ERR_CORRUPT;
+    size_t src = op - (size_t)dist;
+    if ((size_t)dist >= (size_t)length) {
+        /* Non-overlapping: straight memcpy */
+        memcpy(out + op, out + src, (size_t)length);
+    } else if (dist == 1) {
+        /* Byte fill (very common for runs) */
+        memset(out + op, out[src], (size_t)length);
+    } else {
+        /* Overlapping: copy in dist-sized chunks */
+        size_t rem = (size_t)length;
+        size_t d = (size_t)dist;
+        uint8_t *dst = out + op;
+        const uint8_t *s = out + src;
+        while (rem >= d) {
+            memcpy(dst, s, d);
+            dst += d;
+            rem -= d;
+        }
+        if (rem > 0) memcpy(dst, s, rem);
+    }
+    return ODZ_OK;
+}
+
+/* Body of decode_tokens, for tables of a known shape: flat, neither
+ * table has secondary entries; lits, the literal/length table has no
+ * length codes, so the block is literals up to its end */
+static ALWAYS_INLINE int decode_tokens_as(bit_reader_t *br,
+                                          const huff_decode_table_t *ll_tab,
+                                          const huff_decode_table_t *d_tab,
+                                          uint8_t *out, size_t raw_size, size_t stop,
+                                          size_t *out_pos, int *reps,
+                                          const int flat, const int lits) {
     size_t op = *out_pos;
+    if (lits) {
+        /* A few literals per refill while input and output last */
+        if (flat) {
+            while (br->pos + 8 <= br->len && op + FLAT_PER_REFILL <= stop) {
+                br_refill_fast(br);
+                for (int k = 0; k < FLAT_PER_REFILL; k++) {
+                    int sym = huff_lookup_flat(br, ll_tab);
+                    if (sym > 255) {
+                        if (sym != LITLEN_END) return ODZ_ERR_CORRUPT;
+                        *out_pos = op;
+                        return ODZ_OK;
+                    }
+                    out[op++] = (uint8_t)sym;
+                }
+            }
+        }
+        for (;;) {
+            if (op > stop) { *out_pos = op; return DECODE_FULL; }
+            int sym = huff_decode_as(br, ll_tab, flat);
+            if (sym > 255) {
+                if (sym != LITLEN_END) return ODZ_ERR_CORRUPT;
+                break;
+            }
+            if (op >= raw_size) return ODZ_ERR_CORRUPT;
+            out[op++] = (uint8_t)sym;
+        }
+        *out_pos = op;
+        return ODZ_OK;
+    }
+
+    /* Decode tokens */
     for (;;) {
-        int sym = huff_decode2(&br, ll_tab);
+        if (op > stop) { *out_pos = op; return DECODE_FULL; }
+        int sym = huff_decode_as(br, ll_tab, flat);
 
         if (sym < 256) {
             /* Literal */
@@ -74,38 +209,24 @@ static int decompress_huffman_block(const uint8_t *comp, size_t comp_size,
             if (code_idx < 0 || code_idx >= 29) return ODZ_ERR_CORRUPT;
             int length = base_length[code_idx];
             if (extra_lbits[code_idx] > 0)
-                length += (int)br_read(&br, extra_lbits[code_idx]);
+                length += (int)br_read(br, extra_lbits[code_idx]);
 
-            /* Distance code */
-            int dcode = huff_decode2(&br, d_tab);
-            if (dcode < 0 || dcode >= 30) return ODZ_ERR_CORRUPT;
-            int dist = base_dist[dcode];
-            if (extra_dbits[dcode] > 0)
-                dist += (int)br_read(&br, extra_dbits[dcode]);
-
-            /* Copy match */
-            if (dist <= 0 || (size_t)dist > op) return ODZ_ERR_CORRUPT;
-            if (op + (size_t)length > raw_size) return ODZ_ERR_CORRUPT;
-            size_t src = op - (size_t)dist;
-            if ((size_t)dist >= (size_t)length) {
-                /* Non-overlapping: straight memcpy */
-                memcpy(out + op, out + src, (size_t)length);
-            } else if (dist == 1) {
-                /* Byte fill (very common for runs) */
-                memset(out + op, out[src], (size_t)length);
+            /* Distance code, or a rep code */
+            int dcode = huff_decode_as(br, d_tab, flat);
+            int dist;
+            if (reps && dcode < REP_CODES) {
+                dist = reps[dcode];
             } else {
-                /* Overlapping: copy in dist-sized chunks */
-                size_t rem = (size_t)length;
-                size_t d = (size_t)dist;
-                uint8_t *dst = out + op;
-                const uint8_t *s = out + src;
-                while (rem >= d) {
-                    memcpy(dst, s, d);
-                    dst += d;
-                    rem -= d;
-                }
-                if (rem > 0) memcpy(dst, s, rem);
+                int ebits = 0;
+                dist = dist_base(reps ? dcode - REP_CODES : dcode, &ebits);
+                if (dist < 0) return ODZ_ERR_CORRUPT;
+                if (ebits > 0) dist += (int)br_read(br, ebits);
             }
+            if (reps) rep_update(reps, dist);
+
+            /* Copy match */
+            int rc = copy_match(out, op, raw_size, dist, length);
+            if (rc != ODZ_OK) return rc;
             op += (size_t)length;
         }
     }
@@ -113,94 +234,1312 @@ static int decompress_huffman_block(const uint8_t *comp, size_t comp_size,
     return ODZ_OK;
 }
 
-/* ── Public API ────────────────────────────────────────────── */
+/* Decode tokens until end-of-block, replaying matches into out[0..raw_size)
+ * from *out_pos on; matches may reach back to out[0].
+ * If *out_pos passes stop first, returns DECODE_FULL between two tokens;
+ * odz blocks pass stop = raw_size, which never triggers.
+ * reps: the rep list of a rep-match block, NULL for plain distance codes.
+ * Runs the loop for the tables' shape: flat tables (short codes, as with
+ * the fixed codes or --fast-decode) skip the secondary lookup, and blocks
+ * without length codes the match path.
+ * Returns ODZ_OK on success, ODZ_ERR_* on failure */
+static int decode_tokens(bit_reader_t *br,
+                         const huff_decode_table_t *ll_tab,
+                         const huff_decode_table_t *d_tab,
+                         uint8_t *out, size_t raw_size, size_t stop,
+                         size_t *out_pos, int *reps) {
+    int lits = ll_tab->max_sym <= LITLEN_END;
+    int flat = ll_tab->secondary_size == 0 && (lits || d_tab->secondary_size == 0);
+    if (lits) {
+        return flat ? decode_tokens_as(br, ll_tab, d_tab, out, raw_size, stop, out_pos, reps, 1, 1)
+                    : decode_tokens_as(br, ll_tab, d_tab, out, raw_size, stop, out_pos, reps, 0, 1);
+    }
+    return flat ? decode_tokens_as(br, ll_tab, d_tab, out, raw_size, stop, out_pos, reps, 1, 0)
+                : decode_tokens_as(br, ll_tab, d_tab, out, raw_size, stop, out_pos, reps, 0, 0);
+}
 
-int odz_decompress(FILE *in, FILE *out, const odz_options_t *opts) {
-    int rc = ODZ_OK;
-    uint8_t *block_out = NULL;
-    uint8_t *comp = NULL;
+/* ANS block: the counts of both alphabets, then the tokens of a rep
+ * block read backwards (ans.h), literal/length symbols alternating
+ * between two states. tab holds both decode tables.
+ * Returns ODZ_OK on success, ODZ_ERR_* on failure */
+static int decompress_ans_block(const uint8_t *comp, size_t comp_size,
+                                uint8_t *out, size_t raw_size, size_t *out_pos,
+                                ans_dec_t *tab, int dist_codes) {
+    bit_reader_t br;
+    br_init(&br, comp, comp_size);
+    int nd = REP_CODES + dist_codes;
+    uint16_t ll_norm[LITLEN_SYMS], d_norm[DIST_SYMS_MAX];
+    int ll_log, d_log;
+    if (ans_read_counts(&br, ll_norm, LITLEN_SYMS, &ll_log) != 0 ||
+        ans_read_counts(&br, d_norm, nd, &d_log) != 0 || br.nbits < 0)
+        return ODZ_ERR_CORRUPT;
+
+    /* The symbols start at the byte after the counts */
+    size_t start = br.pos - (size_t)(br.nbits >> 3);
+    ans_reader_t r;
+    if (ans_reader_init(&r, comp + start, comp_size - start) != 0) return ODZ_ERR_CORRUPT;
+    ans_dec_t *ll_tab = tab, *d_tab = tab + ((size_t)1 << ANS_MAX_TABLE_LOG);
+    ans_build_dec(ll_tab, ll_norm, LITLEN_SYMS, ll_log);
+    ans_build_dec(d_tab, d_norm, nd, d_log);
+
+    uint32_t ls[2], ds;
+    ls[0] = ans_read(&r, ll_log);
+    ls[1] = ans_read(&r, ll_log);
+    ds = ans_read(&r, d_log);
+
+    int reps[REP_CODES];
+    memcpy(reps, rep_init, sizeof reps);
+    size_t op = *out_pos;
+    for (size_t j = 0;; j++) {
+        int sym = ans_get(&r, ll_tab, &ls[j & 1]);
+        if (sym < 256) {
+            if (op >= raw_size) return ODZ_ERR_CORRUPT;
+            out[op++] = (uint8_t)sym;
+            continue;
+        }
+        if (sym == LITLEN_END) break;
+
+        int code_idx = sym - 257;
+        int length = base_length[code_idx] + (int)ans_read(&r, extra_lbits[code_idx]);
+        int dcode = ans_get(&r, d_tab, &ds);
+        int dist;
+        if (dcode < REP_CODES) {
+            dist = reps[dcode];
+        } else {
+            int ebits = 0;
+            dist = dist_base(dcode - REP_CODES, &ebits);
+            if (dist < 0) return ODZ_ERR_CORRUPT;
+            dist += (int)ans_read(&r, ebits);
+        }
+        rep_update(reps, dist);
+
+        int rc = copy_match(out, op, raw_size, dist, length);
+        if (rc != ODZ_OK) return rc;
+        op += (size_t)length;
+    }
+    if (r.bad) return ODZ_ERR_CORRUPT;
+    *out_pos = op;
+    return ODZ_OK;
+}
+
+/* dist_codes: 0 for plain DEFLATE distance codes, else a rep-match block
+ * with this many distance codes after the rep codes.
+ * Returns ODZ_OK on success, ODZ_ERR_* on failure */
+static int decompress_huffman_block(const uint8_t *comp, size_t comp_size,
+                                    uint8_t *out, size_t raw_size,
+                                    size_t *out_pos,
+                                    huff_decode_table_t *ll_tab,
+                                    huff_decode_table_t *d_tab, int dist_codes) {
+    bit_reader_t br;
+    br_init(&br, comp, comp_size);
+
+    /* Read Huffman trees */
+    int nd = dist_codes ? REP_CODES + dist_codes : DIST_SYMS;
+    uint8_t ll_lens[LITLEN_SYMS], d_lens[DIST_SYMS_MAX];
+    int n_ll, n_dist;
+    if (huff_read_trees(&br, ll_lens, &n_ll, d_lens, &n_dist, nd) != 0)
+        return ODZ_ERR_CORRUPT;
+
+    /* Build two-level decode tables */
+    if (huff_build_decode_table2(ll_lens, LITLEN_SYMS, ll_tab) != 0)
+        return ODZ_ERR_OOM;
+    if (huff_build_decode_table2(d_lens, nd, d_tab) != 0)
+        return ODZ_ERR_OOM;
+
+    int reps[REP_CODES];
+    memcpy(reps, rep_init, sizeof reps);
+    return decode_tokens(&br, ll_tab, d_tab, out, raw_size, raw_size, out_pos,
+                         dist_codes ? reps : NULL);
+}
+
+/* The tokens of a context block (below), tab_of[] giving each byte's
+ * literal/length table; flat: all of them and d_tab are flat */
+static ALWAYS_INLINE int decode_ctx_loop_as(bit_reader_t *br, uint8_t *out, size_t raw_size,
+                                            size_t *out_pos,
+                                            const huff_decode_table_t *const *tab_of,
+                                            const huff_decode_table_t *d_tab, const int flat) {
+    int reps[REP_CODES];
+    memcpy(reps, rep_init, sizeof reps);
+    size_t op = *out_pos;
+    const huff_decode_table_t *tab = tab_of[0];
+    for (;;) {
+        int sym = huff_decode_as(br, tab, flat);
+        if (sym < 256) {
+            if (op >= raw_size) return ODZ_ERR_CORRUPT;
+            out[op++] = (uint8_t)sym;
+            tab = tab_of[sym];
+            continue;
+        }
+        if (sym == LITLEN_END) break;
+
+        int code_idx = sym - 257;
+        if (code_idx >= 29) return ODZ_ERR_CORRUPT;
+        int length = base_length[code_idx];
+        if (extra_lbits[code_idx] > 0) length += (int)br_read(br, extra_lbits[code_idx]);
+        int dcode = huff_decode_as(br, d_tab, flat);
+        int dist;
+        if (dcode < REP_CODES) {
+            dist = reps[dcode];
+        } else {
+            int ebits = 0;
+            dist = dist_base(dcode - REP_CODES, &ebits);
+            if (dist < 0) return ODZ_ERR_CORRUPT;
+            if (ebits > 0) dist += (int)br_read(br, ebits);
+        }
+        rep_update(reps, dist);
+
+        int rc = copy_match(out, op, raw_size, dist, length);
+        if (rc != ODZ_OK) return rc;
+        op += (size_t)length;
+        tab = tab_of[256 + out[op - 1]];
+    }
+    *out_pos = op;
+    return ODZ_OK;
+}
+
+/* Context block (ODZ_EXT_CTX): the number of literal/length tables and
+ * the map from contexts to them, the tables (the first with the distance
+ * tree), then tokens as in a rep block, each literal/length symbol coded
+ * with the table for the byte before it.
+ * Returns ODZ_OK on success, ODZ_ERR_* on failure */
+static int decode_ctx_tokens(bit_reader_t *br, uint8_t *out, size_t raw_size,
+                             size_t *out_pos, huff_decode_table_t *ll_tabs,
+                             huff_decode_table_t *d_tab, int dist_codes) {
+    int nt = (int)br_read(br, 2) + 1;
+    uint8_t map[LIT_CTXS];
+    for (int x = 0; x < LIT_CTXS; x++) {
+        map[x] = (uint8_t)br_read(br, 2);
+        if (map[x] >= nt) return ODZ_ERR_CORRUPT;
+    }
+    int nd = REP_CODES + dist_codes;
+    uint8_t ll_lens[LITLEN_SYMS], d_lens[DIST_SYMS_MAX], no_dist[1];
+    int n_ll, n_dist;
+    if (huff_read_trees(br, ll_lens, &n_ll, d_lens, &n_dist, nd) != 0)
+        return ODZ_ERR_CORRUPT;
+    if (huff_build_decode_table2(d_lens, nd, d_tab) != 0) return ODZ_ERR_OOM;
+    for (int t = 0; t < nt; t++) {
+        if (t > 0 && huff_read_trees(br, ll_lens, &n_ll, no_dist, &n_dist, 1) != 0)
+            return ODZ_ERR_CORRUPT;
+        if (huff_build_decode_table2(ll_lens, LITLEN_SYMS, &ll_tabs[t]) != 0)
+            return ODZ_ERR_OOM;
+    }
+    /* Table of each byte, then of each byte ending a match: one lookup
+     * on the path from one symbol to the next */
+    const huff_decode_table_t *tab_of[512];
+    for (int b = 0; b < 512; b++) tab_of[b] = &ll_tabs[map[lit_ctx(b & 255, b >> 8)]];
+
+    int flat = d_tab->secondary_size == 0;
+    for (int t = 0; t < nt; t++) flat &= ll_tabs[t].secondary_size == 0;
+    return flat ? decode_ctx_loop_as(br, out, raw_size, out_pos, tab_of, d_tab, 1)
+                : decode_ctx_loop_as(br, out, raw_size, out_pos, tab_of, d_tab, 0);
+}
+
+/* The bulk of decode_lit4: literals [0, i) of each of the streams in
+ * r[0..4), each q long, for the i it returns, while all four have 8 bytes
+ * of input left. ORs every symbol into *bad. The loop works on copies of
+ * the readers that nothing else sees, so they stay in registers; a flat
+ * table (no secondary entries) takes more codes per refill. */
+static ALWAYS_INLINE size_t decode_lit4_as(bit_reader_t *r, const huff_decode_table_t *t,
+                                           uint8_t *lit, size_t q, unsigned *bad,
+                                           const int flat) {
+    const int per = flat ? FLAT_PER_REFILL : 57 / HUFF_MAX_BITS;
+    size_t i = 0;
+    unsigned b = 0;
+    bit_reader_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3];
+    while (i + (size_t)per <= q && r0.pos + 8 <= r0.len && r1.pos + 8 <= r1.len &&
+           r2.pos + 8 <= r2.len && r3.pos + 8 <= r3.len) {
+        br_refill_fast(&r0);
+        br_refill_fast(&r1);
+        br_refill_fast(&r2);
+        br_refill_fast(&r3);
+        for (int j = 0; j < per; j++, i++) {
+            int s0 = flat ? huff_lookup_flat(&r0, t) : huff_lookup2(&r0, t);
+            int s1 = flat ? huff_lookup_flat(&r1, t) : huff_lookup2(&r1, t);
+            int s2 = flat ? huff_lookup_flat(&r2, t) : huff_lookup2(&r2, t);
+            int s3 = flat ? huff_lookup_flat(&r3, t) : huff_lookup2(&r3, t);
+            lit[i] = (uint8_t)s0;
+            lit[q + i] = (uint8_t)s1;
+            lit[2 * q + i] = (uint8_t)s2;
+            lit[3 * q + i] = (uint8_t)s3;
+            b |= (unsigned)(s0 | s1 | s2 | s3);
+        }
+    }
+    r[0] = r0;
+    r[1] = r1;
+    r[2] = r2;
+    r[3] = r3;
+    *bad |= b;
+    return i;
+}
+
+/* The literals of a sequence block in four streams (ODZ_EXT_LIT4): from
+ * the byte after the header, the sizes of the first three (u32 LE each),
+ * then the streams, each with a quarter of the literals (the last one any
+ * left over). They are decoded side by side, so the table lookups of one
+ * stream don't wait for the bits of another; br ends up in the last one,
+ * where the sequences follow.
+ * Returns ODZ_OK on success, ODZ_ERR_* on failure */
+static int decode_lit4(bit_reader_t *br, const huff_decode_table_t *t,
+                       uint8_t *lit, size_t nlit) {
+    br_consume(br, br->nbits & 7);
+    size_t at = br->pos - (size_t)(br->nbits >> 3);
+    if (br->len - at < 12) return ODZ_ERR_CORRUPT;
+    const uint8_t *sizes = br->buf + at;
+    size_t left = br->len - at - 12;
+    at += 12;
+    bit_reader_t r[4];
+    for (int k = 0; k < 3; k++) {
+        size_t n = rd_u32le(sizes + 4 * k);
+        if (n > left) return ODZ_ERR_CORRUPT;
+        br_init(&r[k], br->buf + at, n);
+        at += n;
+        left -= n;
+    }
+    br_init(&r[3], br->buf + at, left);
+
+    size_t q = nlit / 4;
+    unsigned bad = 0;  /* any symbol past 255 */
+    size_t i = t->secondary_size == 0 ? decode_lit4_as(r, t, lit, q, &bad, 1)
+                                      : decode_lit4_as(r, t, lit, q, &bad, 0);
+    for (; i < q; i++) {
+        for (int k = 0; k < 4; k++) {
+            int sym = huff_decode2(&r[k], t);
+            lit[k * q + i] = (uint8_t)sym;
+            bad |= (unsigned)sym;
+        }
+    }
+    for (i = 4 * q; i < nlit; i++) {
+        int sym = huff_decode2(&r[3], t);
+        lit[i] = (uint8_t)sym;
+        bad |= (unsigned)sym;
+    }
+    *br = r[3];
+    return bad > 255 ? ODZ_ERR_CORRUPT : ODZ_OK;
+}
+
+/* The matches of a sequence block (below), from out[op] on, the literals
+ * not yet moved at out[lp..raw_size); flat: the run, sequence and distance
+ * tables are flat */
+static ALWAYS_INLINE int decode_seq_loop_as(bit_reader_t *br, uint8_t *out, size_t raw_size,
+                                            size_t op, size_t lp, size_t *out_pos,
+                                            const huff_decode_table_t *tabs,
+                                            const huff_decode_table_t *d_tab, const int flat) {
+    int reps[REP_CODES];
+    memcpy(reps, rep_init, sizeof reps);
+    for (;;) {
+        int sym = huff_decode_as(br, &tabs[2], flat);
+        if (sym >= SEQ_SYMS) {
+            if (sym == LITLEN_END) break;
+            return ODZ_ERR_CORRUPT;
+        }
+        size_t run = (size_t)(sym / 29);
+        int code_idx = sym % 29, ebits = 0;
+        if (run == SEQ_RUNS - 1) {
+            int rsym = huff_decode_as(br, &tabs[1], flat);
+            if (rsym >= RUN_SYMS) return ODZ_ERR_CORRUPT;
+            run += run_base(rsym, &ebits);
+            if (ebits > 0) run += br_read(br, ebits);
+        }
+        if (run > raw_size - lp) return ODZ_ERR_CORRUPT;
+        if (lp - op >= 16 && raw_size - lp - run >= 16) {
+            for (size_t k = 0; k < run; k += 16) memcpy(out + op + k, out + lp + k, 16);
+        } else {
+            memmove(out + op, out + lp, run);
+        }
+        op += run;
+        lp += run;
+
+        int length = base_length[code_idx];
+        if (extra_lbits[code_idx] > 0) length += (int)br_read(br, extra_lbits[code_idx]);
+        int dcode = huff_decode_as(br, d_tab, flat);
+        int dist;
+        if (dcode < REP_CODES) {
+            dist = reps[dcode];
+        } else {
+            dist = dist_base(dcode - REP_CODES, &ebits);
+            if (dist < 0) return ODZ_ERR_CORRUPT;
+            if (ebits > 0) dist += (int)br_read(br, ebits);
+        }
+        rep_update(reps, dist);
+
+        if ((size_t)length > lp - op) return ODZ_ERR_CORRUPT;
+        if (dist >= 16 && (size_t)dist <= op && lp - op - (size_t)length >= 16) {
+            for (int k = 0; k < length; k += 16)
+                memcpy(out + op + k, out + op - dist + k, 16);
+        } else {
+            int rc = copy_match(out, op, raw_size, dist, length);
+            if (rc != ODZ_OK) return rc;
+        }
+        op += (size_t)length;
+    }
+    memmove(out + op, out + lp, raw_size - lp);
+    *out_pos = op + (raw_size - lp);
+    return ODZ_OK;
+}
+
+/* Sequence block (ODZ_EXT_SEQ): the number of literals, the literal and
+ * run trees, the sequence and distance trees, every literal, then the
+ * matches, each a sequence symbol (run and length code, lz_tables.h), the
+ * run code of a long run, length extra bits and distance; the literals
+ * left after the end symbol finish the block.
+ * The literals are decoded in one go to the end of out[], and each run
+ * moved down to its place ahead of the match after it. Matches never
+ * reach the literals not yet moved, so while those are 16 bytes off,
+ * runs and matches are copied 16 bytes at a time. tabs[0..2] get the
+ * literal, run and sequence tables; lit4: ODZ_EXT_LIT4 literals.
+ * Returns ODZ_OK on success, ODZ_ERR_* on failure */
+static int decode_seq_tokens(bit_reader_t *br, uint8_t *out, size_t raw_size,
+                             size_t *out_pos, huff_decode_table_t *tabs,
+                             huff_decode_table_t *d_tab, int dist_codes, int lit4) {
+    size_t nlit = br_read(br, 32);
+    int nd = REP_CODES + dist_codes;
+    uint8_t lit_lens[LITLEN_SYMS], run_lens[RUN_SYMS];
+    uint8_t seq_lens[LITLEN_SYMS], d_lens[DIST_SYMS_MAX];
+    int n_ll, n_dist;
+    if (huff_read_trees(br, lit_lens, &n_ll, run_lens, &n_dist, RUN_SYMS) != 0 ||
+        huff_read_trees(br, seq_lens, &n_ll, d_lens, &n_dist, nd) != 0)
+        return ODZ_ERR_CORRUPT;
+    if (huff_build_decode_table2(lit_lens, LITLEN_SYMS, &tabs[0]) != 0 ||
+        huff_build_decode_table2(run_lens, RUN_SYMS, &tabs[1]) != 0 ||
+        huff_build_decode_table2(seq_lens, LITLEN_SYMS, &tabs[2]) != 0 ||
+        huff_build_decode_table2(d_lens, nd, d_tab) != 0)
+        return ODZ_ERR_OOM;
+
+    size_t op = *out_pos;
+    if (nlit > raw_size - op) return ODZ_ERR_CORRUPT;
+    size_t lp = raw_size - nlit;    /* next literal to move */
+    if (lit4) {
+        int rc = decode_lit4(br, &tabs[0], out + lp, nlit);
+        if (rc != ODZ_OK) return rc;
+    } else {
+        for (size_t i = lp; i < raw_size; i++) {
+            int sym = huff_decode2(br, &tabs[0]);
+            if (sym > 255) return ODZ_ERR_CORRUPT;
+            out[i] = (uint8_t)sym;
+        }
+    }
+
+    int flat = tabs[1].secondary_size == 0 && tabs[2].secondary_size == 0 &&
+               d_tab->secondary_size == 0;
+    return flat ? decode_seq_loop_as(br, out, raw_size, op, lp, out_pos, tabs, d_tab, 1)
+                : decode_seq_loop_as(br, out, raw_size, op, lp, out_pos, tabs, d_tab, 0);
+}
+
+/* Extended block: a mode byte (ODZ_EXT_*), then the block in that mode.
+ * Returns ODZ_OK on success, ODZ_ERR_* on failure */
+static int decompress_ext_block(const uint8_t *comp, size_t comp_size,
+                                uint8_t *out, size_t raw_size, size_t *out_pos,
+                                huff_decode_table_t *ll_tabs, huff_decode_table_t *d_tab,
+                                int dist_codes) {
+    bit_reader_t br;
+    br_init(&br, comp, comp_size);
+    int mode = (int)br_read(&br, 8);
+    switch (mode) {
+        case ODZ_EXT_CTX:
+            return decode_ctx_tokens(&br, out, raw_size, out_pos, ll_tabs, d_tab, dist_codes);
+        case ODZ_EXT_SEQ:
+        case ODZ_EXT_SEQ | ODZ_EXT_LIT4:
+            return decode_seq_tokens(&br, out, raw_size, out_pos, ll_tabs, d_tab, dist_codes,
+                                     mode & ODZ_EXT_LIT4);
+        default:
+            return ODZ_ERR_CORRUPT;
+    }
+}
+
+/* ── Stream reader ─────────────────────────────────────────── */
+
+/* Reusable decompression state */
+struct odz_dctx {
+    huff_decode_table_t ll_tab, d_tab;      /* rebuilt for every dynamic block */
+    huff_decode_table_t ll_fixed, d_fixed;  /* fixed codes, built on first use */
+    huff_decode_table_t ll_deflate;         /* DEFLATE's fixed lit/len code */
+    ans_dec_t *ans_tab;     /* literal/length then distance ANS tables */
+    huff_decode_table_t ctx_tab[LIT_TABLES];    /* context blocks' tables */
+    int      have_fixed;
+    uint8_t *block_out;     /* FILE output only */
+    size_t   block_cap;
+    uint8_t *comp;          /* FILE input; decrypted payload for memory input */
+    size_t   comp_cap;
+    gcm_ctx_t *gcm;         /* key for encrypted streams */
+    uint64_t *block_start;  /* frame output offset of each block, for copies */
+    size_t   block_start_cap;
+    FILE    *ref;           /* reference for patch frames */
+};
+
+/* Build the fixed-code tables on first use */
+static int fixed_tables(odz_dctx_t *d) {
+    if (d->have_fixed) return ODZ_OK;
+    uint8_t ll_lens[LITLEN_FIXED], d_lens[DIST_SYMS];
+    huff_fixed_lengths(ll_lens, LITLEN_FIXED, d_lens);
+    if (huff_build_decode_table2(ll_lens, LITLEN_FIXED, &d->ll_deflate) != 0 ||
+        huff_build_decode_table2(ll_lens, LITLEN_SYMS, &d->ll_fixed) != 0 ||
+        huff_build_decode_table2(d_lens, DIST_SYMS, &d->d_fixed) != 0)
+        return ODZ_ERR_OOM;
+    d->have_fixed = 1;
+    return ODZ_OK;
+}
+
+/* Input source: a FILE, or a caller-provided buffer */
+typedef struct {
+    FILE          *f;
+    const uint8_t *buf;
+    size_t         len;
+    size_t         pos;
+} source_t;
+
+static int src_read(source_t *s, void *dst, size_t n) {
+    if (s->f) return fread(dst, 1, n, s->f) == n ? ODZ_OK : ODZ_ERR_IO;
+    if (n > s->len - s->pos) return ODZ_ERR_CORRUPT;   /* truncated */
+    memcpy(dst, s->buf + s->pos, n);
+    s->pos += n;
+    return ODZ_OK;
+}
+
+/* Grow d->comp to at least n bytes (contents are not kept) */
+static int comp_reserve(odz_dctx_t *d, size_t n) {
+    if (n <= d->comp_cap) return ODZ_OK;
+    free(d->comp);
+    d->comp = malloc(n);
+    d->comp_cap = d->comp ? n : 0;
+    return d->comp ? ODZ_OK : ODZ_ERR_OOM;
+}
+
+/* Get n bytes of block payload: a pointer into a memory source, or the
+ * payload read into d->comp for a file. */
+static int src_take(odz_dctx_t *d, source_t *s, size_t n, const uint8_t **p) {
+    if (!s->f) {
+        if (n > s->len - s->pos) return ODZ_ERR_CORRUPT;
+        *p = s->buf + s->pos;
+        s->pos += n;
+        return ODZ_OK;
+    }
+    int rc = comp_reserve(d, n);
+    if (rc != ODZ_OK) return rc;
+    if (fread(d->comp, 1, n, s->f) != n) return ODZ_ERR_IO;
+    *p = d->comp;
+    return ODZ_OK;
+}
+
+odz_dctx_t *odz_dctx_new(void) {
+    return calloc(1, sizeof(odz_dctx_t));
+}
+
+void odz_dctx_free(odz_dctx_t *d) {
+    if (!d) return;
+    huff_free_decode_table2(&d->ll_tab);
+    huff_free_decode_table2(&d->d_tab);
+    for (int t = 0; t < LIT_TABLES; t++) huff_free_decode_table2(&d->ctx_tab[t]);
+    huff_free_decode_table2(&d->ll_fixed);
+    huff_free_decode_table2(&d->ll_deflate);
+    huff_free_decode_table2(&d->d_fixed);
+    free(d->block_out);
+    free(d->comp);
+    free(d->gcm);
+    free(d->block_start);
+    free(d->ans_tab);
+    free(d);
+}
+
+int odz_dctx_set_key(odz_dctx_t *d, const uint8_t *key) {
+    if (!key) {
+        free(d->gcm);
+        d->gcm = NULL;
+        return ODZ_OK;
+    }
+    if (!d->gcm && !(d->gcm = malloc(sizeof *d->gcm))) return ODZ_ERR_OOM;
+    gcm_init(d->gcm, key);
+    return ODZ_OK;
+}
+
+/* Like src_read, but a clean end of input is not an error:
+ * returns the number of bytes read (< n only at end of input). */
+static size_t src_read_some(source_t *s, void *dst, size_t n) {
+    if (s->f) return fread(dst, 1, n, s->f);
+    if (n > s->len - s->pos) n = s->len - s->pos;
+    memcpy(dst, s->buf + s->pos, n);
+    s->pos += n;
+    return n;
+}
+
+/* Skip n bytes of input */
+static int src_skip(odz_dctx_t *d, source_t *s, uint64_t n) {
+    while (n > 0) {
+        size_t chunk = n < (1u << 16) ? (size_t)n : (1u << 16);
+        const uint8_t *p;
+        int rc = src_take(d, s, chunk, &p);
+        if (rc != ODZ_OK) return rc;
+        n -= chunk;
+    }
+    return ODZ_OK;
+}
+
+/* Header length for a given format version, 0 if unsupported */
+static size_t header_size(int version) {
+    switch (version) {
+        case 2:  return ODZ_HEADER_SIZE_V2;
+        case 3:  return ODZ_HEADER_SIZE;
+        default: return 0;
+    }
+}
+
+/* Frame header fields, whatever the version */
+typedef struct {
+    uint64_t original_size;
+    size_t   block_size;
+    int      flags;         /* ODZ_FLAG_* (0 for v2) */
+    int      window_log;    /* long-distance window, 0 = none */
+    int      encrypted;
+    int      filtered;      /* blocks may name a filter */
+    int      patch;         /* the reference comes first in the output */
+    uint64_t ref_size;
+    uint32_t ref_crc;
+    size_t   tag;           /* bytes of tag after each block's data */
+    uint8_t  hdr[ODZ_HEADER_SIZE_ENC];  /* raw header, AAD for encrypted blocks */
+} frame_hdr_t;
+
+/* Read the rest of a data or patch frame header, after its 4-byte
+ * magic + version. Returns ODZ_OK, ODZ_ERR_FORMAT or a read error. */
+static int read_frame_header(source_t *in, const uint8_t *magic, frame_hdr_t *f) {
+    uint8_t *hdr = f->hdr;
+    f->flags = 0;
+    f->window_log = 0;
+    f->encrypted = 0;
+    f->filtered = 0;
+    f->patch = magic[2] == 'P';
+    f->ref_size = 0;
+    f->ref_crc = 0;
+    f->tag = 0;
+    size_t hsize = header_size(magic[3]);
+    if (f->patch && magic[3] < 3) return ODZ_ERR_FORMAT;
+    if (hsize == 0) return ODZ_ERR_FORMAT;
+    memcpy(hdr, magic, 4);
+    int rc = src_read(in, hdr + 4, hsize - 4);
+    if (rc != ODZ_OK) return rc;
+
+    if (hdr[3] == 2) {
+        /* v2: fixed 1 MB blocks */
+        f->block_size = ODZ_BLOCK_SIZE;
+        f->original_size = rd_u64le(hdr + 4);
+        return ODZ_OK;
+    }
+    if (hdr[4] & ~(ODZ_FLAG_MASK | ODZ_WINDOW_MASK)) return ODZ_ERR_FORMAT;    /* unknown flags */
+    int block_log = hdr[5] & ~ODZ_LOG_FILTERS;
+    if (block_log < ODZ_MIN_BLOCK_LOG || block_log > ODZ_MAX_BLOCK_LOG) return ODZ_ERR_FORMAT;
+    if (hdr[4] & ODZ_WINDOW_MASK)
+        f->window_log = 15 + ((hdr[4] & ODZ_WINDOW_MASK) >> ODZ_WINDOW_SHIFT);
+    /* Copy blocks are never encrypted */
+    if ((hdr[4] & ODZ_FLAG_COPIES) && (hdr[4] & ODZ_FLAG_ENCRYPTED)) return ODZ_ERR_FORMAT;
+    f->flags = hdr[4];
+    f->filtered = (hdr[5] & ODZ_LOG_FILTERS) != 0;
+    if (f->filtered && f->window_log) return ODZ_ERR_FORMAT;
+    f->block_size = (size_t)1 << block_log;
+    f->original_size = rd_u64le(hdr + 6);
+    if (f->patch) {
+        if (!f->window_log || (hdr[4] & ODZ_FLAG_ENCRYPTED)) return ODZ_ERR_FORMAT;
+        uint8_t ref[ODZ_PATCH_REF_SIZE];
+        if ((rc = src_read(in, ref, sizeof ref)) != ODZ_OK) return rc;
+        f->ref_size = rd_u64le(ref);
+        f->ref_crc = rd_u32le(ref + 8);
+        return ODZ_OK;
+    }
+    if (hdr[4] & ODZ_FLAG_ENCRYPTED) {
+        f->encrypted = 1;
+        f->tag = ODZ_TAG_SIZE;
+        return src_read(in, hdr + ODZ_HEADER_SIZE, ODZ_NONCE_PREFIX);
+    }
+    return ODZ_OK;
+}
+
+/* Block header fields */
+typedef struct {
+    int      is_last;
+    int      type;
+    int      filter;    /* ODZ_FILTER_* the data went through */
+    uint32_t raw_size;
+    uint32_t payload;   /* bytes of data following the header (before any tag) */
+    uint32_t src;       /* block number a copy block repeats */
+    uint64_t hash;      /* XXH64 of the raw data, with ODZ_FLAG_BLOCK_HASH */
+    uint8_t  raw[ODZ_BLOCK_HEADER_MAX];  /* the header as stored, AAD for encrypted blocks */
+    int      raw_len;
+} block_hdr_t;
+
+/* Read one block header: flags(1) raw_size(4) [comp_size(4) | src(4)] [hash(8)] */
+static int read_block_header(source_t *in, const frame_hdr_t *f,
+                             uint64_t frame_out, block_hdr_t *b) {
+    uint8_t *blk_hdr = b->raw;
+    int rc = src_read(in, blk_hdr, 1);
+    if (rc != ODZ_OK) return rc;
+
+    b->is_last = blk_hdr[0] & 1;
+    b->type    = (blk_hdr[0] >> 1) & 7;
+    if (b->type == ODZ_BLOCK_COPY && !(f->flags & ODZ_FLAG_COPIES)) return ODZ_ERR_CORRUPT;
+    b->filter  = blk_hdr[0] >> 4;
+    if (b->filter && (!f->filtered || b->filter > ODZ_FILTER_MAX ||
+                      b->type == ODZ_BLOCK_STORED || b->type == ODZ_BLOCK_COPY))
+        return ODZ_ERR_CORRUPT;
+
+    /* raw_size(4), then comp_size(4) for coded blocks or the source
+     * block number for copies */
+    int coded = b->type != ODZ_BLOCK_STORED;
+    if ((rc = src_read(in, blk_hdr + 1, coded ? 8 : 4)) != ODZ_OK) return rc;
+    b->raw_size = rd_u32le(blk_hdr + 1);
+    b->payload  = coded ? rd_u32le(blk_hdr + 5) : b->raw_size;
+    b->src      = 0;
+    if (b->type == ODZ_BLOCK_COPY) {
+        b->src = b->payload;
+        b->payload = 0;
+    }
+    b->raw_len  = coded ? 9 : 5;
+    if (b->raw_size > f->block_size || b->raw_size > f->original_size - frame_out)
+        return ODZ_ERR_CORRUPT;
+    if (f->flags & ODZ_FLAG_BLOCK_HASH) {
+        if ((rc = src_read(in, blk_hdr + b->raw_len, 8)) != ODZ_OK) return rc;
+        b->hash = rd_u64le(blk_hdr + b->raw_len);
+        b->raw_len += 8;
+    }
+    return ODZ_OK;
+}
+
+/* Progress across all frames of a stream */
+typedef struct {
+    const odz_options_t *opts;
+    uint64_t done;      /* bytes output by earlier frames */
+    uint64_t total;     /* original size of all frames seen so far */
+} progress_t;
+
+/* Check and decrypt block number index of an encrypted frame:
+ * in[0..n) + tag → out[0..n) */
+static int open_block(const odz_dctx_t *d, const frame_hdr_t *f, const block_hdr_t *b,
+                      uint32_t index, const uint8_t *in, uint8_t *out, size_t n) {
+    uint8_t nonce[GCM_NONCE_SIZE], aad[ODZ_HEADER_SIZE_ENC + ODZ_BLOCK_HEADER_MAX];
+    memcpy(nonce, f->hdr + ODZ_HEADER_SIZE, ODZ_NONCE_PREFIX);
+    nonce[8] = (uint8_t)(index >> 24); nonce[9] = (uint8_t)(index >> 16);
+    nonce[10] = (uint8_t)(index >> 8); nonce[11] = (uint8_t)index;
+    memcpy(aad, f->hdr, ODZ_HEADER_SIZE_ENC);
+    memcpy(aad + ODZ_HEADER_SIZE_ENC, b->raw, (size_t)b->raw_len);
+    if (gcm_open(d->gcm, nonce, aad, ODZ_HEADER_SIZE_ENC + (size_t)b->raw_len,
+                 in, out, n, in + n) != 0)
+        return ODZ_ERR_AUTH;
+    return ODZ_OK;
+}
+
+/* Copy block number index: the output of earlier block b->src of the
+ * frame, total_out bytes into it, to dst. It is still in front of dst for
+ * memory output, and within the hist bytes there for file output, or
+ * else read back from the output file. */
+static int copy_block(const odz_dctx_t *d, const block_hdr_t *b, uint32_t index,
+                      uint64_t total_out, odz_sink_t *out, size_t hist, uint8_t *dst) {
+    if (b->src >= index) return ODZ_ERR_CORRUPT;
+    uint64_t start = d->block_start[b->src];
+    uint64_t end = b->src + 1 < index ? d->block_start[b->src + 1] : total_out;
+    if (end - start != b->raw_size) return ODZ_ERR_CORRUPT;
 
-    /* Read file header */
-    uint8_t hdr[12];
-    if (fread(hdr, 1, 12, in) != 12) return ODZ_ERR_IO;
-    if (hdr[0] != 'O' || hdr[1] != 'D' || hdr[2] != 'Z') return ODZ_ERR_FORMAT;
-    if (hdr[3] != ODZ_VERSION) return ODZ_ERR_FORMAT;
+    uint64_t back = total_out - start;    /* >= raw_size: no overlap */
+    if (!out->f || back <= hist) {
+        memcpy(dst, dst - back, b->raw_size);
+        return ODZ_OK;
+    }
+    int64_t pos = ftello(out->f);
+    if (pos < 0 || (uint64_t)pos < back ||
+        fseeko(out->f, pos - (int64_t)back, SEEK_SET) != 0 ||
+        fread(dst, 1, b->raw_size, out->f) != b->raw_size ||
+        fseeko(out->f, pos, SEEK_SET) != 0)
+        return ODZ_ERR_IO;
+    return ODZ_OK;
+}
 
-    uint64_t original_size = rd_u64le(hdr + 4);
+/* Read a patch frame's reference into the block buffer, leaving the
+ * last of it (at least a window, if it has that much) as *hist bytes of
+ * history, and check it is the one the patch was made against. */
+static int load_reference(odz_dctx_t *d, const frame_hdr_t *f, size_t window,
+                          size_t *hist) {
+    FILE *ref = d->ref;
+    if (!ref) return ODZ_ERR_REF;
+    if (fseeko(ref, 0, SEEK_SET) != 0) return ODZ_ERR_IO;
+    uint64_t total = 0;
+    uint32_t crc = 0;
+    size_t h = 0;
+    for (;;) {
+        if (h + f->block_size > d->block_cap) {
+            size_t keep = h < window ? h : window;
+            memmove(d->block_out, d->block_out + h - keep, keep);
+            h = keep;
+        }
+        size_t room = d->block_cap - h < f->block_size ? d->block_cap - h : f->block_size;
+        size_t got = fread(d->block_out + h, 1, room, ref);
+        if (got == 0) break;
+        crc = odz_crc32(crc, d->block_out + h, got);
+        total += got;
+        h += got;
+    }
+    if (ferror(ref)) return ODZ_ERR_IO;
+    if (total != f->ref_size || crc != f->ref_crc) return ODZ_ERR_REF;
+    *hist = h;
+    return ODZ_OK;
+}
+
+/* Decode one data frame's blocks (header already read) */
+static int decompress_frame(odz_dctx_t *d, source_t *in, const frame_hdr_t *f,
+                            odz_sink_t *out, progress_t *prog) {
+    int rc;
     uint64_t total_out = 0;
+    uint32_t index = 0;     /* block number, for the nonce and copies */
 
-    block_out = malloc(ODZ_BLOCK_SIZE);
-    if (!block_out) return ODZ_ERR_OOM;
+    if (f->encrypted && !d->gcm) return ODZ_ERR_NOKEY;
+    if (f->patch && (!d->ref || !out->f)) return ODZ_ERR_REF;
 
-    /* Allocate decode tables once, reuse across blocks */
-    huff_decode_table_t ll_tab = {.secondary = NULL, .secondary_size = 0, .secondary_cap = 0};
-    huff_decode_table_t d_tab  = {.secondary = NULL, .secondary_size = 0, .secondary_cap = 0};
+    /* File output goes through the block buffer, sized to the output
+     * (small frames stay small), with room for the window in front of
+     * each block in long-distance frames. Memory output is decoded in
+     * place, behind all of the frame's earlier output. */
+    size_t window = f->window_log ? (size_t)1 << f->window_log : 0;
+    size_t hist = 0;    /* output kept in front of the block */
+    if (out->f) {
+        size_t need = window ? odz_history_size(f->window_log, f->block_size) : f->block_size;
+        if (f->original_size + f->ref_size < need) need = (size_t)(f->original_size + f->ref_size);
+        if (need > d->block_cap || !d->block_out) {
+            free(d->block_out);
+            d->block_out = malloc(need ? need : 1);
+            d->block_cap = d->block_out ? need : 0;
+            if (!d->block_out) return ODZ_ERR_OOM;
+        }
+        if (f->patch && (rc = load_reference(d, f, window, &hist)) != ODZ_OK) return rc;
+    }
 
     for (;;) {
-        /* Read block header */
-        uint8_t blk_hdr[9];
-        if (fread(blk_hdr, 1, 1, in) != 1) { rc = ODZ_ERR_IO; goto cleanup; }
-
-        int is_last  = blk_hdr[0] & 1;
-        int blk_type = (blk_hdr[0] >> 1) & 3;
-
-        if (blk_type == ODZ_BLOCK_STORED) {
-            /* Read raw_size */
-            if (fread(blk_hdr + 1, 1, 4, in) != 4) { rc = ODZ_ERR_IO; goto cleanup; }
-            uint32_t raw_size = rd_u32le(blk_hdr + 1);
-            if (raw_size > ODZ_BLOCK_SIZE) { rc = ODZ_ERR_CORRUPT; goto cleanup; }
-
-            /* Read and write raw data */
-            if (fread(block_out, 1, raw_size, in) != raw_size) { rc = ODZ_ERR_IO; goto cleanup; }
-            if (fwrite(block_out, 1, raw_size, out) != raw_size) { rc = ODZ_ERR_IO; goto cleanup; }
-            total_out += raw_size;
-
-        } else if (blk_type == ODZ_BLOCK_HUFFMAN) {
-            /* Read raw_size + compressed_size */
-            if (fread(blk_hdr + 1, 1, 8, in) != 8) { rc = ODZ_ERR_IO; goto cleanup; }
-            uint32_t raw_size  = rd_u32le(blk_hdr + 1);
-            uint32_t comp_size = rd_u32le(blk_hdr + 5);
-            if (raw_size > ODZ_BLOCK_SIZE) { rc = ODZ_ERR_CORRUPT; goto cleanup; }
-
-            /* Read compressed data */
-            comp = malloc(comp_size);
-            if (!comp) { rc = ODZ_ERR_OOM; goto cleanup; }
-            if (fread(comp, 1, comp_size, in) != comp_size) { rc = ODZ_ERR_IO; goto cleanup; }
-
-            /* Decompress */
-            size_t out_pos = 0;
-            rc = decompress_huffman_block(comp, comp_size,
-                                          block_out, raw_size, &out_pos,
-                                          &ll_tab, &d_tab);
-            if (rc != ODZ_OK) { free(comp); comp = NULL; goto cleanup; }
-            if (out_pos != raw_size) { free(comp); comp = NULL; rc = ODZ_ERR_CORRUPT; goto cleanup; }
-
-            if (fwrite(block_out, 1, raw_size, out) != raw_size) { free(comp); comp = NULL; rc = ODZ_ERR_IO; goto cleanup; }
-            total_out += raw_size;
-            free(comp);
-            comp = NULL;
+        block_hdr_t b;
+        if ((rc = read_block_header(in, f, total_out, &b)) != ODZ_OK) return rc;
+        uint32_t raw_size = b.raw_size;
+        if (f->flags & ODZ_FLAG_COPIES) {
+            if (index == d->block_start_cap) {
+                size_t ncap = index ? (size_t)index * 2 : 256;
+                uint64_t *nb = realloc(d->block_start, ncap * sizeof *nb);
+                if (!nb) return ODZ_ERR_OOM;
+                d->block_start = nb;
+                d->block_start_cap = ncap;
+            }
+            d->block_start[index] = total_out;
+        }
+
+        uint8_t *dst;
+        if (out->f) {
+            if (hist + raw_size > d->block_cap) {
+                /* Slide down, keeping the last window of output */
+                size_t keep = hist < window ? hist : window;
+                memmove(d->block_out, d->block_out + hist - keep, keep);
+                hist = keep;
+            }
+            dst = d->block_out + hist;
         } else {
-            rc = ODZ_ERR_FORMAT;
-            goto cleanup;
+            if (raw_size > out->cap - out->pos) return ODZ_ERR_SPACE;
+            dst = out->buf + out->pos;
+            if (window) hist = (size_t)total_out;
         }
 
+        if (b.type == ODZ_BLOCK_COPY) {
+            if ((rc = copy_block(d, &b, index, total_out, out, hist, dst)) != ODZ_OK)
+                return rc;
+        } else if (b.type == ODZ_BLOCK_STORED) {
+            if (f->encrypted) {
+                /* Stored: decrypt straight into place */
+                const uint8_t *ct;
+                if ((rc = src_take(d, in, raw_size + f->tag, &ct)) != ODZ_OK) return rc;
+                if ((rc = open_block(d, f, &b, index, ct, dst, raw_size)) != ODZ_OK) return rc;
+            } else {
+                /* Stored: copy raw data */
+                if ((rc = src_read(in, dst, raw_size)) != ODZ_OK) return rc;
+            }
+        } else {
+            uint32_t comp_size = b.payload;
+            const uint8_t *comp;
+            if ((rc = src_take(d, in, (size_t)comp_size + f->tag, &comp)) != ODZ_OK) return rc;
+            if (f->encrypted) {
+                /* Into d->comp: in place for a file, a copy for memory */
+                if ((rc = comp_reserve(d, comp_size)) != ODZ_OK) return rc;
+                if ((rc = open_block(d, f, &b, index, comp, d->comp, comp_size)) != ODZ_OK)
+                    return rc;
+                comp = d->comp;
+            }
+
+            /* Decompress, behind the history */
+            size_t out_pos = hist, end = hist + raw_size;
+            int dist_codes = f->window_log ? DIST_CODES(f->window_log) : DIST_SYMS;
+            if (b.type == ODZ_BLOCK_FIXED) {
+                if ((rc = fixed_tables(d)) != ODZ_OK) return rc;
+                bit_reader_t br;
+                br_init(&br, comp, comp_size);
+                rc = decode_tokens(&br, &d->ll_fixed, &d->d_fixed,
+                                   dst - hist, end, end, &out_pos, NULL);
+            } else if (b.type == ODZ_BLOCK_ANS) {
+                if (!d->ans_tab &&
+                    !(d->ans_tab = malloc(((size_t)2 << ANS_MAX_TABLE_LOG) * sizeof *d->ans_tab)))
+                    return ODZ_ERR_OOM;
+                rc = decompress_ans_block(comp, comp_size, dst - hist, end, &out_pos,
+                                          d->ans_tab, dist_codes);
+            } else if (b.type == ODZ_BLOCK_EXT) {
+                rc = decompress_ext_block(comp, comp_size, dst - hist, end, &out_pos,
+                                          d->ctx_tab, &d->d_tab, dist_codes);
+            } else if (b.type == ODZ_BLOCK_LZRC) {
+                rc = lzrc_decompress(comp, comp_size, dst - hist, hist, end) != 0
+                         ? ODZ_ERR_CORRUPT : ODZ_OK;
+                out_pos = end;
+            } else {
+                rc = decompress_huffman_block(comp, comp_size,
+                                              dst - hist, end, &out_pos,
+                                              &d->ll_tab, &d->d_tab,
+                                              b.type == ODZ_BLOCK_REP ? dist_codes : 0);
+            }
+            if (rc != ODZ_OK) return rc;
+            if (out_pos != end) return ODZ_ERR_CORRUPT;
+
+            /* The payload is done with: d->comp can hold the filtered data */
+            if (b.filter) {
+                if ((rc = comp_reserve(d, raw_size)) != ODZ_OK) return rc;
+                memcpy(d->comp, dst, raw_size);
+                filter_decode(b.filter, d->comp, dst, raw_size);
+            }
+        }
+        if ((f->flags & ODZ_FLAG_BLOCK_HASH) && odz_hash64(dst, raw_size) != b.hash)
+            return ODZ_ERR_CORRUPT;
+
+        if (out->f) {
+            if (fwrite(dst, 1, raw_size, out->f) != raw_size) return ODZ_ERR_IO;
+        }
+        out->pos += raw_size;
+        total_out += raw_size;
+        if (out->f && window) hist += raw_size;
+        index++;
+
         /* Progress callback */
+        const odz_options_t *opts = prog->opts;
         if (opts && opts->progress) {
-            if (opts->progress(total_out, original_size, opts->userdata) != 0) {
-                rc = ODZ_ERR_IO;
-                goto cleanup;
+            if (opts->progress(prog->done + total_out, prog->total, opts->userdata) != 0)
+                return ODZ_ERR_IO;
+        }
+
+        if (b.is_last) break;
+    }
+
+    if (total_out != f->original_size) return ODZ_ERR_CORRUPT;
+    return ODZ_OK;
+}
+
+/* Decode a stream: a sequence of data and skippable frames, up to the end
+ * of the input. Anything else after the first frame is an error. */
+static int decompress_stream(odz_dctx_t *d, source_t *in, odz_sink_t *out,
+                             const odz_options_t *opts) {
+    progress_t prog = { .opts = opts };
+    int rc;
+
+    for (int nframes = 0; ; nframes++) {
+        uint8_t magic[4];
+        size_t got = src_read_some(in, magic, 4);
+        if (got == 0 && nframes > 0) return ODZ_OK;    /* clean end */
+        if (got < 4) return nframes > 0 ? ODZ_ERR_FORMAT : ODZ_ERR_IO;
+
+        if (magic[0] == 'O' && magic[1] == 'D' && magic[2] == 'S') {
+            /* Skippable frame: kind(1) already read, then size(4) + payload */
+            uint8_t sz[4];
+            if ((rc = src_read(in, sz, 4)) != ODZ_OK) return rc;
+            if ((rc = src_skip(d, in, rd_u32le(sz))) != ODZ_OK) return rc;
+            continue;
+        }
+        if (magic[0] != 'O' || magic[1] != 'D' || (magic[2] != 'Z' && magic[2] != 'P'))
+            return ODZ_ERR_FORMAT;
+
+        frame_hdr_t f;
+        if ((rc = read_frame_header(in, magic, &f)) != ODZ_OK) return rc;
+        prog.total += f.original_size;
+        if ((rc = decompress_frame(d, in, &f, out, &prog)) != ODZ_OK) return rc;
+        prog.done += f.original_size;
+    }
+}
+
+int odz_decompress_mem(odz_dctx_t *d, const uint8_t *src, size_t n,
+                       odz_sink_t *out) {
+    source_t in = { .buf = src, .len = n };
+    return decompress_stream(d, &in, out, NULL);
+}
+
+/* ── DEFLATE / zlib / gzip reader ──────────────────────────── */
+
+/* Output is decoded into win[] behind up to 32 KB of history, drained to
+ * the file every INFLATE_CHUNK bytes, then the history slides down. */
+#define INFLATE_CHUNK  (1u << 20)
+#define INFLATE_STOP   (ODZ_WINDOW + INFLATE_CHUNK)
+#define INFLATE_CAP    (INFLATE_STOP + ODZ_MAX_MATCH)
+
+typedef struct {
+    uint8_t    *win;
+    size_t      op;         /* end of output in win */
+    size_t      flushed;    /* win[0..flushed) already written */
+    odz_sink_t *out;
+    int         format;
+    uint32_t    check;      /* running crc32 / adler32 of this member */
+    uint64_t    total;      /* output bytes of this member */
+} inflate_t;
+
+/* The bit reader ran past the end of its input (it reads zeros there) */
+static inline int br_overrun(const bit_reader_t *br) {
+    return br->nbits < 0;
+}
+
+/* Input bytes consumed so far, once byte-aligned */
+static inline size_t br_byte_pos(const bit_reader_t *br) {
+    return br->pos - (size_t)(br->nbits >> 3);
+}
+
+/* Write out new output and slide the window down */
+static int inflate_flush(inflate_t *z) {
+    size_t n = z->op - z->flushed;
+    const uint8_t *p = z->win + z->flushed;
+    if (z->format == ODZ_FMT_GZIP) z->check = odz_crc32(z->check, p, n);
+    if (z->format == ODZ_FMT_ZLIB) z->check = odz_adler32(z->check, p, n);
+    z->total += n;
+    int rc = odz_sink_write(z->out, p, n);
+    if (rc != ODZ_OK) return rc;
+
+    if (z->op > ODZ_WINDOW) {
+        memmove(z->win, z->win + z->op - ODZ_WINDOW, ODZ_WINDOW);
+        z->op = ODZ_WINDOW;
+    }
+    z->flushed = z->op;
+    return ODZ_OK;
+}
+
+/* Stored block: LEN, NLEN, then LEN raw bytes from the byte boundary */
+static int inflate_stored(bit_reader_t *br, inflate_t *z) {
+    int rc;
+    if (z->op > INFLATE_STOP && (rc = inflate_flush(z)) != ODZ_OK) return rc;
+    br_consume(br, br->nbits & 7);
+    uint32_t len  = br_read(br, 16);
+    uint32_t nlen = br_read(br, 16);
+    if (br_overrun(br) || len != (~nlen & 0xFFFF)) return ODZ_ERR_CORRUPT;
+
+    /* Bytes still in the bit buffer first, then straight from the input */
+    while (len > 0 && br->nbits >= 8) {
+        z->win[z->op++] = (uint8_t)br_read(br, 8);
+        len--;
+    }
+    if (len > br->len - br->pos) return ODZ_ERR_CORRUPT;
+    /* The buffer is empty then, but a refill may have put bits of the next
+     * input byte above nbits; they'd be wrong once pos skips ahead */
+    if (len > 0) br->bits = 0;
+    while (len > 0) {
+        if (z->op > INFLATE_STOP && (rc = inflate_flush(z)) != ODZ_OK) return rc;
+        size_t n = INFLATE_CAP - z->op;
+        if (n > len) n = len;
+        memcpy(z->win + z->op, br->buf + br->pos, n);
+        z->op += n;
+        br->pos += n;
+        len -= (uint32_t)n;
+    }
+    return ODZ_OK;
+}
+
+/* Decode DEFLATE blocks up to and including the final one */
+static int inflate_blocks(odz_dctx_t *d, bit_reader_t *br, inflate_t *z,
+                          const odz_options_t *opts) {
+    int rc, final;
+    do {
+        uint32_t hdr = br_read(br, 3);
+        final = hdr & 1;
+        const huff_decode_table_t *ll_tab, *d_tab;
+
+        switch (hdr >> 1) {
+        case 0:
+            if ((rc = inflate_stored(br, z)) != ODZ_OK) return rc;
+            continue;
+        case 1:
+            if ((rc = fixed_tables(d)) != ODZ_OK) return rc;
+            ll_tab = &d->ll_deflate;
+            d_tab  = &d->d_fixed;
+            break;
+        case 2: {
+            uint8_t ll_lens[LITLEN_SYMS], d_lens[DIST_SYMS];
+            int n_ll, n_dist;
+            if (huff_read_trees(br, ll_lens, &n_ll, d_lens, &n_dist, DIST_SYMS) != 0)
+                return ODZ_ERR_CORRUPT;
+            if (huff_build_decode_table2(ll_lens, LITLEN_SYMS, &d->ll_tab) != 0 ||
+                huff_build_decode_table2(d_lens, DIST_SYMS, &d->d_tab) != 0)
+                return ODZ_ERR_OOM;
+            ll_tab = &d->ll_tab;
+            d_tab  = &d->d_tab;
+            break;
+        }
+        default:
+            return ODZ_ERR_CORRUPT;
+        }
+
+        while ((rc = decode_tokens(br, ll_tab, d_tab, z->win, INFLATE_CAP,
+                                   INFLATE_STOP, &z->op, NULL)) == DECODE_FULL) {
+            /* A truncated stream decodes as zeros; don't spin on it */
+            if (br_overrun(br)) return ODZ_ERR_CORRUPT;
+            if ((rc = inflate_flush(z)) != ODZ_OK) return rc;
+            if (opts && opts->progress &&
+                opts->progress(br_byte_pos(br), br->len, opts->userdata) != 0)
+                return ODZ_ERR_IO;
+        }
+        if (rc != ODZ_OK) return rc;
+        if (br_overrun(br)) return ODZ_ERR_CORRUPT;
+    } while (!final);
+
+    br_consume(br, br->nbits & 7);
+    return inflate_flush(z);
+}
+
+/* Length of the gzip member header at p[0..n), 0 if invalid */
+static size_t gzip_header(const uint8_t *p, size_t n) {
+    if (n < 10 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 0xE0)) return 0;
+    int flg = p[3];
+    size_t pos = 10;
+    if (flg & 4) {                          /* FEXTRA */
+        if (n - pos < 2) return 0;
+        size_t xlen = (size_t)p[pos] | ((size_t)p[pos + 1] << 8);
+        if (n - pos - 2 < xlen) return 0;
+        pos += 2 + xlen;
+    }
+    for (int bit = 8; bit <= 16; bit <<= 1) {  /* FNAME, FCOMMENT */
+        if (!(flg & bit)) continue;
+        const uint8_t *z = memchr(p + pos, 0, n - pos);
+        if (!z) return 0;
+        pos = (size_t)(z - p) + 1;
+    }
+    if (flg & 2) {                          /* FHCRC */
+        if (n - pos < 2) return 0;
+        pos += 2;
+    }
+    return pos;
+}
+
+/* Decode a whole DEFLATE / zlib / gzip stream held in memory.
+ * gzip members may be concatenated, like odz frames. */
+static int inflate_stream(odz_dctx_t *d, const uint8_t *in, size_t n, int format,
+                          odz_sink_t *out, const odz_options_t *opts) {
+    if (d->block_cap < INFLATE_CAP) {
+        free(d->block_out);
+        d->block_out = malloc(INFLATE_CAP);
+        d->block_cap = d->block_out ? INFLATE_CAP : 0;
+        if (!d->block_out) return ODZ_ERR_OOM;
+    }
+
+    size_t pos = 0;
+    do {
+        inflate_t z = { .win = d->block_out, .out = out, .format = format,
+                        .check = format == ODZ_FMT_ZLIB ? 1 : 0 };
+
+        if (format == ODZ_FMT_GZIP) {
+            size_t h = gzip_header(in + pos, n - pos);
+            if (h == 0) return ODZ_ERR_FORMAT;
+            pos += h;
+        } else if (format == ODZ_FMT_ZLIB) {
+            /* CM = 8, window <= 32K, header check, no preset dictionary */
+            if (n - pos < 2 || (in[pos] & 0x0F) != 8 || (in[pos] >> 4) > 7 ||
+                ((unsigned)in[pos] << 8 | in[pos + 1]) % 31 != 0 || (in[pos + 1] & 0x20))
+                return ODZ_ERR_FORMAT;
+            pos += 2;
+        }
+
+        bit_reader_t br;
+        br_init(&br, in + pos, n - pos);
+        int rc = inflate_blocks(d, &br, &z, opts);
+        if (rc != ODZ_OK) return rc;
+        pos += br_byte_pos(&br);
+
+        if (format == ODZ_FMT_GZIP) {
+            if (n - pos < 8) return ODZ_ERR_CORRUPT;
+            if (rd_u32le(in + pos) != z.check ||
+                rd_u32le(in + pos + 4) != (uint32_t)z.total)
+                return ODZ_ERR_CORRUPT;
+            pos += 8;
+        } else if (format == ODZ_FMT_ZLIB) {
+            if (n - pos < 4) return ODZ_ERR_CORRUPT;
+            uint32_t a = (uint32_t)in[pos] << 24 | (uint32_t)in[pos + 1] << 16 |
+                         (uint32_t)in[pos + 2] << 8 | in[pos + 3];
+            if (a != z.check) return ODZ_ERR_CORRUPT;
+            pos += 4;
+        }
+    } while (format == ODZ_FMT_GZIP && pos < n);
+
+    /* Anything after the stream is an error, as with odz frames */
+    return pos == n ? ODZ_OK : ODZ_ERR_FORMAT;
+}
+
+/* Read all of a FILE into memory: DEFLATE blocks carry no length, so the
+ * bit reader needs the whole compressed stream up front. */
+static int read_all(FILE *f, uint8_t **buf, size_t *len) {
+    size_t cap = 1 << 16, n = 0;
+    uint8_t *b = malloc(cap);
+    if (!b) return ODZ_ERR_OOM;
+    for (;;) {
+        n += fread(b + n, 1, cap - n, f);
+        if (n < cap) break;
+        uint8_t *nb = realloc(b, cap * 2);
+        if (!nb) { free(b); return ODZ_ERR_OOM; }
+        b = nb;
+        cap *= 2;
+    }
+    if (ferror(f)) { free(b); return ODZ_ERR_IO; }
+    *buf = b;
+    *len = n;
+    return ODZ_OK;
+}
+
+/* ── Public API ────────────────────────────────────────────── */
+
+int odz_decompressed_size(const void *src, size_t n, uint64_t *size) {
+    /* Walk frame and block headers only; no decoding, no allocation
+     * (src_take never copies from a memory source). */
+    source_t in = { .buf = src, .len = n };
+    uint64_t total = 0;
+    int rc;
+
+    for (int nframes = 0; ; nframes++) {
+        uint8_t magic[4];
+        size_t got = src_read_some(&in, magic, 4);
+        if (got == 0 && nframes > 0) break;
+        if (got < 4) return ODZ_ERR_FORMAT;
+
+        if (magic[0] == 'O' && magic[1] == 'D' && magic[2] == 'S') {
+            uint8_t sz[4];
+            if ((rc = src_read(&in, sz, 4)) != ODZ_OK) return rc;
+            if (rd_u32le(sz) > in.len - in.pos) return ODZ_ERR_CORRUPT;
+            in.pos += rd_u32le(sz);
+            continue;
+        }
+        if (magic[0] != 'O' || magic[1] != 'D' || (magic[2] != 'Z' && magic[2] != 'P'))
+            return ODZ_ERR_FORMAT;
+
+        frame_hdr_t f;
+        if ((rc = read_frame_header(&in, magic, &f)) != ODZ_OK) return rc;
+        uint64_t frame_out = 0;
+        for (;;) {
+            block_hdr_t b;
+            if ((rc = read_block_header(&in, &f, frame_out, &b)) != ODZ_OK) return rc;
+            if ((uint64_t)b.payload + f.tag > in.len - in.pos) return ODZ_ERR_CORRUPT;
+            in.pos += b.payload + f.tag;
+            frame_out += b.raw_size;
+            if (b.is_last) break;
+        }
+        if (frame_out != f.original_size) return ODZ_ERR_CORRUPT;
+        total += f.original_size;
+    }
+    *size = total;
+    return ODZ_OK;
+}
+
+int odz_block_index(FILE *f, odz_block_ref_t **refs, size_t *n,
+                    int *block_log, int *rsyncable) {
+    source_t in = { .f = f };
+    odz_block_ref_t *r = NULL;
+    size_t cnt = 0, cap = 0;
+    int rc = ODZ_OK, nframes = 0;
+
+    for (;;) {
+        uint8_t magic[4];
+        size_t got = src_read_some(&in, magic, 4);
+        if (got == 0 && nframes > 0) break;
+        if (got < 4) { rc = nframes > 0 ? ODZ_ERR_FORMAT : ODZ_ERR_IO; goto fail; }
+
+        if (magic[0] == 'O' && magic[1] == 'D' && magic[2] == 'S') {
+            uint8_t sz[4];
+            if ((rc = src_read(&in, sz, 4)) != ODZ_OK) goto fail;
+            if (fseeko(f, rd_u32le(sz), SEEK_CUR) != 0) { rc = ODZ_ERR_IO; goto fail; }
+            continue;
+        }
+        if (magic[0] != 'O' || magic[1] != 'D' || magic[2] != 'Z') { rc = ODZ_ERR_FORMAT; goto fail; }
+
+        frame_hdr_t fh;
+        if ((rc = read_frame_header(&in, magic, &fh)) != ODZ_OK) goto fail;
+        if (!(fh.flags & ODZ_FLAG_BLOCK_HASH) || fh.encrypted || fh.window_log ||
+            (fh.flags & ODZ_FLAG_COPIES) || fh.filtered) {
+            rc = ODZ_ERR_PARAM;
+            goto fail;
+        }
+        if (nframes++ == 0) {
+            *block_log = fh.hdr[5];
+            *rsyncable = (fh.flags & ODZ_FLAG_RSYNCABLE) != 0;
+        }
+
+        uint64_t frame_out = 0;
+        for (;;) {
+            int64_t off = ftello(f);
+            if (off < 0) { rc = ODZ_ERR_IO; goto fail; }
+            block_hdr_t b;
+            if ((rc = read_block_header(&in, &fh, frame_out, &b)) != ODZ_OK) goto fail;
+            if (fseeko(f, b.payload, SEEK_CUR) != 0) { rc = ODZ_ERR_IO; goto fail; }
+
+            if (cnt == cap) {
+                size_t ncap = cap ? cap * 2 : 256;
+                odz_block_ref_t *nr = realloc(r, ncap * sizeof *r);
+                if (!nr) { rc = ODZ_ERR_OOM; goto fail; }
+                r = nr;
+                cap = ncap;
             }
+            r[cnt].hash     = b.hash;
+            r[cnt].offset   = (uint64_t)off;
+            r[cnt].raw_size = b.raw_size;
+            r[cnt].len      = (uint32_t)b.raw_len + b.payload;
+            cnt++;
+
+            frame_out += b.raw_size;
+            if (b.is_last) break;
         }
+        if (frame_out != fh.original_size) { rc = ODZ_ERR_CORRUPT; goto fail; }
+    }
+    *refs = r;
+    *n = cnt;
+    return ODZ_OK;
+
+fail:
+    free(r);
+    return rc;
+}
 
-        if (is_last) break;
+/* odz_decompress, or odz_patch_apply when ref is set */
+static int decompress_file(FILE *in, FILE *out, const odz_options_t *opts, FILE *ref) {
+    int format = opts ? opts->format : ODZ_FMT_ODZ;
+    if (format < ODZ_FMT_ODZ || format > ODZ_FMT_DEFLATE) return ODZ_ERR_PARAM;
+
+    if (format == ODZ_FMT_ODZ) {
+        /* Sniff gzip (1f 8b) and zlib (CM = 8 in the low nibble) from the
+         * first byte; odz's 'O' is neither. */
+        int c = getc(in);
+        if (c != EOF && ungetc(c, in) == EOF) return ODZ_ERR_IO;
+        if (c == 0x1f) format = ODZ_FMT_GZIP;
+        else if (c != EOF && (c & 0x0F) == 8) format = ODZ_FMT_ZLIB;
     }
 
-    if (total_out != original_size) { rc = ODZ_ERR_CORRUPT; goto cleanup; }
+    odz_dctx_t *d = odz_dctx_new();
+    if (!d) return ODZ_ERR_OOM;
+    d->ref = ref;
+
+    odz_sink_t sink = { .f = out };
+    int rc = opts && opts->key ? odz_dctx_set_key(d, opts->key) : ODZ_OK;
+    if (rc != ODZ_OK) {
+        odz_dctx_free(d);
+        return rc;
+    }
+    if (format == ODZ_FMT_ODZ) {
+        source_t src = { .f = in };
+        rc = decompress_stream(d, &src, &sink, opts);
+    } else {
+        uint8_t *buf;
+        size_t len;
+        if ((rc = read_all(in, &buf, &len)) == ODZ_OK) {
+            rc = inflate_stream(d, buf, len, format, &sink, opts);
+            free(buf);
+        }
+    }
 
-cleanup:
-    huff_free_decode_table2(&ll_tab);
-    huff_free_decode_table2(&d_tab);
-    free(block_out);
-    free(comp);
+    odz_dctx_free(d);
     return rc;
 }
+
+int odz_decompress(FILE *in, FILE *out, const odz_options_t *opts) {
+    return decompress_file(in, out, opts, NULL);
+}
+
+int odz_patch_apply(FILE *ref, FILE *patch, FILE *out, const odz_options_t *opts) {
+    return decompress_file(patch, out, opts, ref);
+}
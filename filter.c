@@ -0,0 +1,68 @@
+#include "filter.h"
+#include <string.h>
+
+static const uint8_t strides[ODZ_FILTER_MAX - ODZ_FILTER_DELTA + 1] = { 1, 2, 3, 4, 6, 8, 12, 16 };
+
+size_t filter_stride(int id) {
+    return strides[id - ODZ_FILTER_DELTA];
+}
+
+/* E8/E9 operands in place: relative → absolute when encoding, back when
+ * decoding. The 25-bit value (24 bits + the sign in the top byte) is
+ * shifted by the position after the instruction, mod 2^25, and its top
+ * byte rewritten as 00 / FF. Every E8/E9 skips its 4 operand bytes,
+ * converted or not, so no conversion ever changes a byte the other side
+ * decides on: both see the same opcodes and the same top bytes. */
+static void x86_convert(uint8_t *p, size_t n, int encode) {
+    for (size_t i = 0; i + 5 <= n; ) {
+        if ((p[i] & 0xFE) != 0xE8) {
+            i++;
+            continue;
+        }
+        if (p[i + 4] != 0x00 && p[i + 4] != 0xFF) {
+            i += 5;
+            continue;
+        }
+        uint32_t v = (uint32_t)p[i + 1] | (uint32_t)p[i + 2] << 8 |
+                     (uint32_t)p[i + 3] << 16 | (uint32_t)(p[i + 4] & 1) << 24;
+        uint32_t pos = (uint32_t)(i + 5);
+        v = (encode ? v + pos : v - pos) & 0x1FFFFFF;
+        p[i + 1] = (uint8_t)v;
+        p[i + 2] = (uint8_t)(v >> 8);
+        p[i + 3] = (uint8_t)(v >> 16);
+        p[i + 4] = (v >> 24) ? 0xFF : 0x00;
+        i += 5;
+    }
+}
+
+void filter_encode(int id, const uint8_t *in, uint8_t *out, size_t n) {
+    if (id == ODZ_FILTER_X86) {
+        memcpy(out, in, n);
+        x86_convert(out, n, 1);
+        return;
+    }
+    size_t s = filter_stride(id);
+    for (size_t k = 0; k < s; k++) {
+        uint8_t prev = 0;
+        for (size_t i = k; i < n; i += s) {
+            *out++ = (uint8_t)(in[i] - prev);
+            prev = in[i];
+        }
+    }
+}
+
+void filter_decode(int id, const uint8_t *in, uint8_t *out, size_t n) {
+    if (id == ODZ_FILTER_X86) {
+        memcpy(out, in, n);
+        x86_convert(out, n, 0);
+        return;
+    }
+    size_t s = filter_stride(id);
+    for (size_t k = 0; k < s; k++) {
+        uint8_t prev = 0;
+        for (size_t i = k; i < n; i += s) {
+            prev = (uint8_t)(prev + *in++);
+            out[i] = prev;
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef FILTER_H
+#define FILTER_H
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Reversible transforms a block's data can go through before LZ77, for
+ * data that compresses badly as it is:
+ *
+ * x86: the rel32 operand of E8 (call) / E9 (jmp) opcodes becomes an
+ * absolute (block-relative) target, so calls to the same function repeat.
+ * Only operands within +-16 MB (top byte 00 or FF) are converted, and
+ * they stay that way, so the decoder finds the same ones.
+ *
+ * Delta: the block is split into `stride` planes (byte k of every
+ * stride-byte record) and each plane is delta-coded, so slowly changing
+ * fixed-width numbers turn into runs of small values.
+ */
+
+#define ODZ_FILTER_NONE    0
+#define ODZ_FILTER_X86     1
+#define ODZ_FILTER_DELTA   2    /* 2..ODZ_FILTER_MAX: delta, filter_stride() */
+#define ODZ_FILTER_MAX     9
+
+/* Record size of a delta filter */
+size_t filter_stride(int id);
+
+/* in[0..n) → out[0..n), which must not overlap */
+void filter_encode(int id, const uint8_t *in, uint8_t *out, size_t n);
+void filter_decode(int id, const uint8_t *in, uint8_t *out, size_t n);
+
+#endif
@@ -64,6 +64,19 @@ static void limit_lengths(uint8_t *lengths, int nsym, int max_bits) {
 check_kraft:
         ;
     }
+
+    /* Undersubscribed: hand the slack back by shortening the longest codes
+     * that fit. Leaves a complete code, which DEFLATE decoders require. */
+    for (int d = max_bits; d >= 2 && kraft < target; d--) {
+        for (int i = 0; i < nsym && kraft < target; i++) {
+            if (lengths[i] == d && kraft + (1 << (max_bits - d)) <= target) {
+                kraft += 1 << (max_bits - d);
+                lengths[i]--;
+                d = max_bits + 1;   /* restart from the longest */
+                break;
+            }
+        }
+    }
 }
 
 void huff_build_lengths(const uint32_t *freqs, int nsym, int max_bits,
@@ -145,6 +158,17 @@ void huff_build_codes(const uint8_t *lengths, int nsym, uint16_t *codes) {
     }
 }
 
+/* ── Fixed codes ───────────────────────────────────────────── */
+
+void huff_fixed_lengths(uint8_t *ll_lens, int n_ll, uint8_t *d_lens) {
+    int i = 0;
+    for (; i < 144; i++)  ll_lens[i] = 8;
+    for (; i < 256; i++)  ll_lens[i] = 9;
+    for (; i < 280; i++)  ll_lens[i] = 7;
+    for (; i < n_ll; i++) ll_lens[i] = 8;
+    for (i = 0; i < DIST_SYMS; i++) d_lens[i] = 5;
+}
+
 /* ── Build flat decode table ───────────────────────────────── */
 
 void huff_build_decode_table(const uint8_t *lengths, int nsym,
@@ -177,8 +201,19 @@ void huff_build_decode_table(const uint8_t *lengths, int nsym,
 
 int huff_build_decode_table2(const uint8_t *lengths, int nsym,
                               huff_decode_table_t *t) {
-    const int pbits = HUFF_PRIMARY_BITS;
+    /* Find max code length to know if we need secondary tables */
+    int max_len = 0;
+    t->max_sym = -1;
+    for (int s = 0; s < nsym; s++) {
+        if (lengths[s] > max_len) max_len = lengths[s];
+        if (lengths[s]) t->max_sym = s;
+    }
+
+    /* Codes short enough for one flat table get one */
+    const int pbits = max_len > HUFF_PRIMARY_BITS && max_len <= HUFF_FLAT_BITS
+                    ? max_len : HUFF_PRIMARY_BITS;
     const int psize = 1 << pbits;
+    t->mask = (uint32_t)psize - 1;
 
     /* Default primary: invalid */
     for (int i = 0; i < psize; i++) {
@@ -187,14 +222,9 @@ int huff_build_decode_table2(const uint8_t *lengths, int nsym,
     }
 
     /* Build canonical codes */
-    uint16_t codes[LITLEN_SYMS];
+    uint16_t codes[LITLEN_FIXED];
     huff_build_codes(lengths, nsym, codes);
 
-    /* Find max code length to know if we need secondary tables */
-    int max_len = 0;
-    for (int s = 0; s < nsym; s++)
-        if (lengths[s] > max_len) max_len = lengths[s];
-
     /* First pass: fill primary table for codes <= pbits */
     for (int s = 0; s < nsym; s++) {
         if (lengths[s] == 0 || lengths[s] > pbits) continue;
@@ -354,22 +384,31 @@ static int rle_encode(const uint8_t *lens, int n,
     return out;
 }
 
+/* Width of the HDIST field for a distance alphabet of n symbols */
+static int hdist_bits(int n) {
+    int bits = 5;
+    while ((1 << bits) < n) bits++;
+    return bits;
+}
+
 void huff_write_trees(bit_writer_t *bw,
                       const uint8_t *ll_lens, int n_ll,
                       const uint8_t *d_lens, int n_dist) {
+    int dist_bits = hdist_bits(n_dist);
+
     /* Trim trailing zeros (but keep at least 257 lit/len and 1 dist) */
     while (n_ll > 257 && ll_lens[n_ll - 1] == 0) n_ll--;
     while (n_dist > 1 && d_lens[n_dist - 1] == 0) n_dist--;
 
     /* Concatenate and RLE-encode */
-    uint8_t combined[LITLEN_SYMS + DIST_SYMS];
+    uint8_t combined[LITLEN_SYMS + DIST_SYMS_MAX];
     memcpy(combined, ll_lens, (size_t)n_ll);
     memcpy(combined + n_ll, d_lens, (size_t)n_dist);
     int total_lens = n_ll + n_dist;
 
-    uint8_t rle_syms[LITLEN_SYMS + DIST_SYMS + 64];
-    uint8_t rle_extra[LITLEN_SYMS + DIST_SYMS + 64];
-    uint8_t rle_ebits[LITLEN_SYMS + DIST_SYMS + 64];
+    uint8_t rle_syms[LITLEN_SYMS + DIST_SYMS_MAX + 64];
+    uint8_t rle_extra[LITLEN_SYMS + DIST_SYMS_MAX + 64];
+    uint8_t rle_ebits[LITLEN_SYMS + DIST_SYMS_MAX + 64];
     int nrle = rle_encode(combined, total_lens, rle_syms, rle_extra, rle_ebits);
 
     /* Build Huffman tree for the RLE symbols (code-length alphabet) */
@@ -385,9 +424,9 @@ void huff_write_trees(bit_writer_t *bw,
     int hclen = CODELEN_SYMS;
     while (hclen > 4 && cl_lens[codelen_order[hclen - 1]] == 0) hclen--;
 
-    /* Write header: HLIT(5), HDIST(5), HCLEN(4) */
+    /* Write header: HLIT(5), HDIST(5+), HCLEN(4) */
     bw_write(bw, (uint32_t)(n_ll - 257), 5);
-    bw_write(bw, (uint32_t)(n_dist - 1), 5);
+    bw_write(bw, (uint32_t)(n_dist - 1), dist_bits);
     bw_write(bw, (uint32_t)(hclen - 4), 4);
 
     /* Write code-length code lengths (3 bits each, permuted order) */
@@ -403,18 +442,36 @@ void huff_write_trees(bit_writer_t *bw,
     }
 }
 
+/* Reject over-subscribed code lengths (a prefix code can't have them,
+ * and the table builders assume it). Incomplete codes are allowed. */
+static int lengths_valid(const uint8_t *lens, int nsym, int max_bits) {
+    int count[HUFF_MAX_BITS + 1] = {0};
+    for (int s = 0; s < nsym; s++) {
+        if (lens[s] > max_bits) return 0;
+        count[lens[s]]++;
+    }
+    int left = 1;
+    for (int len = 1; len <= max_bits; len++) {
+        left = (left << 1) - count[len];
+        if (left < 0) return 0;
+    }
+    return 1;
+}
+
 int huff_read_trees(bit_reader_t *br,
                      uint8_t *ll_lens, int *n_ll,
-                     uint8_t *d_lens, int *n_dist) {
+                     uint8_t *d_lens, int *n_dist, int dist_syms) {
     int hlit  = (int)br_read(br, 5) + 257;
-    int hdist = (int)br_read(br, 5) + 1;
+    int hdist = (int)br_read(br, hdist_bits(dist_syms)) + 1;
     int hclen = (int)br_read(br, 4) + 4;
+    if (hlit > LITLEN_SYMS || hdist > dist_syms) return -1;
 
     /* Read code-length code lengths */
     uint8_t cl_lens[CODELEN_SYMS];
     memset(cl_lens, 0, sizeof cl_lens);
     for (int i = 0; i < hclen; i++)
         cl_lens[codelen_order[i]] = (uint8_t)br_read(br, 3);
+    if (!lengths_valid(cl_lens, CODELEN_SYMS, HUFF_CL_MAX_BITS)) return -1;
 
     /* Build decode table for code-length alphabet */
     huff_entry_t cl_table[1 << HUFF_CL_MAX_BITS];
@@ -422,7 +479,7 @@ int huff_read_trees(bit_reader_t *br,
 
     /* Decode the combined lit/len + distance code lengths */
     int total = hlit + hdist;
-    uint8_t combined[LITLEN_SYMS + DIST_SYMS];
+    uint8_t combined[LITLEN_SYMS + DIST_SYMS_MAX];
     memset(combined, 0, sizeof combined);
 
     int i = 0;
@@ -446,10 +503,15 @@ int huff_read_trees(bit_reader_t *br,
         }
     }
 
+    if (combined[LITLEN_END] == 0 ||
+        !lengths_valid(combined, hlit, HUFF_MAX_BITS) ||
+        !lengths_valid(combined + hlit, hdist, HUFF_MAX_BITS))
+        return -1;
+
     memcpy(ll_lens, combined, (size_t)hlit);
     memset(ll_lens + hlit, 0, (size_t)(LITLEN_SYMS - hlit));
     memcpy(d_lens, combined + hlit, (size_t)hdist);
-    memset(d_lens + hdist, 0, (size_t)(DIST_SYMS - hdist));
+    memset(d_lens + hdist, 0, (size_t)(dist_syms - hdist));
 
     *n_ll = hlit;
     *n_dist = hdist;
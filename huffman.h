@@ -8,6 +8,7 @@
 #define HUFF_MAX_BITS     15   /* max code length for lit/len and distance */
 #define HUFF_CL_MAX_BITS  7    /* max code length for the code-length alphabet */
 #define HUFF_PRIMARY_BITS 9    /* primary table bits for two-level decode */
+#define HUFF_FLAT_BITS    11   /* codes up to this long decode in one lookup */
 
 /* Decode table entry — used for fast table-based decoding */
 typedef struct {
@@ -15,9 +16,12 @@ typedef struct {
     uint16_t len;   /* bits consumed */
 } huff_entry_t;
 
-/* Two-level decode table: 9-bit primary + secondary overflow */
+/* Two-level decode table: 9-bit primary + secondary overflow, or a flat
+ * table of up to 11 bits when no code is longer */
 typedef struct {
-    huff_entry_t primary[1 << HUFF_PRIMARY_BITS];  /* 512 entries = 2KB */
+    huff_entry_t primary[1 << HUFF_FLAT_BITS];     /* 2048 entries = 8KB */
+    uint32_t      mask;                            /* primary index bits */
+    int           max_sym;                         /* last symbol with a code */
     huff_entry_t *secondary;                         /* overflow sub-tables */
     int           secondary_size;
     int           secondary_cap;
@@ -39,6 +43,15 @@ void huff_build_lengths(const uint32_t *freqs, int nsym, int max_bits,
 void huff_build_codes(const uint8_t *lengths, int nsym,
                       uint16_t *codes);
 
+/*
+ * Fill in the fixed lit/len + distance code lengths (DEFLATE BTYPE=01)
+ * for n_ll lit/len symbols. These are implied by the block type, so no
+ * trees are written. DEFLATE's code has LITLEN_FIXED symbols; odz fixed
+ * blocks leave out the last two (LITLEN_SYMS), which moves the 9-bit
+ * codes of literals 144-255.
+ */
+void huff_fixed_lengths(uint8_t *ll_lens, int n_ll, uint8_t *d_lens);
+
 /*
  * Build a flat decode table from code lengths.
  * table must have (1 << table_bits) entries.
@@ -49,6 +62,8 @@ void huff_build_decode_table(const uint8_t *lengths, int nsym,
 
 /*
  * Build a two-level decode table (9-bit primary + secondary overflow).
+ * If no code is longer than HUFF_FLAT_BITS, the primary table takes
+ * every code and there is no secondary.
  * Primary table is stack-allocated inside the struct; secondary is heap-allocated.
  * Call huff_free_decode_table2 when done, or reuse by calling build again.
  * Returns 0 on success, -1 on OOM.
@@ -60,17 +75,20 @@ void huff_free_decode_table2(huff_decode_table_t *t);
 /*
  * Write lit/len + distance Huffman trees to the bitstream
  * using the DEFLATE 3-level code-length encoding.
+ * n_dist is the size of the distance alphabet, which sets the width of the
+ * HDIST field (5 bits for DEFLATE's 30 symbols, wider for larger ones).
  */
 void huff_write_trees(bit_writer_t *bw,
                       const uint8_t *ll_lens, int n_ll,
                       const uint8_t *d_lens, int n_dist);
 
 /*
- * Read lit/len + distance Huffman trees from the bitstream.
+ * Read lit/len + distance Huffman trees from the bitstream, for a
+ * distance alphabet of dist_syms symbols (d_lens is filled to that).
  * Returns 0 on success, -1 on corrupt data.
  */
 int  huff_read_trees(bit_reader_t *br,
                      uint8_t *ll_lens, int *n_ll,
-                     uint8_t *d_lens, int *n_dist);
+                     uint8_t *d_lens, int *n_dist, int dist_syms);
 
 #endif
@@ -3,8 +3,9 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
-#define ODZ_FORMAT_VERSION  2
+#define ODZ_FORMAT_VERSION  3
 
 /* Error codes */
 #define ODZ_OK          0
@@ -12,19 +13,139 @@
 #define ODZ_ERR_OOM     2
 #define ODZ_ERR_FORMAT  3   /* bad magic, unsupported version */
 #define ODZ_ERR_CORRUPT 4   /* data integrity error */
+#define ODZ_ERR_SPACE   5   /* output buffer too small */
+#define ODZ_ERR_PARAM   6   /* invalid option */
+#define ODZ_ERR_AUTH    7   /* wrong key or tampered data */
+#define ODZ_ERR_NOKEY   8   /* stream is encrypted, no key given */
+#define ODZ_ERR_REF     9   /* patch without its reference, or the wrong one */
 
 /* Progress callback.
  * Return 0 to continue, nonzero to abort. */
 typedef int (*odz_progress_fn)(uint64_t processed, uint64_t total, void *userdata);
 
+/* Stream formats (odz_options_t.format) */
+#define ODZ_FMT_ODZ      0   /* native; decompression also detects gzip/zlib */
+#define ODZ_FMT_GZIP     1   /* RFC 1952 */
+#define ODZ_FMT_ZLIB     2   /* RFC 1950 */
+#define ODZ_FMT_DEFLATE  3   /* raw RFC 1951, no header or checksum */
+
+#define ODZ_KEY_SIZE  32    /* odz_options_t.key */
+
 /* Options (pass NULL for defaults / no progress) */
 typedef struct {
     odz_progress_fn progress;
     void *userdata;
+    int threads;    /* worker threads (0 or 1 = calling thread): batch
+                     * calls spread items over them, file compression
+                     * splits large blocks between them and parses the
+                     * next block while coding the current one */
+    size_t block_size;  /* compression block size: a power of two from
+                         * 64 KB to 64 MB, recorded in the stream
+                         * (0 = default, 1 MB) */
+    int format;     /* ODZ_FMT_*; FILE API only (batch calls reject others) */
+    const uint8_t *key; /* 32-byte AES-256 key: compression encrypts every
+                         * block with AES-256-GCM (odz format only),
+                         * decompression needs it for encrypted streams */
+    int rsyncable;  /* compression: end blocks where the content says so
+                     * (a rolling hash) rather than every block_size bytes,
+                     * so a local edit only changes nearby output */
+    size_t window_size; /* compression: also match repeats up to this far
+                         * back, across blocks (a power of two from 64 KB
+                         * to 1 GB; 0 = off, matches stay within a block
+                         * and 32 KB). Decompressing such a stream keeps
+                         * that much output in memory. odz format only. */
+    int dedup;      /* compression: store a block identical to an earlier
+                     * one as a reference to it (odz format, unencrypted).
+                     * odz_decompress then re-reads that earlier output
+                     * from its out FILE, which must be open for reading
+                     * too (mode "w+b"); memory output needs nothing. */
+    int filters;    /* compression: try an x86 call/jump and a delta
+                     * filter on a sample of every block and run it
+                     * through the best one first (odz format; ignored
+                     * with window_size and for patches). Helps
+                     * executables and arrays of fixed-width numbers. */
+    int archive;    /* compression: code every block with an optimal
+                     * parse and an adaptive range coder (odz format).
+                     * Smaller output, but several times slower to
+                     * compress and to decompress. */
+    int fast_decode;    /* compression: keep Huffman codes to 11 bits, so
+                         * every symbol decodes with one table lookup.
+                         * Output grows by a fraction of a percent; any
+                         * reader decodes it. */
 } odz_options_t;
 
+/* A compressed stream is a sequence of independent frames: odz_compress
+ * writes one, and odz_decompress reads frames until the end of the input,
+ * so concatenated .odz files (`cat a.odz b.odz`) decompress to the
+ * concatenated inputs. */
 int odz_compress(FILE *in, FILE *out, const odz_options_t *opts);
 int odz_decompress(FILE *in, FILE *out, const odz_options_t *opts);
 const char *odz_strerror(int err);
 
+/* Compress in to out like odz_compress, but copy every block whose data
+ * is unchanged from old (an odz stream written by odz_compress, seekable)
+ * instead of compressing it again, so the work scales with what changed.
+ * Uses old's block size and boundaries; opts->block_size is ignored.
+ * Unchanged data after an insertion is only found again if old was
+ * rsyncable. *reused (if not NULL) gets the input bytes copied.
+ * Returns ODZ_ERR_PARAM for encrypted, batch-written (no block hashes),
+ * long-distance, dedup or filtered old streams, or a key, window_size,
+ * dedup, filters or non-odz format in opts. */
+int odz_update(FILE *old, FILE *in, FILE *out, const odz_options_t *opts,
+               uint64_t *reused);
+
+/* Compress in to out as a patch against ref, an earlier version of the
+ * same data: a long-distance stream whose matches reach back into ref
+ * (read twice, so it must be seekable), so whatever the two share costs
+ * next to nothing. Returns ODZ_ERR_PARAM for a key or non-odz format. */
+int odz_patch_create(FILE *ref, FILE *in, FILE *out, const odz_options_t *opts);
+
+/* Decompress a patch from odz_patch_create back to the new data, given
+ * the same ref (checked by size and CRC-32: ODZ_ERR_REF if it differs).
+ * Plain odz streams decompress as with odz_decompress; odz_decompress
+ * fails on patches with ODZ_ERR_REF. */
+int odz_patch_apply(FILE *ref, FILE *patch, FILE *out, const odz_options_t *opts);
+
+/* Write a skippable frame carrying up to 4 GB of opaque metadata; kind is
+ * 0-255, free for applications to use. Decoders skip it entirely, so it
+ * may sit before, between or after data frames. */
+int odz_write_skippable(FILE *out, int kind, const void *data, size_t size);
+
+/* ── Batch API ─────────────────────────────────────────────── */
+
+/* One input buffer */
+typedef struct {
+    const void *data;
+    size_t      size;
+} odz_in_span_t;
+
+/* One output buffer. size and err are filled in per item. */
+typedef struct {
+    void   *data;
+    size_t  cap;
+    size_t  size;   /* bytes written */
+    int     err;    /* ODZ_OK or ODZ_ERR_* for this item */
+} odz_out_span_t;
+
+/* Worst-case compressed size of an n-byte input; size out[i].cap with it */
+size_t odz_compress_bound(size_t n);
+
+/* Total original size of a compressed stream, summed over its frames.
+ * Only headers are read. Returns ODZ_OK, ODZ_ERR_FORMAT or ODZ_ERR_CORRUPT. */
+int odz_decompressed_size(const void *src, size_t n, uint64_t *size);
+
+/*
+ * Compress / decompress n independent buffers: in[i] → out[i], each a
+ * complete stream. Working memory is shared across items (one context per
+ * thread), and opts->threads > 1 spreads items across that many threads.
+ * progress, if set, is called after each item with the input bytes done so
+ * far; returning nonzero skips the items not yet started.
+ * Returns ODZ_OK if every item succeeded, else the first failing item's
+ * error (see out[i].err).
+ */
+int odz_compress_batch(const odz_in_span_t *in, odz_out_span_t *out, size_t n,
+                       const odz_options_t *opts);
+int odz_decompress_batch(const odz_in_span_t *in, odz_out_span_t *out, size_t n,
+                         const odz_options_t *opts);
+
 #endif
@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 
-static uint32_t hash3(uint8_t a, uint8_t b, uint8_t c, uint32_t mask){
+static uint32_t hash3(uint8_t a, uint8_t b, uint8_t c, int shift){
     uint32_t k = ((uint32_t)a<<16) ^ ((uint32_t)b<<8) ^ (uint32_t)c;
-    return (k * 2654435761u) & mask; // mask = (1<<hash_bits)-1
+    // top bits of the product mix all three bytes; the low bits only see the
+    // low bits of k, which for small tables would mean hashing one byte
+    return (k * 2654435761u) >> shift; // shift = 32-hash_bits
 }
 
 int lz_matcher_init(lz_matcher_t *m, size_t n_block, int hash_bits, int max_chain_steps){
@@ -14,6 +16,31 @@ int lz_matcher_init(lz_matcher_t *m, size_t n_block, int hash_bits, int max_chai
     if (!m->head || !m->prev) { free(m->head); free(m->prev); return -1; }
     m->n = n_block;
     m->hash_mask = (uint32_t)hash_size - 1u;
+    m->hash_shift = 32 - hash_bits;
+    m->max_chain_steps = max_chain_steps;
+    m->head_cap = hash_size;
+    m->prev_cap = n_block;
+    memset(m->head, 0xFF, hash_size * sizeof *m->head); // -1
+    return 0;
+}
+
+int lz_matcher_prepare(lz_matcher_t *m, size_t n_block, int hash_bits, int max_chain_steps){
+    size_t hash_size = (size_t)1 << hash_bits;
+    if (hash_size > m->head_cap) {
+        free(m->head);
+        m->head = (int32_t*)malloc(hash_size * sizeof *m->head);
+        m->head_cap = m->head ? hash_size : 0;
+        if (!m->head) return -1;
+    }
+    if (n_block > m->prev_cap) {
+        free(m->prev);
+        m->prev = (int32_t*)malloc(n_block * sizeof *m->prev);
+        m->prev_cap = m->prev ? n_block : 0;
+        if (!m->prev) return -1;
+    }
+    m->n = n_block;
+    m->hash_mask = (uint32_t)hash_size - 1u;
+    m->hash_shift = 32 - hash_bits;
     m->max_chain_steps = max_chain_steps;
     memset(m->head, 0xFF, hash_size * sizeof *m->head); // -1
     return 0;
@@ -28,11 +55,12 @@ void lz_matcher_reset(lz_matcher_t *m, size_t n_block){
 void lz_matcher_free(lz_matcher_t *m){
     free(m->head); free(m->prev);
     m->head = m->prev = NULL; m->n = 0;
+    m->head_cap = m->prev_cap = 0;
 }
 
 void lz_matcher_insert(lz_matcher_t *m, const uint8_t *in, size_t i) {
     if (i + 2 >= m->n) { m->prev[i] = -1; return; }
-    uint32_t h = hash3(in[i], in[i+1], in[i+2], m->hash_mask);
+    uint32_t h = hash3(in[i], in[i+1], in[i+2], m->hash_shift);
     m->prev[i] = m->head[h];
     m->head[h] = (int32_t)i;
 }
@@ -52,14 +80,15 @@ void lz_matcher_find_best(const lz_matcher_t *m, const uint8_t *in, size_t i, si
 {
     int best_len = 0, best_dist = 0;
     if (i + (size_t)min_match <= n) {
-        uint32_t h = hash3(in[i], in[i+1], in[i+2], m->hash_mask);
+        uint32_t h = hash3(in[i], in[i+1], in[i+2], m->hash_shift);
         int32_t p = m->head[h];
         int steps = 0;
         int maxl = (int)((n - i) < (size_t)max_match ? (n - i) : (size_t)max_match);
 
         while (p >= 0 && steps++ < m->max_chain_steps) {
             int dist = (int)(i - (size_t)p);
-            if (dist > 0 && dist <= window) {
+            if (dist > window) break;   // chains run newest first: the rest are older
+            if (dist > 0) {
                 int l = match_len(in + p, in + i, maxl);
                 if (l >= min_match && (l > best_len || (l == best_len && dist < best_dist))) {
                     best_len = l; best_dist = dist;
@@ -80,3 +109,22 @@ void lz_matcher_find_best_next(const lz_matcher_t *m, const uint8_t *in, size_t
     // pretend i+1 is the current position; safe because matcher chains are built incrementally (see compressor loop)
     lz_matcher_find_best(m, in, i+1, n, window, min_match, max_match, out_len, out_dist);
 }
+
+void lz_matcher_find_rep(const uint8_t *in, size_t i, size_t n,
+                         const int *reps, int nreps, int window,
+                         int min_match, int max_match,
+                         int *out_len, int *out_idx)
+{
+    int best_len = 0, best_idx = 0;
+    int maxl = (int)((n - i) < (size_t)max_match ? (n - i) : (size_t)max_match);
+    for (int k = 0; k < nreps; k++) {
+        size_t dist = (size_t)reps[k];
+        if (dist > i || dist > (size_t)window) continue;
+        const uint8_t *p = in + i - dist;
+        if (p[0] != in[i]) continue;
+        int l = match_len(p, in + i, maxl);
+        if (l > best_len) { best_len = l; best_idx = k; }
+    }
+    if (best_len < min_match) best_len = 0;
+    *out_len = best_len; *out_idx = best_idx;
+}
@@ -0,0 +1,125 @@
+#include "lz_long.h"
+#include "odz.h"
+#include <stdlib.h>
+#include <string.h>
+
+int ldm_reset(ldm_t *l, int window_log, uint64_t frame_size) {
+    int bits = LDM_RATE_LOG + LDM_BUCKET_LOG + 4;
+    while (bits < window_log && ((uint64_t)1 << bits) < frame_size) bits++;
+    l->window_log = window_log;
+    l->hash_log = bits - LDM_RATE_LOG - LDM_BUCKET_LOG;
+
+    size_t entries = (size_t)1 << (l->hash_log + LDM_BUCKET_LOG);
+    if (entries > l->cap) {
+        free(l->pos);
+        free(l->check);
+        l->pos = malloc(entries * sizeof *l->pos);
+        l->check = malloc(entries * sizeof *l->check);
+        l->cap = l->pos && l->check ? entries : 0;
+        if (!l->cap) return -1;
+    }
+    /* Empty entries point at frame position 0 with a check of 0: at worst
+     * a wasted comparison */
+    memset(l->pos, 0, entries * sizeof *l->pos);
+    memset(l->check, 0, entries * sizeof *l->check);
+    odz_gear_init(l->gear);
+    l->h = 0;
+    l->frame_pos = 0;
+    return 0;
+}
+
+void ldm_free(ldm_t *l) {
+    free(l->pos);
+    free(l->check);
+    free(l->matches);
+    memset(l, 0, sizeof *l);
+}
+
+/* Length of the common prefix of a and b, up to max */
+static size_t common_len(const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t l = 0;
+    for (; l + 8 <= max; l += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + l, 8);
+        memcpy(&y, b + l, 8);
+        if (x != y) break;
+    }
+    while (l < max && a[l] == b[l]) l++;
+    return l;
+}
+
+int ldm_find(ldm_t *l, const uint8_t *in, size_t n, size_t hist, size_t *count) {
+    /* Matches don't overlap and are at least LDM_MIN_MATCH long */
+    size_t need = n / LDM_MIN_MATCH + 1;
+    if (need > l->matches_cap) {
+        free(l->matches);
+        l->matches = malloc(need * sizeof *l->matches);
+        l->matches_cap = l->matches ? need : 0;
+        if (!l->matches) return -1;
+    }
+
+    const uint64_t base = l->frame_pos;            /* of in[0] */
+    const uint64_t window = (uint64_t)1 << l->window_log;
+    const int sel = 64 - LDM_RATE_LOG;
+    const int bshift = sel - l->hash_log, cshift = bshift - 32;
+    const uint64_t bmask = ((uint64_t)1 << l->hash_log) - 1;
+    uint64_t h = l->h;
+    size_t nm = 0;
+    size_t done = 0;    /* in[0..done) is taken by earlier matches */
+
+    for (size_t i = 0; i < n; i++) {
+        h = (h << 1) + l->gear[in[i]];
+        if ((h >> sel) != 0) continue;
+        uint64_t end = base + i + 1;
+        if (end < LDM_MIN_MATCH) continue;      /* h hasn't seen 64 bytes yet */
+        uint64_t start = end - LDM_MIN_MATCH;   /* the 64 bytes h covers */
+
+        size_t b = (size_t)((h >> bshift) & bmask) << LDM_BUCKET_LOG;
+        uint64_t *bp = l->pos + b;
+        uint32_t *bc = l->check + b;
+        uint32_t chk = (uint32_t)(h >> cshift);
+
+        if (start >= base + done) {
+            size_t w = (size_t)(start - base);
+            size_t best_len = 0, best_back = 0, best_dist = 0;
+            for (int k = 0; k < (1 << LDM_BUCKET_LOG); k++) {
+                if (bc[k] != chk || bp[k] >= start) continue;
+                uint64_t dist = start - bp[k];
+                if (dist > window || dist > w + hist) continue;  /* gone */
+
+                const uint8_t *p = in + w - (size_t)dist;
+                size_t len = common_len(p, in + w, n - w);
+                if (len < LDM_MIN_MATCH) continue;
+
+                /* Extend backwards over what the sample point missed */
+                size_t back = 0, max_back = w - done;
+                if (max_back > w + hist - (size_t)dist) max_back = w + hist - (size_t)dist;
+                while (back < max_back && p[-1 - (ptrdiff_t)back] == in[w - 1 - back]) back++;
+
+                if (len + back > best_len + best_back) {
+                    best_len = len;
+                    best_back = back;
+                    best_dist = (size_t)dist;
+                }
+            }
+            if (best_len) {
+                ldm_match_t *m = &l->matches[nm++];
+                m->pos  = (uint32_t)(w - best_back);
+                m->len  = (uint32_t)(best_len + best_back);
+                m->dist = (uint32_t)best_dist;
+                done = w + best_len;
+            }
+        }
+
+        /* Insert, dropping the bucket's oldest entry */
+        memmove(bp + 1, bp, ((1 << LDM_BUCKET_LOG) - 1) * sizeof *bp);
+        memmove(bc + 1, bc, ((1 << LDM_BUCKET_LOG) - 1) * sizeof *bc);
+        bp[0] = start;
+        bc[0] = chk;
+    }
+
+    l->h = h;
+    l->frame_pos = base + n;
+    *count = nm;
+    return 0;
+}
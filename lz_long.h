@@ -0,0 +1,52 @@
+#ifndef LZ_LONG_H
+#define LZ_LONG_H
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Long-distance matcher: finds repeats of LDM_MIN_MATCH bytes or more up
+ * to 2^window_log bytes back, across block boundaries.
+ *
+ * A gear rolling hash runs over the whole frame. Positions where its top
+ * LDM_RATE_LOG bits are zero (about one in 64, picked by the content of
+ * the 64 bytes before them) go into a bucketed table, so the later copy
+ * of a repeat hits the same sampled points as the earlier one, however
+ * far apart they are. The table holds about one entry per sample in the
+ * window, and is sized down for frames smaller than that.
+ */
+
+#define LDM_MIN_MATCH   64
+#define LDM_RATE_LOG    6
+#define LDM_BUCKET_LOG  2   /* 4 entries per bucket, most recent first */
+
+typedef struct {
+    uint32_t pos;       /* in the block */
+    uint32_t len;
+    uint32_t dist;
+} ldm_match_t;
+
+typedef struct {
+    int          window_log;
+    int          hash_log;      /* buckets in use: 1 << hash_log */
+    uint64_t    *pos;           /* frame position of each entry's 64 bytes */
+    uint32_t    *check;         /* more hash bits, to skip most false hits */
+    size_t       cap;           /* allocated entries */
+    uint64_t     gear[256];
+    uint64_t     h;             /* rolling hash */
+    uint64_t     frame_pos;     /* bytes of the frame seen so far */
+    ldm_match_t *matches;       /* from the last ldm_find */
+    size_t       matches_cap;
+} ldm_t;
+
+/* Start a frame of frame_size bytes (an upper bound is fine) with the
+ * given window. Returns 0, or -1 if out of memory. */
+int  ldm_reset(ldm_t *l, int window_log, uint64_t frame_size);
+void ldm_free(ldm_t *l);
+
+/* Long matches in in[0..n), the next n bytes of the frame; in[-hist..0)
+ * is the frame's data before them that is still in memory. Fills
+ * l->matches in order, without overlaps, and sets *count.
+ * Returns 0, or -1 if out of memory. */
+int  ldm_find(ldm_t *l, const uint8_t *in, size_t n, size_t hist, size_t *count);
+
+#endif
@@ -8,7 +8,10 @@ typedef struct {
 	int32_t *prev;
 	size_t   n;
 	uint32_t hash_mask;
+	int      hash_shift;
 	int      max_chain_steps;
+	size_t   head_cap;   /* allocated entries, for lz_matcher_prepare */
+	size_t   prev_cap;
 } lz_matcher_t;
 
 #define HASH_BITS 15
@@ -16,6 +19,9 @@ typedef struct {
 
 int  lz_matcher_init(lz_matcher_t *m, size_t n_block, int hash_bits, int max_chain_steps);
 void lz_matcher_reset(lz_matcher_t *m, size_t n_block);
+/* Like init, but reuses (and grows) the tables of a previously prepared or
+ * zero-initialized matcher, so one matcher can serve many blocks. */
+int  lz_matcher_prepare(lz_matcher_t *m, size_t n_block, int hash_bits, int max_chain_steps);
 void lz_matcher_free(lz_matcher_t *m);
 
 /* NOTE: plain prototype (no static/inline) */
@@ -28,4 +34,11 @@ void lz_matcher_find_best(const lz_matcher_t *m, const uint8_t *in, size_t i, si
 void lz_matcher_find_best_next(const lz_matcher_t *m, const uint8_t *in, size_t i, size_t n,
 							   int window, int min_match, int max_match,
 							   int *out_len, int *out_dist);
+/* Longest match at i (at least min_match) at one of the distances
+ * reps[0..nreps); *out_idx is its index in reps. Checked before the hash
+ * chain: a match at a recent distance is cheap to code and to find. */
+void lz_matcher_find_rep(const uint8_t *in, size_t i, size_t n,
+						 const int *reps, int nreps, int window,
+						 int min_match, int max_match,
+						 int *out_len, int *out_idx);
 #endif
@@ -5,16 +5,74 @@
  * DEFLATE-compatible length and distance coding tables.
  *
  * Lengths 3-258 are encoded as symbols 257-285 plus extra bits.
- * Distances 1-32768 are encoded as symbols 0-29 plus extra bits.
+ * Distances 1-32768 are encoded as symbols 0-29 plus extra bits
+ * (more symbols in long-distance frames, below).
  */
 
 #include <stdint.h>
 
 #define LITLEN_SYMS   286   /* 0-255 literal, 256 end, 257-285 length */
 #define LITLEN_END    256
+#define LITLEN_FIXED  288   /* DEFLATE's fixed code also has 286 and 287 */
 #define DIST_SYMS     30
 #define CODELEN_SYMS  19
 
+/* Rep-match blocks: distance symbols 0-2 repeat the last, second and
+ * third most recent distances; 3+ are the distance codes below, shifted
+ * by REP_CODES. The rep list starts out as rep_init at every block. */
+#define REP_CODES      3
+#define DIST_SYMS_REP  (REP_CODES + DIST_SYMS)
+
+/* Long-distance frames continue the distance codes past 29 on the same
+ * pattern: code c has c/2 - 1 extra bits and starts at
+ * ((2 + (c & 1)) << (c/2 - 1)) + 1, so 2 * window_log codes reach
+ * 2^window_log (30 codes: 32 KB). Windows go up to 2^30. */
+#define DIST_CODES(window_log)  (2 * (window_log))
+#define DIST_SYMS_MAX  (REP_CODES + DIST_CODES(30))
+
+static const int rep_init[REP_CODES] = { 1, 4, 8 };
+
+/* Context-coded blocks have up to LIT_TABLES literal/length tables, one
+ * picked for each symbol through a map of its context: the top 6 bits of
+ * the byte before it (0 at the start of the block), and whether that byte
+ * ended a match. What follows a space or a newline is nothing like what
+ * follows a letter, and the byte after a match is one the match couldn't
+ * predict. */
+#define LIT_CTXS      128
+#define LIT_TABLES    4
+
+static inline int lit_ctx(int prev, int after_match) {
+    return prev >> 2 | after_match << 6;
+}
+
+/* Sequence blocks code each match's length code together with the run of
+ * literals before it: symbol run * 29 + code for runs below SEQ_RUNS - 1,
+ * (SEQ_RUNS - 1) * 29 + code for longer ones, whose run - (SEQ_RUNS - 1)
+ * follows as a run code. Symbol 256 ends the block; the literals left
+ * come last. Most runs are short, so most matches take one symbol. */
+#define SEQ_RUNS      8
+#define SEQ_SYMS      (SEQ_RUNS * 29)
+
+/* Run codes: runs 0-15 are symbols 0-15, longer ones one symbol per bit
+ * length, the bits below the top one extra (symbol 38 reaches 2^27 - 1,
+ * past the largest block). */
+#define RUN_SYMS      39
+
+static inline void run_to_code(uint32_t run, int *sym, int *ebits, uint32_t *eval) {
+    if (run < 16) { *sym = (int)run; *ebits = 0; *eval = 0; return; }
+    int b = 5;
+    while (run >> b) b++;
+    *sym = b + 11;
+    *ebits = b - 1;
+    *eval = run - (1u << (b - 1));
+}
+
+static inline uint32_t run_base(int sym, int *ebits) {
+    if (sym < 16) { *ebits = 0; return (uint32_t)sym; }
+    *ebits = sym - 12;
+    return 1u << (sym - 12);
+}
+
 /* ── Length codes (symbols 257-285) ────────────────────────── */
 
 static const int base_length[29] = {
@@ -59,8 +117,16 @@ static inline void len_to_code(int length, int *sym, int *ebits, int *eval) {
     }
 }
 
-/* Distance (1-32768) → symbol + extra bits */
+/* Distance (1-2^30) → symbol + extra bits */
 static inline void dist_to_code(int dist, int *sym, int *ebits, int *eval) {
+    if (dist > 32768) {
+        int e = 14;
+        while ((dist - 1) >> (e + 2)) e++;
+        *sym = 2 * e + 2 + (((dist - 1) >> e) & 1);
+        *ebits = e;
+        *eval = dist - ((2 + (*sym & 1)) << e) - 1;
+        return;
+    }
     for (int c = 29; c >= 0; c--) {
         if (dist >= base_dist[c]) {
             *sym = c;
@@ -71,4 +137,19 @@ static inline void dist_to_code(int dist, int *sym, int *ebits, int *eval) {
     }
 }
 
+/* Symbol c >= 30 of a long-distance frame → base distance + extra bits */
+static inline int long_dist_base(int c, int *ebits) {
+    *ebits = c / 2 - 1;
+    return ((2 + (c & 1)) << *ebits) + 1;
+}
+
+/* Move dist to the front of the rep list. If it wasn't there, the oldest
+ * entry drops out. Encoder and decoder both run this after every match. */
+static inline void rep_update(int *reps, int dist) {
+    if (dist == reps[0]) return;
+    if (dist != reps[1]) reps[2] = reps[1];
+    reps[1] = reps[0];
+    reps[0] = dist;
+}
+
 #endif
@@ -0,0 +1,830 @@
+#include "lzrc.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* ── Range coder ───────────────────────────────────────────── */
+
+typedef uint16_t prob_t;    /* P(bit = 0), in 1/2048 */
+
+#define PROB_BITS   11
+#define PROB_ONE    (1u << PROB_BITS)
+#define MOVE_BITS   5       /* adaptation rate: 1/32 of the way per bit */
+#define RC_TOP      (1u << 24)
+
+typedef struct {
+    uint64_t      low;
+    uint32_t      range;
+    uint8_t       cache;    /* last byte not yet written: a carry may change it */
+    uint64_t      cache_size;
+    bit_writer_t *out;
+    int           err;
+} rc_enc_t;
+
+static void rc_enc_init(rc_enc_t *rc, bit_writer_t *out) {
+    rc->low = 0;
+    rc->range = 0xFFFFFFFFu;
+    rc->cache = 0;
+    rc->cache_size = 1;
+    rc->out = out;
+    rc->err = 0;
+}
+
+static void rc_shift_low(rc_enc_t *rc) {
+    if ((uint32_t)rc->low < 0xFF000000u || (rc->low >> 32) != 0) {
+        uint8_t carry = (uint8_t)(rc->low >> 32);
+        uint8_t b = rc->cache;
+        do {
+            if (bw_write(rc->out, (uint8_t)(b + carry), 8) != 0) rc->err = 1;
+            b = 0xFF;
+        } while (--rc->cache_size != 0);
+        rc->cache = (uint8_t)(rc->low >> 24);
+    }
+    rc->cache_size++;
+    rc->low = (rc->low & 0x00FFFFFFu) << 8;
+}
+
+static inline void rc_bit(rc_enc_t *rc, prob_t *p, int bit) {
+    uint32_t bound = (rc->range >> PROB_BITS) * *p;
+    if (!bit) {
+        rc->range = bound;
+        *p = (prob_t)(*p + ((PROB_ONE - *p) >> MOVE_BITS));
+    } else {
+        rc->low += bound;
+        rc->range -= bound;
+        *p = (prob_t)(*p - (*p >> MOVE_BITS));
+    }
+    while (rc->range < RC_TOP) {
+        rc->range <<= 8;
+        rc_shift_low(rc);
+    }
+}
+
+/* nbits of v, top first, at probability 1/2 */
+static void rc_direct(rc_enc_t *rc, uint32_t v, int nbits) {
+    while (nbits-- > 0) {
+        rc->range >>= 1;
+        if ((v >> nbits) & 1) rc->low += rc->range;
+        while (rc->range < RC_TOP) {
+            rc->range <<= 8;
+            rc_shift_low(rc);
+        }
+    }
+}
+
+static void rc_flush(rc_enc_t *rc) {
+    for (int i = 0; i < 5; i++) rc_shift_low(rc);
+}
+
+/* nbits of sym through a binary tree of probs[1 << nbits], top bit first */
+static void rc_tree(rc_enc_t *rc, prob_t *probs, int nbits, uint32_t sym) {
+    uint32_t m = 1;
+    while (nbits-- > 0) {
+        int b = (sym >> nbits) & 1;
+        rc_bit(rc, probs + m, b);
+        m = m << 1 | (uint32_t)b;
+    }
+}
+
+/* The same, bottom bit first */
+static void rc_tree_rev(rc_enc_t *rc, prob_t *probs, int nbits, uint32_t sym) {
+    uint32_t m = 1;
+    while (nbits-- > 0) {
+        int b = sym & 1;
+        sym >>= 1;
+        rc_bit(rc, probs + m, b);
+        m = m << 1 | (uint32_t)b;
+    }
+}
+
+typedef struct {
+    const uint8_t *buf;
+    size_t         len, pos;
+    uint32_t       range, code;
+    int            bad;     /* ran past the end */
+} rc_dec_t;
+
+static inline uint8_t rc_next(rc_dec_t *rc) {
+    if (rc->pos < rc->len) return rc->buf[rc->pos++];
+    rc->bad = 1;
+    return 0;
+}
+
+static int rc_dec_init(rc_dec_t *rc, const uint8_t *buf, size_t len) {
+    rc->buf = buf;
+    rc->len = len;
+    rc->pos = 0;
+    rc->range = 0xFFFFFFFFu;
+    rc->code = 0;
+    rc->bad = 0;
+    if (len < 5 || buf[0] != 0) return -1;   /* the encoder's first byte is 0 */
+    for (int i = 0; i < 5; i++) rc->code = rc->code << 8 | rc_next(rc);
+    return 0;
+}
+
+static inline int rc_dbit(rc_dec_t *rc, prob_t *p) {
+    uint32_t bound = (rc->range >> PROB_BITS) * *p;
+    int bit;
+    if (rc->code < bound) {
+        rc->range = bound;
+        *p = (prob_t)(*p + ((PROB_ONE - *p) >> MOVE_BITS));
+        bit = 0;
+    } else {
+        rc->code -= bound;
+        rc->range -= bound;
+        *p = (prob_t)(*p - (*p >> MOVE_BITS));
+        bit = 1;
+    }
+    if (rc->range < RC_TOP) {
+        rc->range <<= 8;
+        rc->code = rc->code << 8 | rc_next(rc);
+    }
+    return bit;
+}
+
+static uint32_t rc_ddirect(rc_dec_t *rc, int nbits) {
+    uint32_t v = 0;
+    while (nbits-- > 0) {
+        rc->range >>= 1;
+        uint32_t b = rc->code >= rc->range;
+        if (b) rc->code -= rc->range;
+        v = v << 1 | b;
+        if (rc->range < RC_TOP) {
+            rc->range <<= 8;
+            rc->code = rc->code << 8 | rc_next(rc);
+        }
+    }
+    return v;
+}
+
+static uint32_t rc_dtree(rc_dec_t *rc, prob_t *probs, int nbits) {
+    uint32_t m = 1;
+    for (int i = 0; i < nbits; i++) m = m << 1 | (uint32_t)rc_dbit(rc, probs + m);
+    return m - (1u << nbits);
+}
+
+static uint32_t rc_dtree_rev(rc_dec_t *rc, prob_t *probs, int nbits) {
+    uint32_t m = 1, sym = 0;
+    for (int i = 0; i < nbits; i++) {
+        uint32_t b = (uint32_t)rc_dbit(rc, probs + m);
+        m = m << 1 | b;
+        sym |= b << i;
+    }
+    return sym;
+}
+
+/* ── Model ─────────────────────────────────────────────────── */
+
+#define STATES        12    /* literal / match / rep history */
+#define LIT_STATES    7     /* states below this: the last token was a literal */
+#define POS_STATES    4     /* position & 3 */
+#define LIT_CTX_SHIFT 5     /* literal context: the previous byte's top 3 bits */
+#define LEN_STATES    4     /* distance context: min(len - 2, 3) */
+#define SLOT_BITS     6
+#define MODEL_SLOTS   14    /* slots 4..13 code their low bits with probs */
+#define FULL_DISTS    128   /* below slot MODEL_SLOTS */
+#define ALIGN_BITS    4     /* larger ones: direct bits, then 4 with probs */
+#define NREPS         4
+
+typedef struct {
+    prob_t choice, choice2;
+    prob_t low[POS_STATES][8];      /* len 2..9 */
+    prob_t mid[POS_STATES][8];      /* 10..17 */
+    prob_t high[256];               /* 18..273 */
+} len_model_t;
+
+typedef struct {
+    prob_t is_match[STATES][POS_STATES];
+    prob_t is_rep[STATES];
+    prob_t is_rep0[STATES];
+    prob_t is_rep1[STATES];
+    prob_t is_rep2[STATES];
+    prob_t is_rep0_long[STATES][POS_STATES];
+    prob_t lit[1 << (8 - LIT_CTX_SHIFT)][0x300];
+    prob_t slot[LEN_STATES][1 << SLOT_BITS];
+    prob_t special[FULL_DISTS - MODEL_SLOTS];
+    prob_t align[1 << ALIGN_BITS];
+    len_model_t len, rep_len;
+} model_t;
+
+static void model_init(model_t *md) {
+    prob_t *p = (prob_t *)md;
+    for (size_t i = 0; i < sizeof *md / sizeof *p; i++) p[i] = PROB_ONE / 2;
+}
+
+static inline int st_lit(int s)   { return s < 4 ? 0 : s < 10 ? s - 3 : s - 6; }
+static inline int st_match(int s) { return s < LIT_STATES ? 7 : 10; }
+static inline int st_rep(int s)   { return s < LIT_STATES ? 8 : 11; }
+static inline int st_short(int s) { return s < LIT_STATES ? 9 : 11; }
+
+static int highbit(uint32_t x) {
+    int b = 0;
+    while (x >>= 1) b++;
+    return b;
+}
+
+/* Slot of distance - 1: its bit length and the bit below the top */
+static inline uint32_t dist_slot(uint32_t d0) {
+    if (d0 < 4) return d0;
+    int hb = highbit(d0);
+    return (uint32_t)hb * 2 + ((d0 >> (hb - 1)) & 1);
+}
+
+static inline int len_state(uint32_t len) {
+    return len - LZRC_MIN_LEN < LEN_STATES - 1 ? (int)(len - LZRC_MIN_LEN) : LEN_STATES - 1;
+}
+
+static inline void rep_to_front(uint32_t *reps, int k) {
+    uint32_t d = reps[k];
+    for (; k > 0; k--) reps[k] = reps[k - 1];
+    reps[0] = d;
+}
+
+/* ── Encoder ───────────────────────────────────────────────── */
+
+#define OPT_NUM     4096    /* positions per parse */
+#define NICE_LEN    128     /* a match this long is taken without looking on */
+#define MAX_CANDS   32
+#define BT_CUT      48      /* tree nodes visited per position */
+#define BT_MAX_HASH 20
+#define REFRESH     32      /* matches between price table updates */
+
+enum { K_LIT, K_SHORT, K_REP0, K_MATCH = K_REP0 + NREPS };
+
+/* Parse node: the cheapest way found to reach a position */
+typedef struct {
+    uint32_t price;         /* in 1/16 bits */
+    uint32_t from;          /* node the last step starts at */
+    uint32_t dist;          /* K_MATCH */
+    uint16_t len;
+    uint8_t  kind;
+    uint8_t  state;         /* after the step, once the node is reached */
+    uint32_t reps[NREPS];
+} opt_t;
+
+struct lzrc_enc {
+    model_t  md;
+    uint32_t bit_price[PROB_ONE >> 4];  /* -log2(p) of a probability >> 4 */
+    uint32_t len_price[2][POS_STATES][LZRC_MAX_LEN + 1];   /* match, rep */
+    uint32_t slot_price[LEN_STATES][1 << SLOT_BITS];
+    uint32_t dist_price[LEN_STATES][FULL_DISTS];
+    uint32_t align_price[1 << ALIGN_BITS];
+    opt_t    opt[OPT_NUM + LZRC_MAX_LEN + 1];
+    uint32_t path[OPT_NUM + LZRC_MAX_LEN + 1];
+    int32_t *head;          /* match finder: newest position of each hash */
+    int32_t *son;           /* and its two subtrees, per position */
+    size_t   head_cap, son_cap;
+    int      hash_shift;
+};
+
+/* log2(x) for x >= 1, in 1/256 bits */
+static uint32_t log2_q8(uint32_t x) {
+    int hb = highbit(x);
+    uint64_t m = ((uint64_t)x << 16) >> hb;
+    uint32_t frac = 0;
+    for (int i = 7; i >= 0; i--) {
+        m = (m * m) >> 16;
+        if (m >= (2u << 16)) {
+            m >>= 1;
+            frac |= 1u << i;
+        }
+    }
+    return (uint32_t)hb << 8 | frac;
+}
+
+lzrc_enc_t *lzrc_enc_new(void) {
+    lzrc_enc_t *e = malloc(sizeof *e);
+    if (!e) return NULL;
+    e->head = e->son = NULL;
+    e->head_cap = e->son_cap = 0;
+    for (uint32_t i = 0; i < (PROB_ONE >> 4); i++)
+        e->bit_price[i] = ((PROB_BITS << 8) - log2_q8((i << 4) + 8) + 8) >> 4;
+    return e;
+}
+
+void lzrc_enc_free(lzrc_enc_t *e) {
+    if (!e) return;
+    free(e->head);
+    free(e->son);
+    free(e);
+}
+
+static inline uint32_t price_bit(const lzrc_enc_t *e, prob_t p, int bit) {
+    return e->bit_price[(bit ? PROB_ONE - p : p) >> 4];
+}
+
+static uint32_t price_tree(const lzrc_enc_t *e, const prob_t *probs, int nbits, uint32_t sym) {
+    uint32_t price = 0, m = 1;
+    while (nbits-- > 0) {
+        int b = (sym >> nbits) & 1;
+        price += price_bit(e, probs[m], b);
+        m = m << 1 | (uint32_t)b;
+    }
+    return price;
+}
+
+static uint32_t price_tree_rev(const lzrc_enc_t *e, const prob_t *probs, int nbits, uint32_t sym) {
+    uint32_t price = 0, m = 1;
+    while (nbits-- > 0) {
+        int b = sym & 1;
+        sym >>= 1;
+        price += price_bit(e, probs[m], b);
+        m = m << 1 | (uint32_t)b;
+    }
+    return price;
+}
+
+/* A literal after a match is coded against the byte the match would
+ * have continued with, mb: while their bits agree, with probabilities
+ * of their own */
+static uint32_t price_lit(const lzrc_enc_t *e, const prob_t *probs, int matched,
+                          uint32_t mb, uint32_t byte) {
+    uint32_t price = 0, sym = 1, offs = matched ? 0x100 : 0;
+    for (int i = 7; i >= 0; i--) {
+        int b = (byte >> i) & 1;
+        mb <<= 1;
+        uint32_t mbit = mb & offs;
+        price += price_bit(e, probs[offs + mbit + sym], b);
+        sym = sym << 1 | (uint32_t)b;
+        offs &= b ? mbit : ~mbit;
+    }
+    return price;
+}
+
+static void enc_lit(rc_enc_t *rc, prob_t *probs, int matched, uint32_t mb, uint32_t byte) {
+    uint32_t sym = 1, offs = matched ? 0x100 : 0;
+    for (int i = 7; i >= 0; i--) {
+        int b = (byte >> i) & 1;
+        mb <<= 1;
+        uint32_t mbit = mb & offs;
+        rc_bit(rc, probs + offs + mbit + sym, b);
+        sym = sym << 1 | (uint32_t)b;
+        offs &= b ? mbit : ~mbit;
+    }
+}
+
+static void enc_len(rc_enc_t *rc, len_model_t *lm, uint32_t len, int ps) {
+    uint32_t l = len - LZRC_MIN_LEN;
+    if (l < 8) {
+        rc_bit(rc, &lm->choice, 0);
+        rc_tree(rc, lm->low[ps], 3, l);
+    } else if (l < 16) {
+        rc_bit(rc, &lm->choice, 1);
+        rc_bit(rc, &lm->choice2, 0);
+        rc_tree(rc, lm->mid[ps], 3, l - 8);
+    } else {
+        rc_bit(rc, &lm->choice, 1);
+        rc_bit(rc, &lm->choice2, 1);
+        rc_tree(rc, lm->high, 8, l - 16);
+    }
+}
+
+static void enc_dist(rc_enc_t *rc, model_t *md, uint32_t dist, uint32_t len) {
+    uint32_t d0 = dist - 1, slot = dist_slot(d0);
+    rc_tree(rc, md->slot[len_state(len)], SLOT_BITS, slot);
+    if (slot < 4) return;
+    int footer = (int)(slot >> 1) - 1;
+    uint32_t base = (2 | (slot & 1)) << footer, rem = d0 - base;
+    if (slot < MODEL_SLOTS) {
+        rc_tree_rev(rc, md->special + base - slot - 1, footer, rem);
+    } else {
+        rc_direct(rc, rem >> ALIGN_BITS, footer - ALIGN_BITS);
+        rc_tree_rev(rc, md->align, ALIGN_BITS, rem & ((1u << ALIGN_BITS) - 1));
+    }
+}
+
+/* Length and distance price tables, from the model as it is now */
+static void refresh_prices(lzrc_enc_t *e) {
+    const model_t *md = &e->md;
+    for (int r = 0; r < 2; r++) {
+        const len_model_t *lm = r ? &md->rep_len : &md->len;
+        uint32_t c0 = price_bit(e, lm->choice, 0), c1 = price_bit(e, lm->choice, 1);
+        uint32_t c10 = c1 + price_bit(e, lm->choice2, 0), c11 = c1 + price_bit(e, lm->choice2, 1);
+        for (int ps = 0; ps < POS_STATES; ps++) {
+            uint32_t *lp = e->len_price[r][ps];
+            for (uint32_t l = 0; l + LZRC_MIN_LEN <= LZRC_MAX_LEN; l++) {
+                lp[l + LZRC_MIN_LEN] =
+                    l < 8  ? c0 + price_tree(e, lm->low[ps], 3, l) :
+                    l < 16 ? c10 + price_tree(e, lm->mid[ps], 3, l - 8) :
+                             c11 + price_tree(e, lm->high, 8, l - 16);
+            }
+        }
+    }
+    for (int ls = 0; ls < LEN_STATES; ls++) {
+        for (uint32_t slot = 0; slot < (1u << SLOT_BITS); slot++) {
+            uint32_t p = price_tree(e, md->slot[ls], SLOT_BITS, slot);
+            if (slot >= MODEL_SLOTS) p += ((slot >> 1) - 1 - ALIGN_BITS) << 4;
+            e->slot_price[ls][slot] = p;
+        }
+        for (uint32_t d0 = 0; d0 < FULL_DISTS; d0++) {
+            uint32_t slot = dist_slot(d0), p = e->slot_price[ls][slot];
+            if (slot >= 4) {
+                int footer = (int)(slot >> 1) - 1;
+                uint32_t base = (2 | (slot & 1)) << footer;
+                p += price_tree_rev(e, md->special + base - slot - 1, footer, d0 - base);
+            }
+            e->dist_price[ls][d0] = p;
+        }
+    }
+    for (uint32_t a = 0; a < (1u << ALIGN_BITS); a++)
+        e->align_price[a] = price_tree_rev(e, md->align, ALIGN_BITS, a);
+}
+
+static inline uint32_t price_dist(const lzrc_enc_t *e, uint32_t dist, uint32_t len) {
+    uint32_t d0 = dist - 1;
+    int ls = len_state(len);
+    if (d0 < FULL_DISTS) return e->dist_price[ls][d0];
+    return e->slot_price[ls][dist_slot(d0)] + e->align_price[d0 & ((1u << ALIGN_BITS) - 1)];
+}
+
+/* Bits choosing rep k, after is_match and is_rep */
+static uint32_t price_rep(const lzrc_enc_t *e, int k, int s, int ps) {
+    const model_t *md = &e->md;
+    if (k == 0)
+        return price_bit(e, md->is_rep0[s], 0) + price_bit(e, md->is_rep0_long[s][ps], 1);
+    uint32_t p = price_bit(e, md->is_rep0[s], 1);
+    if (k == 1) return p + price_bit(e, md->is_rep1[s], 0);
+    return p + price_bit(e, md->is_rep1[s], 1) + price_bit(e, md->is_rep2[s], k == 3);
+}
+
+/* State and reps after a step of the given kind */
+static void apply_step(int kind, uint32_t dist, int *s, uint32_t *reps) {
+    if (kind == K_LIT) {
+        *s = st_lit(*s);
+    } else if (kind == K_SHORT) {
+        *s = st_short(*s);
+    } else if (kind == K_MATCH) {
+        memmove(reps + 1, reps, (NREPS - 1) * sizeof *reps);
+        reps[0] = dist;
+        *s = st_match(*s);
+    } else {
+        rep_to_front(reps, kind - K_REP0);
+        *s = st_rep(*s);
+    }
+}
+
+static void encode_step(lzrc_enc_t *e, rc_enc_t *rc, const uint8_t *in, size_t p,
+                        int kind, uint32_t len, uint32_t dist, int *s, uint32_t *reps) {
+    model_t *md = &e->md;
+    int ps = (int)(p & (POS_STATES - 1));
+    if (kind == K_LIT) {
+        rc_bit(rc, &md->is_match[*s][ps], 0);
+        prob_t *probs = md->lit[(p ? in[p - 1] : 0) >> LIT_CTX_SHIFT];
+        uint32_t mb = reps[0] <= p ? in[p - reps[0]] : 0;
+        enc_lit(rc, probs, *s >= LIT_STATES, mb, in[p]);
+    } else {
+        rc_bit(rc, &md->is_match[*s][ps], 1);
+        rc_bit(rc, &md->is_rep[*s], kind != K_MATCH);
+        if (kind == K_MATCH) {
+            enc_len(rc, &md->len, len, ps);
+            enc_dist(rc, md, dist, len);
+        } else if (kind == K_SHORT || kind == K_REP0) {
+            rc_bit(rc, &md->is_rep0[*s], 0);
+            rc_bit(rc, &md->is_rep0_long[*s][ps], kind == K_REP0);
+        } else {
+            int k = kind - K_REP0;
+            rc_bit(rc, &md->is_rep0[*s], 1);
+            rc_bit(rc, &md->is_rep1[*s], k > 1);
+            if (k > 1) rc_bit(rc, &md->is_rep2[*s], k > 2);
+        }
+        if (kind != K_MATCH && kind != K_SHORT) enc_len(rc, &md->rep_len, len, ps);
+    }
+    apply_step(kind, dist, s, reps);
+}
+
+/* Longest common prefix of a and b, up to max */
+static uint32_t common_len(const uint8_t *a, const uint8_t *b, uint32_t max) {
+    uint32_t l = 0;
+    while (l < max && a[l] == b[l]) l++;
+    return l;
+}
+
+static inline void relax(opt_t *opt, size_t *last, size_t to, uint32_t price,
+                         size_t from, int kind, uint32_t len, uint32_t dist) {
+    while (*last < to) opt[++*last].price = UINT32_MAX;
+    if (price >= opt[to].price) return;
+    opt[to].price = price;
+    opt[to].from = (uint32_t)from;
+    opt[to].kind = (uint8_t)kind;
+    opt[to].len = (uint16_t)len;
+    opt[to].dist = dist;
+}
+
+/* ── Match finder ──────────────────────────────────────────── */
+
+/* A binary tree per 3-byte hash of the block's positions, newest at the
+ * root, ordered by the bytes that follow them. Going down it from the
+ * root meets matches in order of distance, each new one only if longer,
+ * so a few dozen nodes find what a hash chain walks thousands for. */
+
+static int bt_prepare(lzrc_enc_t *e, size_t n) {
+    int bits = 8;
+    while (bits < BT_MAX_HASH && ((size_t)1 << bits) < n) bits++;
+    size_t hsize = (size_t)1 << bits;
+    if (hsize > e->head_cap) {
+        free(e->head);
+        e->head = malloc(hsize * sizeof *e->head);
+        e->head_cap = e->head ? hsize : 0;
+        if (!e->head) return -1;
+    }
+    if (2 * n > e->son_cap) {
+        free(e->son);
+        e->son = malloc(2 * n * sizeof *e->son);
+        e->son_cap = e->son ? 2 * n : 0;
+        if (!e->son) return -1;
+    }
+    e->hash_shift = 32 - bits;
+    memset(e->head, 0xFF, hsize * sizeof *e->head);
+    return 0;
+}
+
+/* Insert position p of in[0..n) into its tree, and (len not NULL) list
+ * the matches met on the way, longest last. Returns how many. */
+static int bt_find(lzrc_enc_t *e, const uint8_t *in, size_t p, size_t n,
+                   int *len, int *dist) {
+    uint32_t limit = n - p < LZRC_MAX_LEN ? (uint32_t)(n - p) : LZRC_MAX_LEN;
+    if (limit < 3) return 0;
+    uint32_t k = ((uint32_t)in[p] << 16) ^ ((uint32_t)in[p + 1] << 8) ^ in[p + 2];
+    uint32_t h = (k * 2654435761u) >> e->hash_shift;
+    int32_t cur = e->head[h];
+    e->head[h] = (int32_t)p;
+
+    /* Nodes below p (ptr1) and above it (ptr0) still to be linked */
+    int32_t *ptr0 = &e->son[2 * p + 1], *ptr1 = &e->son[2 * p];
+    uint32_t len0 = 0, len1 = 0, best = 2;
+    int count = 0;
+    for (int cut = BT_CUT; cur >= 0 && cut > 0; cut--) {
+        const uint8_t *pb = in + cur;
+        int32_t *pair = &e->son[2 * (size_t)cur];
+        uint32_t l = len0 < len1 ? len0 : len1;
+        if (pb[l] == in[p + l]) {
+            while (++l < limit && pb[l] == in[p + l]) {}
+            if (l > best) {
+                best = l;
+                if (len) {
+                    if (count == MAX_CANDS) count--;
+                    len[count] = (int)l;
+                    dist[count] = (int)(p - (size_t)cur);
+                    count++;
+                }
+                if (l == limit) {
+                    /* p takes cur's place */
+                    *ptr1 = pair[0];
+                    *ptr0 = pair[1];
+                    return count;
+                }
+            }
+        }
+        if (pb[l] < in[p + l]) {
+            *ptr1 = cur;
+            ptr1 = pair + 1;
+            cur = *ptr1;
+            len1 = l;
+        } else {
+            *ptr0 = cur;
+            ptr0 = pair;
+            cur = *ptr0;
+            len0 = l;
+        }
+    }
+    *ptr0 = *ptr1 = -1;
+    return count;
+}
+
+/* Cheapest path from in[i] on, within in[i..lim), through up to OPT_NUM
+ * positions. Puts its steps' end nodes in e->path[] and returns how many;
+ * *end gets the positions covered. Positions below *ins are in the
+ * trees; this inserts those it reaches. The trees always run to the
+ * block end n: a limit that shrank partway through (the next long match)
+ * would break their order, so tree matches are cut to lim here instead. */
+static size_t parse(lzrc_enc_t *e, const uint8_t *in, size_t i, size_t lim,
+                    size_t n, size_t hist, size_t *ins, int state,
+                    const uint32_t *reps, size_t *end) {
+    const model_t *md = &e->md;
+    opt_t *opt = e->opt;
+    size_t last = 0, stop = 0;
+    int cand_len[MAX_CANDS], cand_dist[MAX_CANDS];
+
+    opt[0].price = 0;
+    opt[0].state = (uint8_t)state;
+    memcpy(opt[0].reps, reps, sizeof opt[0].reps);
+
+    for (size_t cur = 0; cur == 0 || (cur < last && cur < OPT_NUM); cur++) {
+        opt_t *o = &opt[cur];
+        if (o->price == UINT32_MAX) continue;
+        if (cur > 0) {
+            int s = opt[o->from].state;
+            memcpy(o->reps, opt[o->from].reps, sizeof o->reps);
+            apply_step(o->kind, o->dist, &s, o->reps);
+            o->state = (uint8_t)s;
+        }
+        const int s = o->state;
+        const uint32_t *r = o->reps;
+        const size_t p = i + cur;
+        const int ps = (int)(p & (POS_STATES - 1));
+        const uint32_t maxl = lim - p < LZRC_MAX_LEN ? (uint32_t)(lim - p) : LZRC_MAX_LEN;
+        const uint32_t base = o->price;
+        const uint32_t match1 = base + price_bit(e, md->is_match[s][ps], 1);
+        uint32_t longest = 0;
+
+        /* Literal, or the byte at rep0 */
+        uint32_t mb = r[0] <= p ? in[p - r[0]] : 0;
+        uint32_t lit = base + price_bit(e, md->is_match[s][ps], 0) +
+                       price_lit(e, md->lit[(p ? in[p - 1] : 0) >> LIT_CTX_SHIFT],
+                                 s >= LIT_STATES, mb, in[p]);
+        relax(opt, &last, cur + 1, lit, cur, K_LIT, 1, 0);
+        if (r[0] <= p + hist && in[p] == in[(ptrdiff_t)p - (ptrdiff_t)r[0]]) {
+            uint32_t price = match1 + price_bit(e, md->is_rep[s], 1) +
+                             price_bit(e, md->is_rep0[s], 0) +
+                             price_bit(e, md->is_rep0_long[s][ps], 0);
+            relax(opt, &last, cur + 1, price, cur, K_SHORT, 1, 0);
+        }
+
+        /* Rep matches */
+        for (int k = 0; k < NREPS && maxl >= LZRC_MIN_LEN; k++) {
+            if (r[k] > p + hist) continue;
+            int dup = 0;
+            for (int j = 0; j < k; j++) dup |= r[j] == r[k];
+            if (dup) continue;
+            uint32_t len = common_len(in + p - r[k], in + p, maxl);
+            if (len < LZRC_MIN_LEN) continue;
+            uint32_t pre = match1 + price_bit(e, md->is_rep[s], 1) + price_rep(e, k, s, ps);
+            for (uint32_t l = LZRC_MIN_LEN; l <= len; l++)
+                relax(opt, &last, cur + l, pre + e->len_price[1][ps][l], cur, K_REP0 + k, l, 0);
+            if (len > longest) longest = len;
+        }
+
+        /* Matches from the tree, each length at its nearest distance */
+        while (*ins < p) bt_find(e, in, (*ins)++, n, NULL, NULL);
+        int nc = bt_find(e, in, p, n, cand_len, cand_dist);
+        (*ins)++;
+        for (int c = 0; c < nc; c++)
+            if ((uint32_t)cand_len[c] > maxl) cand_len[c] = (int)maxl;
+        uint32_t pre = match1 + price_bit(e, md->is_rep[s], 0);
+        uint32_t l = 3;
+        for (int c = 0; c < nc; c++) {
+            for (; l <= (uint32_t)cand_len[c]; l++) {
+                uint32_t dist = (uint32_t)cand_dist[c];
+                relax(opt, &last, cur + l,
+                      pre + e->len_price[0][ps][l] + price_dist(e, dist, l),
+                      cur, K_MATCH, l, dist);
+            }
+        }
+        if (nc && (uint32_t)cand_len[nc - 1] > longest) longest = (uint32_t)cand_len[nc - 1];
+
+        /* Long enough: take it and start over after it */
+        if (longest >= NICE_LEN) {
+            stop = cur + longest;
+            break;
+        }
+    }
+    if (!stop) stop = last;
+
+    size_t count = 0;
+    for (size_t j = stop; j > 0; j = opt[j].from) e->path[count++] = (uint32_t)j;
+    for (size_t a = 0, b = count - 1; a < b; a++, b--) {
+        uint32_t t = e->path[a];
+        e->path[a] = e->path[b];
+        e->path[b] = t;
+    }
+    *end = stop;
+    return count;
+}
+
+int lzrc_compress(lzrc_enc_t *e, const uint8_t *in, size_t n, size_t hist,
+                  const ldm_match_t *lm, size_t nlong, bit_writer_t *out) {
+    bw_reset(out);
+    if (bt_prepare(e, n) != 0) return -1;
+    model_init(&e->md);
+    rc_enc_t rc;
+    rc_enc_init(&rc, out);
+
+    int state = 0;
+    uint32_t reps[NREPS] = { 1, 1, 1, 1 };
+    size_t ins = 0;     /* positions below are in the trees */
+    size_t i = 0, k = 0;
+    uint32_t matches = REFRESH;    /* literals leave the tables as they are */
+    while (i < n) {
+        size_t lim = k < nlong ? lm[k].pos : n;
+        if (i == lim) {
+            /* Long match: the first piece at its distance, the rest rep0 */
+            uint32_t left = lm[k].len, dist = lm[k].dist;
+            while (left > 0) {
+                uint32_t len = left < LZRC_MAX_LEN ? left : LZRC_MAX_LEN;
+                if (left - len > 0 && left - len < LZRC_MIN_LEN) len = left - LZRC_MIN_LEN;
+                int kind = K_MATCH;
+                for (int j = NREPS - 1; j >= 0; j--)
+                    if (reps[j] == dist) kind = K_REP0 + j;
+                encode_step(e, &rc, in, i, kind, len, dist, &state, reps);
+                i += len;
+                left -= len;
+                matches++;
+            }
+            k++;
+            continue;
+        }
+
+        if (matches >= REFRESH) {
+            refresh_prices(e);
+            matches = 0;
+        }
+        size_t end;
+        size_t count = parse(e, in, i, lim, n, hist, &ins, state, reps, &end);
+        for (size_t j = 0; j < count; j++) {
+            const opt_t *o = &e->opt[e->path[j]];
+            encode_step(e, &rc, in, i + o->from, o->kind, o->len, o->dist, &state, reps);
+            matches += o->kind >= K_REP0;
+        }
+        i += end;
+    }
+    rc_flush(&rc);
+    return rc.err ? -1 : 0;
+}
+
+/* ── Decoder ───────────────────────────────────────────────── */
+
+static uint32_t dec_len(rc_dec_t *rc, len_model_t *lm, int ps) {
+    if (!rc_dbit(rc, &lm->choice)) return LZRC_MIN_LEN + rc_dtree(rc, lm->low[ps], 3);
+    if (!rc_dbit(rc, &lm->choice2)) return LZRC_MIN_LEN + 8 + rc_dtree(rc, lm->mid[ps], 3);
+    return LZRC_MIN_LEN + 16 + rc_dtree(rc, lm->high, 8);
+}
+
+int lzrc_decompress(const uint8_t *comp, size_t comp_size,
+                    uint8_t *out, size_t start, size_t end) {
+    model_t md;
+    rc_dec_t rc;
+    model_init(&md);
+    if (rc_dec_init(&rc, comp, comp_size) != 0) return -1;
+
+    int s = 0;
+    uint32_t reps[NREPS] = { 1, 1, 1, 1 };
+    size_t op = start;
+    while (op < end) {
+        size_t p = op - start;
+        int ps = (int)(p & (POS_STATES - 1));
+        if (!rc_dbit(&rc, &md.is_match[s][ps])) {
+            prob_t *probs = md.lit[(p ? out[op - 1] : 0) >> LIT_CTX_SHIFT];
+            uint32_t mb = reps[0] <= p ? out[op - reps[0]] : 0;
+            uint32_t sym = 1, offs = s >= LIT_STATES ? 0x100 : 0;
+            while (sym < 0x100) {
+                mb <<= 1;
+                uint32_t mbit = mb & offs;
+                uint32_t b = (uint32_t)rc_dbit(&rc, probs + offs + mbit + sym);
+                sym = sym << 1 | b;
+                offs &= b ? mbit : ~mbit;
+            }
+            out[op++] = (uint8_t)sym;
+            s = st_lit(s);
+            continue;
+        }
+
+        uint32_t len;
+        if (!rc_dbit(&rc, &md.is_rep[s])) {
+            len = dec_len(&rc, &md.len, ps);
+            uint32_t slot = rc_dtree(&rc, md.slot[len_state(len)], SLOT_BITS);
+            uint64_t d0 = slot;
+            if (slot >= 4) {
+                int footer = (int)(slot >> 1) - 1;
+                uint32_t base = (2 | (slot & 1)) << footer;
+                if (slot < MODEL_SLOTS) {
+                    d0 = base + rc_dtree_rev(&rc, md.special + base - slot - 1, footer);
+                } else {
+                    d0 = base + ((uint64_t)rc_ddirect(&rc, footer - ALIGN_BITS) << ALIGN_BITS);
+                    d0 += rc_dtree_rev(&rc, md.align, ALIGN_BITS);
+                }
+            }
+            if (d0 >= op) return -1;
+            memmove(reps + 1, reps, (NREPS - 1) * sizeof *reps);
+            reps[0] = (uint32_t)d0 + 1;
+            s = st_match(s);
+        } else if (!rc_dbit(&rc, &md.is_rep0[s])) {
+            if (!rc_dbit(&rc, &md.is_rep0_long[s][ps])) {
+                /* Short rep: one byte at rep0 */
+                if (reps[0] > op) return -1;
+                out[op] = out[op - reps[0]];
+                op++;
+                s = st_short(s);
+                continue;
+            }
+            len = dec_len(&rc, &md.rep_len, ps);
+            s = st_rep(s);
+        } else {
+            int k = !rc_dbit(&rc, &md.is_rep1[s]) ? 1 : !rc_dbit(&rc, &md.is_rep2[s]) ? 2 : 3;
+            rep_to_front(reps, k);
+            len = dec_len(&rc, &md.rep_len, ps);
+            s = st_rep(s);
+        }
+
+        /* Copy, a byte at a time where it overlaps itself */
+        size_t dist = reps[0];
+        if (dist > op || len > end - op) return -1;
+        const uint8_t *src = out + op - dist;
+        uint8_t *dst = out + op;
+        if (dist >= len) {
+            memcpy(dst, src, len);
+        } else {
+            for (uint32_t j = 0; j < len; j++) dst[j] = src[j];
+        }
+        op += len;
+    }
+    return rc.bad ? -1 : 0;
+}
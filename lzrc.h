@@ -0,0 +1,47 @@
+#ifndef LZRC_H
+#define LZRC_H
+#include <stdint.h>
+#include <stddef.h>
+#include "bitstream.h"
+#include "lz_long.h"
+
+/*
+ * Archival block codec: LZ77 with an optimal parse, coded with an
+ * adaptive binary range coder, along the lines of LZMA.
+ *
+ * Every decision is one bit with its own probability, adapted as the
+ * block goes, in the context of what came before: a 12-state history of
+ * literal / match / rep-match tokens, the position's low 2 bits, the
+ * previous byte's top 3 bits for literals, and after a match, the byte
+ * the match would have continued with (a literal there is likely to
+ * differ from it). Matches reach anywhere in the block, plus four rep
+ * distances and a one-byte rep0 "short rep".
+ *
+ * The parser prices every literal and match choice with the model's
+ * current probabilities and takes the cheapest path through up to 4 KB
+ * at a time. Several times slower to compress and to decode than the
+ * Huffman blocks; for data that is written once and rarely read.
+ */
+
+#define LZRC_MIN_LEN  2
+#define LZRC_MAX_LEN  273
+
+typedef struct lzrc_enc lzrc_enc_t;
+
+lzrc_enc_t *lzrc_enc_new(void);
+void        lzrc_enc_free(lzrc_enc_t *e);
+
+/* Compress in[0..n) into out (reset first). Rep matches may reach hist
+ * bytes before in[0]; lm[0..nlong) are long matches to take as they are
+ * (from ldm_find). The match finder's tables grow to the largest block,
+ * 8 bytes per byte of it. Returns 0, or -1 if out of memory. */
+int lzrc_compress(lzrc_enc_t *e, const uint8_t *in, size_t n, size_t hist,
+                  const ldm_match_t *lm, size_t nlong, bit_writer_t *out);
+
+/* Decode comp[0..comp_size) into out[start..end); out[0..start) is
+ * earlier output matches may reach into.
+ * Returns 0, or -1 on corrupt data. */
+int lzrc_decompress(const uint8_t *comp, size_t comp_size,
+                    uint8_t *out, size_t start, size_t end);
+
+#endif
@@ -1,11 +1,31 @@
 /*
  * odz — a DEFLATE-class compressor
  *
- * Format v2: "ODZ\x02" | original_size(u64 LE) | blocks...
+ * Format v3: "ODZ\x03" | flags(u8) | block_log(u8) | original_size(u64 LE) | blocks...
  * Each block: flags(u8) | raw_size(u32 LE) | [compressed_size(u32 LE)] | data
+ * A stream is a run of such frames (plus skippable "ODS" metadata frames),
+ * so `cat a.odz b.odz > ab.odz` decompresses to a followed by b.
  *
  * Compression pipeline: LZ77 hash-chain → Huffman → bitstream
- * Processes input in 1 MB blocks for bounded memory usage.
+ * Processes input in blocks (1 MB by default, 64 KB .. 64 MB) for bounded
+ * memory usage. v2 streams (fixed 1 MB blocks) still decompress.
+ *
+ * The same blocks can be written as gzip, zlib or raw DEFLATE (-F), and
+ * gzip / zlib input is detected and decompressed too.
+ *
+ * With -k, odz blocks are sealed with AES-256-GCM under a 32-byte key.
+ * --rsyncable cuts blocks at content-defined points (a rolling hash), so
+ * an edit only changes the compressed blocks around it, and --update
+ * rewrites an .odz for a new input by copying its unchanged blocks.
+ * --long also finds repeats up to a large window back, across blocks,
+ * and --dedup stores a block equal to an earlier one as a reference.
+ * --filters runs blocks of executables or numeric arrays through an x86
+ * or delta filter first, when a trial on a sample says it helps.
+ * --archive trades speed for size: optimally parsed, range-coded blocks;
+ * --fast-decode goes the other way, with codes short enough for one-lookup
+ * decoding. -T spreads the coding of large blocks over threads.
+ * --patch-from old writes (or, decompressing, applies) a patch: a .odzp
+ * stream whose matches reach back into old.
  *
  * Build: cmake --build . --config Release
  */
@@ -40,9 +60,123 @@ static const char *base_name(const char *path) {
     return p ? p + 1 : path;
 }
 
-static int ends_with_odz(const char *s) {
-    size_t len = strlen(s);
-    return len >= 4 && strcmp(s + len - 4, ".odz") == 0;
+/* File extension per ODZ_FMT_* */
+static const char *const format_ext[] = { ".odz", ".gz", ".zz", ".deflate" };
+static const char *const format_name[] = { "odz", "gzip", "zlib", "deflate" };
+
+/* Patches (--patch-from) */
+static const char patch_ext[] = ".odzp";
+
+static int has_ext(const char *s, const char *ext) {
+    size_t len = strlen(s), el = strlen(ext);
+    return len >= el && strcmp(s + len - el, ext) == 0;
+}
+
+/* Format whose extension s ends with, or -1 */
+static int ext_format(const char *s) {
+    for (int f = 0; f < 4; f++)
+        if (has_ext(s, format_ext[f])) return f;
+    return -1;
+}
+
+/* "65536", "64K", "16M", "1G" → bytes; 0 if malformed */
+static size_t parse_size(const char *s) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) return 0;
+    if (*end == 'K' || *end == 'k') { v <<= 10; end++; }
+    else if (*end == 'M' || *end == 'm') { v <<= 20; end++; }
+    else if (*end == 'G' || *end == 'g') { v <<= 30; end++; }
+    if (*end != '\0') return 0;
+    return (size_t)v;
+}
+
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Key file: 32 raw bytes, or 64 hex digits with an optional trailing newline */
+static void read_key(const char *path, uint8_t key[ODZ_KEY_SIZE]) {
+    uint8_t buf[2 * ODZ_KEY_SIZE + 3];
+    FILE *f = fopen(path, "rb");
+    if (!f) die("cannot open key file");
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    if (n == ODZ_KEY_SIZE) {
+        memcpy(key, buf, ODZ_KEY_SIZE);
+        return;
+    }
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) n--;
+    if (n != 2 * ODZ_KEY_SIZE) die("key file must hold 32 bytes or 64 hex digits");
+    for (int i = 0; i < ODZ_KEY_SIZE; i++) {
+        int hi = hex_digit(buf[2 * i]), lo = hex_digit(buf[2 * i + 1]);
+        if (hi < 0 || lo < 0) die("key file must hold 32 bytes or 64 hex digits");
+        key[i] = (uint8_t)(hi << 4 | lo);
+    }
+}
+
+/* odz --update old.odz input: recompress input into old.odz (or out_path),
+ * copying the blocks of old.odz whose data hasn't changed. Writes a
+ * temporary file and renames it over the target. */
+static int update_main(const char *old_path, const char *in_path,
+                       const char *out_path, int force, int rsyncable, int archive,
+                       int fast_decode, int threads) {
+    if (!out_path) {
+        out_path = old_path;
+    } else if (!force && strcmp(out_path, old_path) != 0 && file_exists(out_path)) {
+        fprintf(stderr, "odz: '%s' already exists (use -f to overwrite)\n", out_path);
+        return 1;
+    }
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+
+    FILE *fold = fopen(old_path, "rb");
+    if (!fold) die("cannot open old compressed file");
+    FILE *fin = fopen(in_path, "rb");
+    if (!fin) die("cannot open input file");
+    FILE *fout = fopen(tmp_path, "wb");
+    if (!fout) die("cannot open output file");
+
+    odz_options_t opts = {
+        .progress = (verbosity >= 1) ? progress_cb : NULL,
+        .rsyncable = rsyncable,
+        .archive = archive,
+        .fast_decode = fast_decode,
+        .threads = threads
+    };
+
+    if (verbosity >= 2)
+        fprintf(stderr, "update %s from %s → %s\n", old_path, in_path, out_path);
+
+    uint64_t reused = 0;
+    int rc = odz_update(fold, fin, fout, &opts, &reused);
+    long in_size = ftell(fin);
+    fclose(fold);
+    fclose(fin);
+    if (fclose(fout) != 0 && rc == ODZ_OK) rc = ODZ_ERR_IO;
+
+    if (verbosity >= 1)
+        fprintf(stderr, "\n");
+
+    if (rc != ODZ_OK) {
+        remove(tmp_path);
+        die(odz_strerror(rc));
+    }
+#ifdef _WIN32
+    remove(out_path);   /* rename() won't replace an existing file */
+#endif
+    if (rename(tmp_path, out_path) != 0) {
+        remove(tmp_path);
+        die("cannot replace output file");
+    }
+
+    if (verbosity >= 2)
+        fprintf(stderr, "  %llu of %ld bytes reused\n", (unsigned long long)reused, in_size);
+    return 0;
 }
 
 static void usage(const char *prog) {
@@ -52,26 +186,71 @@ static void usage(const char *prog) {
         "  %s [options] <input>\n"
         "  %s [options] <input> <output>\n"
         "  %s [options] c <input> <output>\n"
-        "  %s [options] d <input> <output>\n\n"
+        "  %s [options] d <input> <output>\n"
+        "  %s [options] --update <old.odz> <input>\n"
+        "  %s [options] --patch-from <old> <input> [<output>]\n\n"
         "options:\n"
         "  -c              force compress\n"
         "  -d              force decompress\n"
         "  -o, --out FILE  output file\n"
         "  -f, --force     overwrite existing output\n"
+        "  -F, --format FMT\n"
+        "                  odz (default), gzip, zlib or deflate (raw);\n"
+        "                  gzip and zlib are detected when decompressing\n"
+        "  -z, --gzip      same as --format gzip\n"
+        "  -k, --key FILE  encrypt / decrypt with AES-256-GCM; FILE holds\n"
+        "                  32 raw bytes or 64 hex digits (odz format only)\n"
+        "  -B, --block-size N\n"
+        "                  compression block size, a power of two from\n"
+        "                  64K to 64M (default 1M)\n"
+        "  --rsyncable     cut blocks where the content says so, so small\n"
+        "                  edits only change nearby compressed output\n"
+        "  --long[=N]      also match repeats up to N bytes back, across\n"
+        "                  blocks: a power of two from 64K to 1G (default\n"
+        "                  128M); decompressing needs that much memory\n"
+        "  --dedup         store blocks identical to an earlier block of the\n"
+        "                  input as references to it (not with -k)\n"
+        "  --filters       try x86 call/jump and delta filters on every\n"
+        "                  block (executables, numeric arrays)\n"
+        "  --archive       smallest output: optimal parsing and range\n"
+        "                  coding, several times slower both ways\n"
+        "  --fast-decode   codes of at most 11 bits: a little larger, and\n"
+        "                  faster to decompress\n"
+        "  -T, --threads N compress large blocks on N threads\n"
+        "  --patch-from OLD\n"
+        "                  compress to a patch (.odzp) against OLD, an earlier\n"
+        "                  version of the input, or apply such a patch\n"
+        "  -u, --update    rewrite old.odz (or -o FILE) for a new version of\n"
+        "                  its input, copying unchanged blocks instead of\n"
+        "                  compressing them again (best with --rsyncable)\n"
         "  -v0             silent\n"
         "  -v1             progress (default)\n"
         "  -v2             verbose (progress + summary)\n"
         "  -h, --help      show this help\n\n"
         "Auto-detects mode from extension:\n"
         "  file.txt     → compress  → file.txt.odz\n"
-        "  file.txt.odz → decompress → file.txt\n",
-        ODZ_FORMAT_VERSION, prog, prog, prog, prog);
+        "  file.txt.odz → decompress → file.txt\n"
+        "  (likewise .gz, .zz and .deflate; .odzp needs --patch-from)\n",
+        ODZ_FORMAT_VERSION, prog, prog, prog, prog, prog, prog);
 }
 
 int main(int argc, char **argv) {
     int force = 0;
     int mode = 0;   /* 0=auto, 'c'=compress, 'd'=decompress */
     const char *out_path = NULL;
+    size_t block_size = 0;
+    int format = -1;
+    int rsyncable = 0;
+    size_t window_size = 0;
+    int dedup = 0;
+    int filters = 0;
+    int archive = 0;
+    int fast_decode = 0;
+    int threads = 1;
+    int update = 0;
+    const char *patch_path = NULL;
+    const char *key_path = NULL;
+    uint8_t key[ODZ_KEY_SIZE];
     const char *positionals[3];
     int npos = 0;
 
@@ -91,6 +270,45 @@ int main(int argc, char **argv) {
             verbosity = 1;
         } else if (strcmp(a, "-v2") == 0) {
             verbosity = 2;
+        } else if (strcmp(a, "-z") == 0 || strcmp(a, "--gzip") == 0) {
+            format = ODZ_FMT_GZIP;
+        } else if (strcmp(a, "-F") == 0 || strcmp(a, "--format") == 0) {
+            if (++i >= argc) die("missing argument for -F");
+            format = -1;
+            for (int f = 0; f < 4; f++)
+                if (strcmp(argv[i], format_name[f]) == 0) format = f;
+            if (format < 0) die("unknown format");
+        } else if (strcmp(a, "--rsyncable") == 0) {
+            rsyncable = 1;
+        } else if (strcmp(a, "--long") == 0) {
+            window_size = (size_t)1 << 27;
+        } else if (strncmp(a, "--long=", 7) == 0) {
+            window_size = parse_size(a + 7);
+            if (window_size == 0) die("invalid window size");
+        } else if (strcmp(a, "--dedup") == 0) {
+            dedup = 1;
+        } else if (strcmp(a, "--filters") == 0) {
+            filters = 1;
+        } else if (strcmp(a, "--archive") == 0) {
+            archive = 1;
+        } else if (strcmp(a, "--fast-decode") == 0) {
+            fast_decode = 1;
+        } else if (strcmp(a, "-T") == 0 || strcmp(a, "--threads") == 0) {
+            if (++i >= argc) die("missing argument for -T");
+            threads = atoi(argv[i]);
+            if (threads < 1) die("invalid thread count");
+        } else if (strcmp(a, "--patch-from") == 0) {
+            if (++i >= argc) die("missing argument for --patch-from");
+            patch_path = argv[i];
+        } else if (strcmp(a, "-u") == 0 || strcmp(a, "--update") == 0) {
+            update = 1;
+        } else if (strcmp(a, "-k") == 0 || strcmp(a, "--key") == 0) {
+            if (++i >= argc) die("missing argument for -k");
+            key_path = argv[i];
+        } else if (strcmp(a, "-B") == 0 || strcmp(a, "--block-size") == 0) {
+            if (++i >= argc) die("missing argument for -B");
+            block_size = parse_size(argv[i]);
+            if (block_size == 0) die("invalid block size");
         } else if (strcmp(a, "-o") == 0 || strcmp(a, "--out") == 0) {
             if (++i >= argc) die("missing argument for -o");
             out_path = argv[i];
@@ -103,6 +321,16 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (update) {
+        if (npos != 2) { usage(argv[0]); return 2; }
+        if (window_size) die("--long streams can't be updated");
+        if (dedup) die("--dedup streams can't be updated");
+        if (patch_path) die("patches can't be updated");
+        if (filters) die("--filters streams can't be updated");
+        return update_main(positionals[0], positionals[1], out_path, force, rsyncable,
+                           archive, fast_decode, threads);
+    }
+
     /* Parse positional arguments */
     const char *in_path = NULL;
 
@@ -120,18 +348,29 @@ int main(int argc, char **argv) {
     if (!in_path) { usage(argv[0]); return 2; }
 
     /* Auto-detect mode from extension */
+    int in_format = ext_format(in_path);
     if (mode == 0)
-        mode = ends_with_odz(in_path) ? 'd' : 'c';
+        mode = in_format >= 0 || has_ext(in_path, patch_ext) ? 'd' : 'c';
+
+    /* Raw DEFLATE has no header to detect it by; everything else does */
+    if (format < 0)
+        format = (mode == 'd' && in_format == ODZ_FMT_DEFLATE) ? ODZ_FMT_DEFLATE : ODZ_FMT_ODZ;
 
     /* Auto-generate output path in current directory */
     char auto_out[4096];
     if (!out_path) {
         const char *base = base_name(in_path);
         if (mode == 'c') {
-            snprintf(auto_out, sizeof(auto_out), "%s.odz", base);
+            snprintf(auto_out, sizeof(auto_out), "%s%s", base,
+                     patch_path ? patch_ext : format_ext[format]);
         } else {
-            if (ends_with_odz(base)) {
-                size_t len = strlen(base) - 4;
+            int f = ext_format(base);
+            if (has_ext(base, patch_ext)) {
+                size_t len = strlen(base) - strlen(patch_ext);
+                memcpy(auto_out, base, len);
+                auto_out[len] = '\0';
+            } else if (f >= 0) {
+                size_t len = strlen(base) - strlen(format_ext[f]);
                 memcpy(auto_out, base, len);
                 auto_out[len] = '\0';
             } else {
@@ -141,21 +380,41 @@ int main(int argc, char **argv) {
         out_path = auto_out;
     }
 
+    if (key_path) {
+        if (format != ODZ_FMT_ODZ) die("encryption needs the odz format");
+        read_key(key_path, key);
+    }
+    if (patch_path && format != ODZ_FMT_ODZ) die("patches need the odz format");
+    if (patch_path && key_path && mode == 'c') die("patches can't be encrypted");
+
     /* Refuse to overwrite without --force */
     if (!force && file_exists(out_path)) {
         fprintf(stderr, "odz: '%s' already exists (use -f to overwrite)\n", out_path);
         return 1;
     }
 
+    FILE *fref = NULL;
+    if (patch_path && !(fref = fopen(patch_path, "rb"))) die("cannot open patch reference file");
     FILE *fin = fopen(in_path, "rb");
     if (!fin) die("cannot open input file");
 
-    FILE *fout = fopen(out_path, "wb");
+    /* Decompressing dedup streams reads earlier output back */
+    FILE *fout = fopen(out_path, mode == 'd' ? "w+b" : "wb");
     if (!fout) { fclose(fin); die("cannot open output file"); }
 
     odz_options_t opts = {
         .progress = (verbosity >= 1) ? progress_cb : NULL,
-        .userdata = NULL
+        .userdata = NULL,
+        .block_size = block_size,
+        .format = format,
+        .rsyncable = rsyncable,
+        .window_size = window_size,
+        .dedup = dedup,
+        .filters = filters,
+        .archive = archive,
+        .fast_decode = fast_decode,
+        .threads = threads,
+        .key = key_path ? key : NULL
     };
 
     if (verbosity >= 2)
@@ -164,9 +423,10 @@ int main(int argc, char **argv) {
 
     int rc;
     if (mode == 'c')
-        rc = odz_compress(fin, fout, &opts);
+        rc = fref ? odz_patch_create(fref, fin, fout, &opts) : odz_compress(fin, fout, &opts);
     else
-        rc = odz_decompress(fin, fout, &opts);
+        rc = fref ? odz_patch_apply(fref, fin, fout, &opts) : odz_decompress(fin, fout, &opts);
+    if (fref) fclose(fref);
 
     if (verbosity >= 1)
         fprintf(stderr, "\n");
@@ -4,16 +4,110 @@
 #include <stddef.h>
 #include <stdio.h>
 
+#include "libodzip.h"
+
 /* ── Format constants ──────────────────────────────────────── */
-#define ODZ_VERSION     2
+#define ODZ_VERSION     3
 #define ODZ_WINDOW      32768u      /* max back-reference distance */
 #define ODZ_MIN_MATCH   3
 #define ODZ_MAX_MATCH   258
-#define ODZ_BLOCK_SIZE  (1u << 20)  /* 1 MB blocks for streaming */
+#define ODZ_BLOCK_SIZE  (1u << 20)  /* default: 1 MB blocks for streaming */
+
+/* Block size is per stream (v3+): 2^block_log, 64 KB .. 64 MB */
+#define ODZ_MIN_BLOCK_LOG   16
+#define ODZ_MAX_BLOCK_LOG   26
 
-/* Block types (bits 1-2 of block_flags) */
+/* Block types (bits 1-3 of block_flags) */
 #define ODZ_BLOCK_STORED    0
-#define ODZ_BLOCK_HUFFMAN   1
+#define ODZ_BLOCK_HUFFMAN   1   /* dynamic trees + tokens */
+#define ODZ_BLOCK_FIXED     2   /* tokens with the fixed DEFLATE code
+                                 * lengths, over LITLEN_SYMS symbols
+                                 * (huff_fixed_lengths) */
+#define ODZ_BLOCK_REP       3   /* dynamic trees, distance alphabet with
+                                 * repeat-offset codes (lz_tables.h) */
+#define ODZ_BLOCK_COPY      4   /* same data as an earlier block of the
+                                 * frame, named by its number; no payload */
+#define ODZ_BLOCK_ANS       5   /* rep-block symbols coded with tANS:
+                                 * counts, then a backward stream (ans.h) */
+#define ODZ_BLOCK_LZRC      6   /* LZ77 with an optimal parse, range coded
+                                 * with adaptive models (lzrc.h) */
+#define ODZ_BLOCK_EXT       7   /* mode byte of ODZ_EXT_* flags, then the
+                                 * block as they say; readers reject modes
+                                 * they don't know */
+
+/* Extended block modes */
+#define ODZ_EXT_CTX  0x01   /* rep block with a literal/length table per
+                             * context of the byte before (lz_tables.h) */
+#define ODZ_EXT_SEQ  0x02   /* rep-block tokens as two streams: all the
+                             * literals, then (run, length, distance)
+                             * sequences */
+#define ODZ_EXT_LIT4 0x04   /* with ODZ_EXT_SEQ: the literals in four
+                             * streams, after a table of the first three's
+                             * sizes */
+
+/* A stream is a sequence of self-contained frames, so concatenated
+ * streams are a valid stream. Data frame header:
+ *   v2: "ODZ" version(1) original_size(8)                          (1 MB blocks)
+ *   v3: "ODZ" version(1) flags(1) block_log(1) original_size(8)
+ * followed by blocks, the last one flagged. Readers reject unknown flags.
+ * Skippable frame: "ODS" kind(1) size(u32 LE) payload — readers skip it. */
+#define ODZ_HEADER_SIZE_V2    12
+#define ODZ_HEADER_SIZE       14
+#define ODZ_SKIP_HEADER_SIZE  8
+
+/* Encrypted frames (v3 flags bit 0) carry a random nonce prefix after
+ * the header, and every block's data is AES-256-GCM ciphertext followed
+ * by its tag. Block i uses nonce prefix || i (u32 BE) and authenticates
+ * the frame header + its own block header as AAD, so blocks can't be
+ * reordered, dropped or moved between streams. */
+#define ODZ_FLAG_ENCRYPTED    0x01
+#define ODZ_NONCE_PREFIX      8
+#define ODZ_HEADER_SIZE_ENC   (ODZ_HEADER_SIZE + ODZ_NONCE_PREFIX)
+#define ODZ_TAG_SIZE          16
+
+/* Block hashes (flags bit 1): every block header ends with the XXH64 of
+ * the block's raw data, which readers check and --update matches blocks
+ * by. Never set on encrypted frames, where it would leak content.
+ * Bit 2 records that blocks were cut at content-defined points. */
+#define ODZ_FLAG_BLOCK_HASH   0x02
+#define ODZ_FLAG_RSYNCABLE    0x04
+#define ODZ_FLAG_MASK         (ODZ_FLAG_ENCRYPTED | ODZ_FLAG_BLOCK_HASH | ODZ_FLAG_RSYNCABLE | \
+                               ODZ_FLAG_COPIES)
+
+/* Long-distance frames: flags bits 3-6 hold window_log - 15 (0 = off).
+ * Matches may then reach 2^window_log bytes back, past the start of their
+ * block into the frame's earlier output, so its blocks decode in order
+ * and the decoder keeps that much output in memory. Rep-match blocks use
+ * 2 * window_log distance codes (lz_tables.h). */
+#define ODZ_WINDOW_SHIFT      3
+#define ODZ_WINDOW_MASK       0x78
+#define ODZ_MIN_WINDOW_LOG    16
+#define ODZ_MAX_WINDOW_LOG    30
+
+/* Bit 7: the frame may hold copy blocks. Readers that predate them
+ * reject the flag instead of taking a copy block's type for stored.
+ * Never set on encrypted frames, where it would show which blocks are
+ * equal. */
+#define ODZ_FLAG_COPIES       0x80
+
+/* Filtered frames: bit 7 of the block_log byte (which older readers
+ * range-check, so they reject the frame). Bits 4-7 of a coded (not
+ * stored or copy) block's flags then name the filter (filter.h) its data went
+ * through before LZ77, which the reader undoes after decoding. Stored
+ * and copy blocks hold the data as is. Never set on long-distance
+ * frames. */
+#define ODZ_LOG_FILTERS       0x80
+#define ODZ_LOG_MASK          0x1F
+
+/* Patch frame: "ODP" version(1) flags(1) block_log(1) original_size(8)
+ * ref_size(8) ref_crc(4), then blocks as in a v3 frame. It decodes as if
+ * the reference file (ref_size bytes with CRC-32 ref_crc) were the
+ * frame's earlier output, so matches reach back into it. Patch frames
+ * are always long-distance frames and never encrypted. */
+#define ODZ_PATCH_REF_SIZE    12
+
+/* flags(1) raw_size(4) [comp_size(4) | copied block(4)] [hash(8)] */
+#define ODZ_BLOCK_HEADER_MAX  17
 
 /* ── Utilities ─────────────────────────────────────────────── */
 void     wr_u32le(uint8_t *dst, uint32_t x);
@@ -21,4 +115,97 @@ uint32_t rd_u32le(const uint8_t *src);
 void     wr_u64le(uint8_t *dst, uint64_t x);
 uint64_t rd_u64le(const uint8_t *src);
 
+/* Running checksums: start from 0 (crc32) or 1 (adler32) */
+uint32_t odz_crc32(uint32_t crc, const void *buf, size_t n);
+uint32_t odz_adler32(uint32_t adler, const void *buf, size_t n);
+
+/* XXH64 (seed 0) of buf[0..n) */
+uint64_t odz_hash64(const void *buf, size_t n);
+
+/* n bytes from the OS CSPRNG. Returns ODZ_OK or ODZ_ERR_IO. */
+int odz_random(void *buf, size_t n);
+
+/* ── Output sink: a FILE, or a caller-provided buffer ──────── */
+typedef struct {
+    FILE    *f;     /* non-NULL: write to this file */
+    uint8_t *buf;   /* otherwise: write into buf[0..cap) */
+    size_t   cap;
+    size_t   pos;   /* bytes written so far */
+} odz_sink_t;
+
+/* Returns ODZ_OK, ODZ_ERR_IO (file) or ODZ_ERR_SPACE (buffer full) */
+int odz_sink_write(odz_sink_t *s, const void *p, size_t n);
+
+/* Block size requested by opts (ODZ_BLOCK_SIZE when unset), as a log2.
+ * Returns ODZ_OK or ODZ_ERR_PARAM. */
+int odz_block_log(const odz_options_t *opts, int *block_log);
+
+/* Long-distance window requested by opts, as a log2 (0 = off).
+ * Returns ODZ_OK or ODZ_ERR_PARAM. */
+int odz_window_log(const odz_options_t *opts, int *window_log);
+
+/* Bytes of buffer that hold a long-distance frame's window plus a block */
+size_t odz_history_size(int window_log, size_t block_size);
+
+/* Gear rolling-hash table: h = (h << 1) + gear[byte]. The top bits of h
+ * only depend on the last 64 bytes. */
+void odz_gear_init(uint64_t gear[256]);
+
+/* ── Block index of an existing stream (for odz_update) ────── */
+typedef struct {
+    uint64_t hash;      /* XXH64 of the raw data */
+    uint64_t offset;    /* of the block header in the file */
+    uint32_t raw_size;
+    uint32_t len;       /* header + data bytes */
+} odz_block_ref_t;
+
+/* List every block of the odz stream in f (read from its current
+ * position; only headers are read, payloads are seeked over). block_log
+ * and rsyncable describe the first data frame. Returns ODZ_ERR_PARAM if
+ * a frame lacks block hashes (old, encrypted or batch-written streams) or
+ * is a long-distance frame or may hold copy or filtered blocks, whose
+ * blocks can't be moved. */
+int odz_block_index(FILE *f, odz_block_ref_t **refs, size_t *n,
+                    int *block_log, int *rsyncable);
+
+/* ── Reusable contexts (memory-to-memory, used by the batch API) ── */
+/* Buffers grow to the largest block seen and are kept until freed, so a
+ * context amortizes allocation and table setup across many streams. */
+typedef struct odz_cctx odz_cctx_t;
+typedef struct odz_dctx odz_dctx_t;
+
+odz_cctx_t *odz_cctx_new(int block_log);
+void        odz_cctx_free(odz_cctx_t *c);
+/* Encrypt every following stream with this 32-byte key (NULL: stop) */
+int         odz_cctx_set_key(odz_cctx_t *c, const uint8_t *key);
+/* Cut blocks at content-defined points (nonzero) or fixed offsets (0) */
+int         odz_cctx_set_rsyncable(odz_cctx_t *c, int on);
+/* Long-distance matching over a 2^window_log window (0: off) */
+int         odz_cctx_set_window(odz_cctx_t *c, int window_log);
+/* Write blocks identical to an earlier one of the frame as copy blocks */
+int         odz_cctx_set_dedup(odz_cctx_t *c, int on);
+/* Try the filters on every block, keeping the best (not with a window) */
+int         odz_cctx_set_filters(odz_cctx_t *c, int on);
+/* Cap Huffman codes at HUFF_FLAT_BITS, for one-lookup decoding */
+int         odz_cctx_set_fast_decode(odz_cctx_t *c, int on);
+/* Work on large blocks with up to this many threads (1: the calling
+ * thread only): their LZ pass runs in segments, one per thread, which
+ * changes the output a little; their tokens are coded in chunks; and
+ * the next block's LZ pass overlaps the coding of the current one */
+int         odz_cctx_set_threads(odz_cctx_t *c, int threads);
+/* Write every block as a range-coded archival block: smaller, and much
+ * slower to compress and to decode */
+int         odz_cctx_set_archive(odz_cctx_t *c, int on);
+/* Compress src[0..n) as one complete stream into out */
+int         odz_compress_mem(odz_cctx_t *c, const uint8_t *src, size_t n,
+                             odz_sink_t *out);
+
+odz_dctx_t *odz_dctx_new(void);
+void        odz_dctx_free(odz_dctx_t *d);
+/* Key for encrypted streams (NULL: none; they fail with ODZ_ERR_NOKEY) */
+int         odz_dctx_set_key(odz_dctx_t *d, const uint8_t *key);
+/* Decompress one complete stream src[0..n) into out */
+int         odz_decompress_mem(odz_dctx_t *d, const uint8_t *src, size_t n,
+                               odz_sink_t *out);
+
 #endif
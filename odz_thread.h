@@ -0,0 +1,77 @@
+#ifndef ODZ_THREAD_H
+#define ODZ_THREAD_H
+
+/*
+ * Minimal thread / mutex / condition variable wrapper:
+ * Win32 threads on Windows, pthreads everywhere else.
+ *
+ * odz_thread_create returns 0 on success. Callers must cope with failure
+ * (e.g. wasm builds without -pthread) by doing the work themselves.
+ */
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <process.h>
+#include <stdlib.h>
+
+typedef HANDLE             odz_thread_t;
+typedef CRITICAL_SECTION   odz_mutex_t;
+typedef CONDITION_VARIABLE odz_cond_t;
+
+typedef struct { void *(*fn)(void *); void *arg; } odz_thread_start_t;
+
+static inline unsigned __stdcall odz_thread_tramp(void *p) {
+    odz_thread_start_t s = *(odz_thread_start_t *)p;
+    free(p);
+    s.fn(s.arg);
+    return 0;
+}
+
+static inline int odz_thread_create(odz_thread_t *t, void *(*fn)(void *), void *arg) {
+    odz_thread_start_t *s = malloc(sizeof *s);
+    if (!s) return -1;
+    s->fn = fn; s->arg = arg;
+    *t = (HANDLE)_beginthreadex(NULL, 0, odz_thread_tramp, s, 0, NULL);
+    if (!*t) { free(s); return -1; }
+    return 0;
+}
+static inline void odz_thread_join(odz_thread_t t) { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+
+static inline void odz_mutex_init(odz_mutex_t *m)    { InitializeCriticalSection(m); }
+static inline void odz_mutex_destroy(odz_mutex_t *m) { DeleteCriticalSection(m); }
+static inline void odz_mutex_lock(odz_mutex_t *m)    { EnterCriticalSection(m); }
+static inline void odz_mutex_unlock(odz_mutex_t *m)  { LeaveCriticalSection(m); }
+
+static inline void odz_cond_init(odz_cond_t *c)      { InitializeConditionVariable(c); }
+static inline void odz_cond_destroy(odz_cond_t *c)   { (void)c; }
+static inline void odz_cond_wait(odz_cond_t *c, odz_mutex_t *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static inline void odz_cond_signal(odz_cond_t *c)    { WakeConditionVariable(c); }
+static inline void odz_cond_broadcast(odz_cond_t *c) { WakeAllConditionVariable(c); }
+
+#else
+#include <pthread.h>
+
+typedef pthread_t       odz_thread_t;
+typedef pthread_mutex_t odz_mutex_t;
+typedef pthread_cond_t  odz_cond_t;
+
+static inline int  odz_thread_create(odz_thread_t *t, void *(*fn)(void *), void *arg) {
+    return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+}
+static inline void odz_thread_join(odz_thread_t t) { pthread_join(t, NULL); }
+
+static inline void odz_mutex_init(odz_mutex_t *m)    { pthread_mutex_init(m, NULL); }
+static inline void odz_mutex_destroy(odz_mutex_t *m) { pthread_mutex_destroy(m); }
+static inline void odz_mutex_lock(odz_mutex_t *m)    { pthread_mutex_lock(m); }
+static inline void odz_mutex_unlock(odz_mutex_t *m)  { pthread_mutex_unlock(m); }
+
+static inline void odz_cond_init(odz_cond_t *c)      { pthread_cond_init(c, NULL); }
+static inline void odz_cond_destroy(odz_cond_t *c)   { pthread_cond_destroy(c); }
+static inline void odz_cond_wait(odz_cond_t *c, odz_mutex_t *m) { pthread_cond_wait(c, m); }
+static inline void odz_cond_signal(odz_cond_t *c)    { pthread_cond_signal(c); }
+static inline void odz_cond_broadcast(odz_cond_t *c) { pthread_cond_broadcast(c); }
+
+#endif
+
+#endif
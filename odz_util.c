@@ -1,9 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <bcrypt.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "bcrypt")
+#endif
+#endif
 
 #include "odz.h"
 #include "libodzip.h"
+#include "crc32_table.h"
 
 const char *odz_strerror(int err) {
     switch (err) {
@@ -12,6 +23,11 @@ const char *odz_strerror(int err) {
         case ODZ_ERR_OOM:     return "out of memory";
         case ODZ_ERR_FORMAT:  return "invalid format";
         case ODZ_ERR_CORRUPT: return "corrupt data";
+        case ODZ_ERR_SPACE:   return "output buffer too small";
+        case ODZ_ERR_PARAM:   return "invalid parameter";
+        case ODZ_ERR_AUTH:    return "authentication failed (wrong key or tampered data)";
+        case ODZ_ERR_NOKEY:   return "stream is encrypted (key required)";
+        case ODZ_ERR_REF:     return "patch reference file missing or wrong";
         default:              return "unknown error";
     }
 }
@@ -34,3 +50,155 @@ uint64_t rd_u64le(const uint8_t *src) {
 	for (int i = 7; i >= 0; i--) x = (x << 8) | src[i];
 	return x;
 }
+
+int odz_sink_write(odz_sink_t *s, const void *p, size_t n) {
+	if (s->f) {
+		if (fwrite(p, 1, n, s->f) != n) return ODZ_ERR_IO;
+	} else {
+		if (n > s->cap - s->pos) return ODZ_ERR_SPACE;
+		memcpy(s->buf + s->pos, p, n);
+	}
+	s->pos += n;
+	return ODZ_OK;
+}
+
+int odz_block_log(const odz_options_t *opts, int *block_log) {
+	size_t bs = opts && opts->block_size ? opts->block_size : ODZ_BLOCK_SIZE;
+	for (int b = ODZ_MIN_BLOCK_LOG; b <= ODZ_MAX_BLOCK_LOG; b++)
+		if (bs == (size_t)1 << b) { *block_log = b; return ODZ_OK; }
+	return ODZ_ERR_PARAM;
+}
+
+int odz_window_log(const odz_options_t *opts, int *window_log) {
+	size_t ws = opts ? opts->window_size : 0;
+	*window_log = 0;
+	if (ws == 0) return ODZ_OK;
+	for (int w = ODZ_MIN_WINDOW_LOG; w <= ODZ_MAX_WINDOW_LOG; w++)
+		if (ws == (size_t)1 << w) { *window_log = w; return ODZ_OK; }
+	return ODZ_ERR_PARAM;
+}
+
+size_t odz_history_size(int window_log, size_t block_size) {
+	/* A quarter window of slack: sliding the window down then costs at
+	 * most a few bytes moved per byte coded */
+	size_t window = (size_t)1 << window_log;
+	return window + window / 4 + block_size;
+}
+
+void odz_gear_init(uint64_t gear[256]) {
+	uint64_t x = 0;
+	for (int i = 0; i < 256; i++) {     /* splitmix64 */
+		uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* ── Checksums (gzip / zlib trailers) ──────────────────────── */
+
+uint32_t odz_crc32(uint32_t crc, const void *buf, size_t n) {
+	const uint8_t *p = buf;
+	crc = ~crc;
+	/* Slice-by-8: eight table lookups per 8 input bytes */
+	while (n >= 8) {
+		uint32_t lo = crc ^ rd_u32le(p), hi = rd_u32le(p + 4);
+		crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF]
+		    ^ crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24]
+		    ^ crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF]
+		    ^ crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+		p += 8; n -= 8;
+	}
+	while (n--) crc = crc32_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+uint32_t odz_adler32(uint32_t adler, const void *buf, size_t n) {
+	const uint8_t *p = buf;
+	uint32_t a = adler & 0xFFFF, b = adler >> 16;
+	while (n > 0) {
+		/* 5552 is the most bytes that can't overflow b before the modulo */
+		size_t k = n < 5552 ? n : 5552;
+		n -= k;
+		while (k--) { a += *p++; b += a; }
+		a %= 65521; b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+/* ── Block content hash: XXH64, seed 0 ─────────────────────── */
+
+#define XXH_P1 0x9E3779B185EBCA87ull
+#define XXH_P2 0xC2B2AE3D27D4EB4Full
+#define XXH_P3 0x165667B19E3779F9ull
+#define XXH_P4 0x85EBCA77C2B2AE63ull
+#define XXH_P5 0x27D4EB2F165667C5ull
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t xxh_read64(const uint8_t *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t x;
+	memcpy(&x, p, 8);
+	return x;
+#else
+	return rd_u64le(p);
+#endif
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in) {
+	return rotl64(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t v) {
+	return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+uint64_t odz_hash64(const void *buf, size_t n) {
+	const uint8_t *p = buf, *end = p + n;
+	uint64_t h;
+	if (n >= 32) {
+		/* Four independent lanes over 32-byte stripes */
+		uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = 0 - XXH_P1;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh_merge(h, v1); h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3); h = xxh_merge(h, v4);
+	} else {
+		h = XXH_P5;
+	}
+	h += (uint64_t)n;
+
+	for (; end - p >= 8; p += 8)
+		h = rotl64(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+	if (end - p >= 4) {
+		h = rotl64(h ^ (uint64_t)rd_u32le(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+	h ^= h >> 33; h *= XXH_P2;
+	h ^= h >> 29; h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+int odz_random(void *buf, size_t n) {
+#ifdef _WIN32
+	NTSTATUS st = BCryptGenRandom(NULL, buf, (ULONG)n, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+	return st == 0 ? ODZ_OK : ODZ_ERR_IO;
+#else
+	FILE *f = fopen("/dev/urandom", "rb");
+	if (!f) return ODZ_ERR_IO;
+	size_t got = fread(buf, 1, n, f);
+	fclose(f);
+	return got == n ? ODZ_OK : ODZ_ERR_IO;
+#endif
+}
@@ -0,0 +1,173 @@
+// Benchmark worker: loads one wasm build, generates a corpus and times
+// compress/decompress over it. Classic (non-module) worker so the
+// MODULARIZE'd emscripten output can be pulled in with importScripts.
+//
+// main → worker: { type: 'prepare', build: { file, name }, corpus: { kind, size, seed }, iters, threads }
+// worker → main: { type: 'ready' } | { type: 'error', message }
+// main → worker: { type: 'run' }
+// worker → main: { type: 'done', threads, csize, cstart, cend, dstart, dend, ok }
+
+'use strict';
+
+let mod = null;
+let api = null;
+let job = null;
+let corpus = null;
+
+function now() {
+    // comparable across workers (each has its own timeOrigin)
+    return performance.timeOrigin + performance.now();
+}
+
+// Minimal wrapper over the copy-free path (see odzip.js): the input goes
+// straight into the input arena and results are views into the output arena.
+function wrap(Module) {
+    const inReserve = Module.cwrap('odz_wasm_in_reserve', 'number', ['number']);
+    const compress = Module.cwrap('odz_wasm_compress', 'number', ['number', 'number', 'number']);
+    const decompress = Module.cwrap('odz_wasm_decompress', 'number', ['number', 'number']);
+    const strerror = Module.cwrap('odz_wasm_strerror', 'string', ['number']);
+
+    function call(fn, input, ...args) {
+        const ptr = inReserve(input.length);
+        if (!ptr) throw new Error('out of memory');
+        Module.HEAPU8.set(input, ptr);
+        const res = fn(ptr, input.length, ...args);
+        const err = Module.getValue(res, 'i32');
+        if (err !== 0) throw new Error(strerror(err));
+        const data = Module.getValue(res + 4, 'i32');
+        const size = Module.getValue(res + 8, 'i32');
+        return Module.HEAPU8.subarray(data, data + size);
+    }
+
+    return {
+        compress: (input, threads) => call(compress, input, threads),
+        decompress: input => call(decompress, input),
+    };
+}
+
+// ── Corpora ─────────────────────────────────────────────────
+// Deterministic (xorshift32) so every build and browser sees the same bytes.
+
+function rng(seed) {
+    let s = seed >>> 0 || 0x9e3779b9;
+    return () => {
+        s ^= s << 13; s >>>= 0;
+        s ^= s >>> 17;
+        s ^= s << 5; s >>>= 0;
+        return s / 4294967296;
+    };
+}
+
+const WORDS = ('the of and to in is was that for it with as his on be at by had are but from or ' +
+    'have an they which one you were her all she there would their we him been has when who will ' +
+    'more no if out so said what up its about into than them can only other new some could time ' +
+    'these two may then do first any my now such like our over man me even most made after also ' +
+    'compression block window huffman stream buffer decode encode literal match distance length').split(' ');
+
+function fill(kind, size, rand) {
+    const out = new Uint8Array(size);
+    const enc = new TextEncoder();
+    let p = 0;
+    const put = str => {
+        const b = enc.encode(str);
+        const n = Math.min(b.length, size - p);
+        out.set(b.subarray(0, n), p);
+        p += n;
+    };
+    // zipf-ish word choice: squaring skews towards the front of the list
+    const word = () => WORDS[Math.floor(rand() * rand() * WORDS.length)];
+
+    switch (kind) {
+    case 'text':
+        while (p < size) {
+            let line = '';
+            const n = 6 + Math.floor(rand() * 12);
+            for (let i = 0; i < n; i++) line += (i ? ' ' : '') + word();
+            put(line + (rand() < 0.3 ? '.\n\n' : '.\n'));
+        }
+        break;
+    case 'logs': {
+        const lv = ['INFO ', 'INFO ', 'INFO ', 'DEBUG', 'WARN ', 'ERROR'];
+        let t = 1700000000000;
+        while (p < size) {
+            t += Math.floor(rand() * 50);
+            put(`${new Date(t).toISOString()} ${lv[Math.floor(rand() * lv.length)]} ` +
+                `[worker-${Math.floor(rand() * 8)}] ${word()} ${word()} ` +
+                `id=${Math.floor(rand() * 1e8).toString(16)} status=${rand() < 0.9 ? 200 : 500} ` +
+                `bytes=${Math.floor(rand() * 65536)} ms=${(rand() * 200).toFixed(2)}\n`);
+        }
+        break;
+    }
+    case 'csv': {
+        let id = 1, price = 100;
+        put('id,sku,qty,price,flag\n');
+        while (p < size) {
+            price += (rand() - 0.5) * 2;
+            put(`${id++},SKU-${1000 + Math.floor(rand() * 50)},${Math.floor(rand() * 20)},` +
+                `${price.toFixed(2)},${rand() < 0.5 ? 'Y' : 'N'}\n`);
+        }
+        break;
+    }
+    case 'sparse':
+        // mostly zero pages with short noisy records, like a VM image or core dump
+        for (let i = 0; i < size; i++) out[i] = rand() < 0.02 ? Math.floor(rand() * 256) : 0;
+        break;
+    case 'random':
+        for (let i = 0; i < size; i++) out[i] = Math.floor(rand() * 256);
+        break;
+    default:
+        throw new Error('unknown corpus ' + kind);
+    }
+    return out;
+}
+
+// ── Messages ────────────────────────────────────────────────
+
+async function prepare(msg) {
+    job = msg;
+    if (!mod || mod.file !== msg.build.file) {
+        importScripts(msg.build.file);
+        const factory = self[msg.build.name];
+        if (typeof factory !== 'function') throw new Error(msg.build.file + ' did not define ' + msg.build.name);
+        mod = { file: msg.build.file, Module: await factory() };
+        api = wrap(mod.Module);
+    }
+    corpus = fill(msg.corpus.kind, msg.corpus.size, rng(msg.corpus.seed));
+    // warm-up: grows the arenas to size and JITs the hot paths
+    api.decompress(api.compress(corpus, job.threads).slice());
+}
+
+function run() {
+    const { iters, threads } = job;
+    let comp = null;
+
+    const cstart = now();
+    for (let i = 0; i < iters; i++) comp = api.compress(corpus, threads);
+    const cend = now();
+
+    // the view is overwritten by the next call, so keep one copy for decode
+    comp = comp.slice();
+
+    let raw = null;
+    const dstart = now();
+    for (let i = 0; i < iters; i++) raw = api.decompress(comp);
+    const dend = now();
+
+    let ok = raw.length === corpus.length;
+    for (let i = 0; ok && i < raw.length; i++) ok = raw[i] === corpus[i];
+
+    return { type: 'done', threads, csize: comp.length, cstart, cend, dstart, dend, ok };
+}
+
+self.onmessage = async e => {
+    try {
+        if (e.data.type === 'prepare') {
+            await prepare(e.data);
+            self.postMessage({ type: 'ready' });
+        } else if (e.data.type === 'run') {
+            self.postMessage(run());
+        }
+    } catch (err) {
+        self.postMessage({ type: 'error', message: String(err && err.message || err) });
+    }
+};
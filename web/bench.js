@@ -0,0 +1,142 @@
+// Benchmark driver for bench.html. Each (build, corpus, workers) cell spawns
+// that many workers, lets them all load and warm up, then starts them together
+// and measures aggregate throughput across the whole group.
+
+const BUILDS = {
+    scalar: { file: 'odz.js', name: 'OdzipModule' },
+    simd: { file: 'odz-simd.js', name: 'OdzipModuleSimd' },
+    mt: { file: 'odz-mt.js', name: 'OdzipModuleMt' },
+};
+
+const MB = 1 << 20;
+const a = n => document.getElementById(n);
+let results = [];
+
+function checked(name) {
+    return [...document.querySelectorAll(`input[name=${name}]:checked`)].map(e => e.value);
+}
+
+function workerCounts() {
+    const hc = navigator.hardwareConcurrency || 4;
+    return a('workers').value.split(',')
+        .map(s => parseInt(s, 10))
+        .filter(n => n > 0 && n <= hc * 2);
+}
+
+function status(s) { a('st').textContent = s; }
+function err(s) { a('err').textContent = s; a('err').classList.add('on'); }
+
+// Send msg to every worker and resolve once each has answered.
+function all(workers, msg) {
+    return Promise.all(workers.map(w => new Promise((resolve, reject) => {
+        w.onmessage = e => e.data.type === 'error' ? reject(new Error(e.data.message)) : resolve(e.data);
+        w.onerror = e => reject(new Error(e.message || 'worker failed to load'));
+        w.postMessage(msg);
+    })));
+}
+
+// Threads per compress call: only the pthreads build runs them in parallel.
+function threadCount(build) {
+    return build === 'mt' ? Math.max(1, parseInt(a('threads').value, 10) || 1) : 1;
+}
+
+async function cell(build, kind, nworkers, size, iters) {
+    const threads = threadCount(build);
+    const workers = [];
+    for (let i = 0; i < nworkers; i++) workers.push(new Worker('bench-worker.js'));
+    try {
+        await all(workers, { type: 'prepare', build: BUILDS[build], corpus: { kind, size, seed: 1 }, iters, threads });
+        const r = await all(workers, { type: 'run' });
+        if (!r.every(x => x.ok)) throw new Error('roundtrip mismatch');
+
+        // aggregate over the group: total bytes over the span from the first
+        // worker starting to the last one finishing
+        const bytes = size * iters * nworkers;
+        const span = (k0, k1) => (Math.max(...r.map(x => x[k1])) - Math.min(...r.map(x => x[k0]))) / 1e3;
+        return {
+            build, corpus: kind, workers: nworkers, threads: r[0].threads, size, iters,
+            ratio: r[0].csize / size,
+            comp: bytes / MB / span('cstart', 'cend'),
+            decomp: bytes / MB / span('dstart', 'dend'),
+        };
+    } finally {
+        workers.forEach(w => w.terminate());
+    }
+}
+
+function baseline() {
+    try {
+        const b = JSON.parse(a('base').value);
+        return b.results || b;
+    } catch {
+        return [];
+    }
+}
+
+function fmt(v, base) {
+    let s = v.toFixed(1);
+    if (base) {
+        const d = (v / base - 1) * 100;
+        s += ` <span class="${d < -5 ? 'neg' : d > 5 ? 'pos' : 'u'}">${d >= 0 ? '+' : ''}${d.toFixed(0)}%</span>`;
+    }
+    return s;
+}
+
+function row(r, base) {
+    const b = base.find(x => x.build === r.build && x.corpus === r.corpus &&
+                             x.workers === r.workers && (x.threads || 1) === r.threads &&
+                             x.size === r.size);
+    const tr = document.createElement('tr');
+    tr.innerHTML = `<td>${r.build}</td><td>${r.corpus}</td><td>${r.workers}</td><td>${r.threads}</td>` +
+        `<td>${(r.ratio * 100).toFixed(1)}<span class=u>%</span></td>` +
+        `<td>${fmt(r.comp, b && b.comp)}</td><td>${fmt(r.decomp, b && b.decomp)}</td>`;
+    a('out').querySelector('tbody').appendChild(tr);
+}
+
+async function run() {
+    a('go').disabled = true;
+    a('err').classList.remove('on');
+    a('out').querySelector('tbody').innerHTML = '';
+    results = [];
+
+    const size = parseInt(a('size').value, 10) * MB;
+    const iters = Math.max(1, parseInt(a('iters').value, 10) || 1);
+    const base = baseline();
+
+    let builds = checked('build');
+    if (builds.includes('mt') && !self.crossOriginIsolated) {
+        // SharedArrayBuffer is only available with COOP/COEP headers
+        err('threaded build skipped: page is not cross-origin isolated');
+        builds = builds.filter(b => b !== 'mt');
+    }
+
+    next: for (const build of builds) {
+        for (const kind of checked('corpus')) {
+            for (const n of workerCounts()) {
+                status(`${build} / ${kind} / ${n} worker${n > 1 ? 's' : ''}...`);
+                try {
+                    const r = await cell(build, kind, n, size, iters);
+                    results.push(r);
+                    row(r, base);
+                } catch (e) {
+                    err(`${build}: ${e.message} (is ${BUILDS[build].file} built?)`);
+                    continue next;
+                }
+            }
+        }
+    }
+    status('done');
+    a('go').disabled = false;
+}
+
+a('go').onclick = run;
+a('json').onclick = () => {
+    const doc = {
+        ua: navigator.userAgent,
+        cores: navigator.hardwareConcurrency,
+        date: new Date().toISOString(),
+        results,
+    };
+    navigator.clipboard.writeText(JSON.stringify(doc, null, 1));
+    status('copied');
+};
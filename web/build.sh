@@ -1,26 +1,54 @@
 #!/bin/sh
+# usage: ./build.sh [scalar|simd|mt|all]   (default: scalar)
+#   scalar → odz.js       (OdzipModule)
+#   simd   → odz-simd.js  (OdzipModuleSimd, wasm simd128)
+#   mt     → odz-mt.js    (OdzipModuleMt, pthreads for compress's threads argument;
+#                          needs cross-origin isolation)
 set -e
 
 SRCDIR="$(cd "$(dirname "$0")/.." && pwd)"
 OUTDIR="$(cd "$(dirname "$0")" && pwd)"
 
-emcc \
-    -O2 -flto \
-    -s EXPORTED_FUNCTIONS='["_odz_wasm_compress","_odz_wasm_decompress","_odz_wasm_strerror","_odz_wasm_free","_malloc","_free"]' \
-    -s EXPORTED_RUNTIME_METHODS='["ccall","cwrap","getValue","UTF8ToString","HEAPU8"]' \
-    -s ALLOW_MEMORY_GROWTH=1 \
-    -s MAXIMUM_MEMORY=512MB \
-    -s MODULARIZE=1 \
-    -s EXPORT_NAME=OdzipModule \
-    -s ENVIRONMENT=web \
-    -I"$SRCDIR" \
-    "$SRCDIR/odz_util.c" \
-    "$SRCDIR/bitstream.c" \
-    "$SRCDIR/huffman.c" \
-    "$SRCDIR/lz_hashchain.c" \
-    "$SRCDIR/compress.c" \
-    "$SRCDIR/decompress.c" \
-    "$OUTDIR/wasm.c" \
-    -o "$OUTDIR/odz.js"
+build() {
+    out="$1"; name="$2"; shift 2
+    emcc \
+        -O2 -flto \
+        "$@" \
+        -s EXPORTED_FUNCTIONS='["_odz_wasm_compress","_odz_wasm_decompress","_odz_wasm_strerror","_odz_wasm_in_reserve","_odz_wasm_reserve","_odz_wasm_release","_malloc","_free"]' \
+        -s EXPORTED_RUNTIME_METHODS='["ccall","cwrap","getValue","UTF8ToString","HEAPU8"]' \
+        -s ALLOW_MEMORY_GROWTH=1 \
+        -s MAXIMUM_MEMORY=512MB \
+        -s MODULARIZE=1 \
+        -s EXPORT_NAME="$name" \
+        -s ENVIRONMENT=web,worker \
+        -I"$SRCDIR" \
+        "$SRCDIR/odz_util.c" \
+        "$SRCDIR/bitstream.c" \
+        "$SRCDIR/huffman.c" \
+        "$SRCDIR/ans.c" \
+        "$SRCDIR/lz_hashchain.c" \
+        "$SRCDIR/lz_long.c" \
+        "$SRCDIR/lzrc.c" \
+        "$SRCDIR/filter.c" \
+        "$SRCDIR/compress.c" \
+        "$SRCDIR/decompress.c" \
+        "$SRCDIR/batch.c" \
+        "$SRCDIR/aes_gcm.c" \
+        "$OUTDIR/wasm.c" \
+        -o "$OUTDIR/$out"
+    echo "built $out"
+}
+
+scalar() { build odz.js OdzipModule; }
+simd()   { build odz-simd.js OdzipModuleSimd -msimd128; }
+mt()     { build odz-mt.js OdzipModuleMt -msimd128 -pthread -s PTHREAD_POOL_SIZE=navigator.hardwareConcurrency; }
+
+case "${1:-scalar}" in
+    scalar) scalar ;;
+    simd)   simd ;;
+    mt)     mt ;;
+    all)    scalar; simd; mt ;;
+    *)      echo "usage: $0 [scalar|simd|mt|all]" >&2; exit 2 ;;
+esac
 
 echo "done"
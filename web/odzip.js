@@ -1,17 +1,29 @@
-export default async function Odzip() {
+const ODZ_ERR_OOM = 2;
+
+// threads: how many threads compress splits each block over. Only the
+// pthreads build (odz-mt.js) actually runs them in parallel.
+export default async function Odzip({ threads = 1 } = {}) {
     const Module = await OdzipModule();
 
-    const _compress = Module.cwrap('odz_wasm_compress', 'number', ['number', 'number']);
+    const _compress = Module.cwrap('odz_wasm_compress', 'number', ['number', 'number', 'number']);
     const _decompress = Module.cwrap('odz_wasm_decompress', 'number', ['number', 'number']);
     const _strerror = Module.cwrap('odz_wasm_strerror', 'string', ['number']);
-    const _free = Module.cwrap('odz_wasm_free', null, ['number']);
+    const _inReserve = Module.cwrap('odz_wasm_in_reserve', 'number', ['number']);
+    const _reserve = Module.cwrap('odz_wasm_reserve', 'number', ['number', 'number']);
+    const _release = Module.cwrap('odz_wasm_release', null, []);
 
-    function call(fn, input) {
-        const ptr = Module._malloc(input.length);
+    // Runs fn over input and returns a view into the module's output arena.
+    // Input is written straight into the persistent input arena; nothing is
+    // malloc'd or freed per call. HEAPU8 is re-read after every call into
+    // wasm because memory growth replaces the underlying buffer.
+    function call(fn, input, ...args) {
+        const ptr = _inReserve(input.length);
+        if (!ptr) {
+            throw new Error(_strerror(ODZ_ERR_OOM));
+        }
         Module.HEAPU8.set(input, ptr);
 
-        const resPtr = fn(ptr, input.length);
-        Module._free(ptr);
+        const resPtr = fn(ptr, input.length, ...args);
 
         const err = Module.getValue(resPtr, 'i32');
         const data = Module.getValue(resPtr + 4, 'i32');
@@ -21,25 +33,52 @@ export default async function Odzip() {
             throw new Error(_strerror(err));
         }
 
-        const out = new Uint8Array(size);
-        out.set(Module.HEAPU8.subarray(data, data + size));
-        _free(data);
-        return out;
+        return Module.HEAPU8.subarray(data, data + size);
+    }
+
+    function check(input) {
+        if (!(input instanceof Uint8Array)) {
+            throw new TypeError('uint8arr');
+        }
     }
 
     return {
+        // Owned results: one copy out of the heap into a fresh buffer,
+        // which the caller may keep or transfer (postMessage) freely.
         compress(input) {
-            if (!(input instanceof Uint8Array)) {
-                throw new TypeError('uint8arr');
-            }
-            return call(_compress, input);
+            check(input);
+            return call(_compress, input, threads).slice();
         },
         decompress(input) {
-            if (!(input instanceof Uint8Array)) {
-                throw new TypeError('uint8arr');
-            }
+            check(input);
+            return call(_decompress, input).slice();
+        },
+
+        // Copy-free results: a view straight into the output arena. Consume
+        // it (hash it, hand it to Blob/fetch/WebSocket.send, write it into
+        // your own buffer...) before the next compress/decompress call,
+        // which overwrites it. Don't keep references to it.
+        compressView(input) {
+            check(input);
+            return call(_compress, input, threads);
+        },
+        decompressView(input) {
+            check(input);
             return call(_decompress, input);
         },
+
+        // Pre-size the arenas for the largest expected input/output so
+        // later calls never grow wasm memory.
+        reserve(inBytes, outBytes) {
+            const err = _reserve(inBytes, outBytes);
+            if (err !== 0) {
+                throw new Error(_strerror(err));
+            }
+        },
+        // Give the arenas back to the allocator (e.g. after a big one-off job).
+        release() {
+            _release();
+        },
         strerror: _strerror,
     };
-}
\ No newline at end of file
+}
@@ -1,93 +1,145 @@
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
 #include <emscripten.h>
 
 #include "libodzip.h"
+#include "odz.h"
 typedef uint8_t uint8; typedef uint64_t uint64; typedef size_t size;
 typedef struct __zip_inst {
-    int err;      
-    void* data;     
-    size size;     
+    int err;
+    void* data;
+    size size;
 } zip_instance;
 
 static zip_instance res;
 
+/* persistent heap arenas, reused across calls.
+ * they only ever grow (geometrically), so after the first few calls the
+ * wasm memory stops growing and js views onto HEAPU8 stay attached. */
+typedef struct {
+    uint8* buf;
+    size cap;
+} arena;
+
+static arena in_arena, out_arena;
+
+// contexts too: their buffers grow to the largest block seen and stay
+static odz_cctx_t* cctx;
+static int cctx_threads = 1;
+static odz_dctx_t* dctx;
+
+static int arena_reserve (arena* a, size need)
+{
+    if (need <= a->cap) return 0;
+    size cap = a->cap ? a->cap : (size)64 << 10;
+    while (cap < need) cap *= 2;
+    // contents don't need preserving, so free first and keep peak heap down
+    free(a->buf);
+    a->buf = malloc(cap);
+    if (!a->buf) { a->cap = 0; return -1; }
+    a->cap = cap;
+    return 0;
+}
+
+// js writes its input straight into the returned pointer, then calls
+// odz_wasm_compress/decompress with it. valid until the next reserve.
 EMSCRIPTEN_KEEPALIVE
-zip_instance* odz_wasm_compress (const uint8* in, size in_len) 
+uint8* odz_wasm_in_reserve (size n)
+{
+    if (arena_reserve(&in_arena, n ? n : 1) != 0) return NULL;
+    return in_arena.buf;
+}
+
+// pre-size both arenas up front (e.g. for the largest expected message)
+// so no later call has to grow memory. returns 0 or ODZ_ERR_OOM.
+EMSCRIPTEN_KEEPALIVE
+int odz_wasm_reserve (size in_cap, size out_cap)
+{
+    if (arena_reserve(&in_arena, in_cap) != 0) return ODZ_ERR_OOM;
+    if (arena_reserve(&out_arena, out_cap) != 0) return ODZ_ERR_OOM;
+    return ODZ_OK;
+}
+
+// hand the arenas back to the allocator
+EMSCRIPTEN_KEEPALIVE
+void odz_wasm_release (void)
+{
+    free(in_arena.buf);
+    free(out_arena.buf);
+    in_arena.buf = out_arena.buf = NULL;
+    in_arena.cap = out_arena.cap = 0;
+    odz_cctx_free(cctx);
+    odz_dctx_free(dctx);
+    cctx = NULL;
+    dctx = NULL;
+    cctx_threads = 1;
+}
+
+// results point into the output arena: they're owned by the module and
+// only valid until the next compress/decompress call (don't free them).
+// threads > 1 splits each block's parsing and coding over that many
+// threads (the pthreads build; elsewhere it just runs them in turn).
+EMSCRIPTEN_KEEPALIVE
+zip_instance* odz_wasm_compress (const uint8* in, size in_len, int threads)
 {
     res.err = 0;
     res.data = NULL;
     res.size = 0;
 
-    FILE* fin = fmemopen((void *)in, in_len, "rb");
-    if (!fin) { res.err = ODZ_ERR_IO; return &res; }
-   
-    // maybe
-    size cap = in_len + in_len/4+4096;
-    uint8* obuf = malloc(cap);
-    if (!obuf) { fclose(fin); res.err = ODZ_ERR_OOM; return &res; }
-    FILE* fout = fmemopen(obuf, cap, "wb");
-
-    if (!fout) { fclose(fin); free(obuf); res.err = ODZ_ERR_IO; return &res; }
-    // int odz_compress(FILE *in, FILE *out, const odz_options_t *opts)
-    int rc = odz_compress(fin, fout, NULL);
-    long written = ftell(fout);
-    fclose(fin);
-    fclose(fout);
-
-    if (rc != ODZ_OK || written < 0) {
-        free(obuf);
-        res.err = rc ? rc : -1;
-        // res.err = (rc != NULL) ? rc : ODZ_ERR_IO;
+    size cap = odz_compress_bound(in_len);
+    if (arena_reserve(&out_arena, cap) != 0) { res.err = ODZ_ERR_OOM; return &res; }
+    if (!cctx) {
+        int block_log;
+        odz_block_log(NULL, &block_log);
+        if (!(cctx = odz_cctx_new(block_log))) { res.err = ODZ_ERR_OOM; return &res; }
+    }
+    // only on a change: it drops the per-thread buffers
+    if (threads < 1) threads = 1;
+    if (threads != cctx_threads) {
+        int rc = odz_cctx_set_threads(cctx, threads);
+        if (rc != ODZ_OK) { cctx_threads = 1; res.err = rc; return &res; }
+        cctx_threads = threads;
+    }
+
+    // compressed straight into the arena, as the batch calls do
+    odz_sink_t sink = { .buf = out_arena.buf, .cap = cap };
+    int rc = odz_compress_mem(cctx, in, in_len, &sink);
+    if (rc != ODZ_OK) {
+        res.err = rc;
         return &res;
     }
-    res.data = obuf;
-    res.size = (size) written;
+    res.data = out_arena.buf;
+    res.size = sink.pos;
     return &res;
 }
 
 EMSCRIPTEN_KEEPALIVE
-zip_instance* odz_wasm_decompress (const uint8* in, size in_len) 
+zip_instance* odz_wasm_decompress (const uint8* in, size in_len)
 {
     res.err  = 0;
     res.data = NULL;
     res.size = 0;
     // if magic byte nothere duh
-    if (in_len < 12) { res.err = ODZ_ERR_FORMAT; return &res; }
-    if (in[0] != 'O' || in[1] != 'D' || in[2] != 'Z') {
-        res.err = ODZ_ERR_FORMAT;
-        return &res;
-    }
-
     uint64 orig = 0;
-    for (int i = 0; i < 8; i++) orig |= (uint64)in[4 + i] << (8 * i);
+    int herr = odz_decompressed_size(in, in_len, &orig);
+    if (herr != ODZ_OK) { res.err = herr; return &res; }
 
     if (orig > (256u << 20)) { res.err = ODZ_ERR_OOM; return &res; }
 
-    FILE* fin = fmemopen((void *)in, in_len, "rb");
-    if (!fin) { res.err = ODZ_ERR_IO; return &res; }
-
-    size out_cap = (size)orig;
-    // whatever dude
-    uint8* obuf = (uint8*)malloc(out_cap);
-    if (!obuf) { fclose(fin); res.err = ODZ_ERR_OOM; return &res; }
-
-    FILE* fout = fmemopen(obuf, out_cap, "wb");
-    if (!fout) { fclose(fin); free(obuf); res.err = ODZ_ERR_IO; return &res; }
-
-    int rc = odz_decompress(fin, fout, NULL);
-    fclose(fin);
-    fclose(fout);
+    if (arena_reserve(&out_arena, orig ? (size)orig : 1) != 0) { res.err = ODZ_ERR_OOM; return &res; }
+    if (!dctx && !(dctx = odz_dctx_new())) { res.err = ODZ_ERR_OOM; return &res; }
 
+    // decoded straight into the arena, so copy blocks (--dedup) are
+    // memcpy'd from the output before them
+    odz_sink_t sink = { .buf = out_arena.buf, .cap = (size)orig };
+    int rc = odz_decompress_mem(dctx, in, in_len, &sink);
     if (rc != ODZ_OK) {
-        free(obuf);
         res.err = rc;
         return &res;
     }
 
-    res.data = obuf;
-    res.size = (size)orig;
+    res.data = out_arena.buf;
+    res.size = sink.pos;
     return &res;
 }
 
@@ -96,9 +148,3 @@ const char* odz_wasm_strerror (int err)
 {
     return odz_strerror(err);
 }
-
-EMSCRIPTEN_KEEPALIVE
-void odz_wasm_free (void* ptr)
-{
-    free(ptr);
-}